@@ -29,6 +29,7 @@
 
 #import "corelib/ItemData.h"
 #import "corelib/PWSfile.h"
+#import "corelib/PWSJournal.h"
 
 //------------------------------------------------------------------------------------
 // Notifications
@@ -42,7 +43,7 @@ extern NSString *iPWSDatabaseEntryModelChangedNotification;
 // Class: iPWSDatabaseEntryModel
 // Description:
 //  Represents a single entry in the password safe database.  This is backed by the C-library version which
-//  stores the data encrypted in memory.  The entry is capable of writing itself to a given file.
+//  stores the data encrypted in memory.  The entry is capable of writing itself to a given file or journal.
 @interface iPWSDatabaseEntryModel : NSObject {
     CItemData data;
 }
@@ -56,9 +57,11 @@ extern NSString *iPWSDatabaseEntryModelChangedNotification;
 @property (readonly) NSString* accessTime;
 @property (readonly) NSString* creationTime;
 @property (readonly) NSString* passwordExpiryTime;
+@property (readonly) const CItemData *dataPtr;
 
 + (id)entryModelWithItemData:(const CItemData *)theData;
 - (id)initWithItemData:(const CItemData *)theData;
 - (BOOL)writeToPWSfile:(PWSfile *)pwsFileHandle;
+- (BOOL)writeToPWSJournal:(PWSJournal *)journal op:(PWSJournal::Op)op;
 
 @end
@@ -109,6 +109,7 @@ extern NSString* iPWSDatabaseFactoryNewModelNameUserInfoKey;
 // File-based helpers
 - (BOOL)doesFileNameExist:(NSString *)fileName;
 - (NSString *)databasePathForFileName:(NSString *)fileName;
+- (BOOL)isAuxiliaryFileName:(NSString *)fileName;
 
 // Accessing the database models
 - (iPWSDatabaseModel *)openDatabaseModelNamed:(NSString *)friendlyName 
@@ -116,8 +117,23 @@ extern NSString* iPWSDatabaseFactoryNewModelNameUserInfoKey;
                                      errorMsg:(NSError **)errorMsg;
 - (iPWSDatabaseModel *)getOpenedDatabaseModelNamed:(NSString *)friendlyName 
                                           errorMsg:(NSError **)errorMsg;
-- (void)closeDatabaseModelNamed:(NSString *)friendlyName;
-- (void)closeAllDatabaseModels;
+// Closing a model first folds its journaled changes into its file.  The model is closed even if that fails (the
+// changes are replayed when the database is next opened), but NO is returned with the reason
+- (BOOL)closeDatabaseModelNamed:(NSString *)friendlyName errorMsg:(NSError **)errorMsg;
+- (BOOL)closeAllDatabaseModels:(NSError **)errorMsg;
+
+// Fold every open model's journaled changes into its file, so that the files shared with iTunes are up to date
+- (BOOL)compactAllDatabaseModels:(NSError **)errorMsg;
+
+// Reads only the header of a database (name, description, when and by whom it was last saved), without
+// opening a model or decrypting any entries, e.g. for an overview of the known databases.  numEntries,
+// if not NULL, is set to the number of entries as of the last save, or to -1 if it was last saved by an
+// application that does not record it or has journaled changes since.
+- (BOOL)peekDatabaseNamed:(NSString *)friendlyName
+               passphrase:(NSString *)passphrase
+                   header:(PWSfileHeader *)header
+               numEntries:(NSInteger *)numEntries
+                 errorMsg:(NSError **)errorMsg;
 
 // Modifing the known databases
 - (BOOL)addDatabaseNamed:(NSString *)friendlyName 
@@ -43,9 +43,14 @@ extern NSString* iPWSDatabaseModelChangedEntryUserInfoKey;
 //------------------------------------------------------------------------------------
 // Class: iPWSDatabaseModel
 // Description:
-//  Each iPWSDatabaseModel represents a single, password-validated PasswordSafe database.  The underlying file that
-//  stores the database is opened, completely re-written, and closed each time a change is made to the database
-//  due to the API exposed by the underlying C model, but that is not reflected in this class.
+//  Each iPWSDatabaseModel represents a single, password-validated PasswordSafe database.  Each change made to an
+//  entry is appended to a journal kept beside the database file (V3 and later), which is replayed when the database
+//  is opened.  The journal is folded back into the file, which is then completely re-written, when the journal grows
+//  large or the passphrase changes, and whenever compact is called (the factory does so when it closes the model).
+//  A model that is released without compacting leaves its journal to be replayed when the file is next opened.
+//  The key stretching (hash iteration) count of an existing database is kept on every re-write.  New databases
+//  and new passphrases get as many iterations as this device can do in DEFAULT_UNLOCK_MILLISECONDS.  The passphrase
+//  is stretched once when the database is opened, and the result (kept in locked memory) is reused by every re-write.
 //
 @interface iPWSDatabaseModel : NSObject {
     NSMutableArray        *entries;
@@ -55,6 +60,9 @@ extern NSString* iPWSDatabaseModelChangedEntryUserInfoKey;
     PWSfileHeader          headerRecord;
     PWSfile               *pwsFileHandle;
     NSError               *lastError;
+    NSUInteger             journalEntries;
+    uint32                 hashIters;
+    PWSfile::StretchedKey *stretchedKey;
 }
 
 // Class methods
@@ -87,4 +95,8 @@ extern NSString* iPWSDatabaseModelChangedEntryUserInfoKey;
 // Passphrase changes
 - (BOOL)changePassphrase:(NSString *)newPassphrase;
 
+// Fold any journaled changes into the database file.  This must be done before the file is used directly (e.g.,
+// copied or uploaded).  Returns NO if the file could not be re-written, in which case the journal is kept
+- (BOOL)compact;
+
 @end
@@ -63,6 +63,8 @@ NSString *iPWSDatabaseEntryModelChangedNotification = @"iPWSDatabaseEntryModelCh
 - (id)initWithItemData:(const CItemData *)theData {
     if (self = [super init]) {
         data = *theData;
+        // Changes are journaled by UUID, so every entry needs one
+        if (!data.HasUUID()) data.CreateUUID();
     }
     
     return self;
@@ -98,6 +100,10 @@ NSString *iPWSDatabaseEntryModelChangedNotification = @"iPWSDatabaseEntryModelCh
     return !pwsFileHandle->WriteRecord(data);
 }
 
+- (BOOL)writeToPWSJournal:(PWSJournal *)journal op:(PWSJournal::Op)op {
+    return !journal->WriteEntry(op, data);
+}
+
 
 //------------------------------------------------------------------------------------
 // Private interface
@@ -28,8 +28,10 @@
 
 #import "iPWSDatabaseFactory.h"
 #import "corelib/ItemData.h"
+#import "corelib/PWSJournal.h"
 #import "DismissAlertView.h"
 #import "iPWSMacros.h"
+#import "NSString+CppStringAdditions.h"
 
 //------------------------------------------------------------------------------------
 // Class: iPWSDatabaseFactory
@@ -49,6 +51,8 @@
 @interface iPWSDatabaseFactory () 
 - (void)synchronizeUserDefaults;
 - (NSError *)errorWithStr:(NSString *)errorStr;
+- (BOOL)compactModel:(iPWSDatabaseModel *)model errorMsg:(NSError **)errorMsg;
+- (void)discardDatabaseModelNamed:(NSString *)friendlyName;
 
 // ---- Change management
 - (void)notifyModelAdded:(NSString *)friendlyName;
@@ -176,6 +180,17 @@ static NSString *PWSDatabaseFactoryMissingSafesMessage =
     return [documentsDirectory stringByAppendingPathComponent:fileName];
 }
 
+// Files kept beside a database rather than databases themselves: its journal (<db>.jnl) and the temporaries that
+// saving and opening it create (<db>.XXXXXX, see pws_os::FOpenTemp)
+- (BOOL)isAuxiliaryFileName:(NSString *)fileName {
+    NSString *base = [fileName stringByDeletingPathExtension];
+    if ([fileName isEqualToString:[NSString stringWithwstring:PWSJournal::JournalName([base getStringX]).c_str()]]) {
+        return YES;
+    }
+    return ([[fileName pathExtension] length] == 6) &&
+           ([self doesFileNameExist:base] || [self isFileNameMapped:base]);
+}
+
 // The full path, including filename, for the given friendly name
 - (NSString *)databasePathForName:(NSString *)friendlyName {
     return [self databasePathForFileName:[friendlyNameToFilename objectForKey:friendlyName]];
@@ -249,18 +264,73 @@ static NSString *PWSDatabaseFactoryMissingSafesMessage =
     return model;
 }
 
-// Close the database model by removing it from memory.
-- (void)closeDatabaseModelNamed:(NSString *)friendlyName {
-    [openDatabaseModels removeObjectForKey:friendlyName];
-    [self notifyModelClosed:friendlyName];
+// Read the header of a database without opening it.  An opened model already has its header and entries,
+// otherwise PWSfile::PeekHeader reads up to the end of the header, which only costs the key stretch.  The number
+// of entries is as of the last save (-1 if the file was last saved by another application, or if entries may have
+// been added or deleted in its journal since)
+- (BOOL)peekDatabaseNamed:(NSString *)friendlyName
+               passphrase:(NSString *)passphrase
+                   header:(PWSfileHeader *)header
+               numEntries:(NSInteger *)numEntries
+                 errorMsg:(NSError **)errorMsg {
+    // Sanity checks
+    if (![self doesFriendlyNameExist:friendlyName]) {
+        SET_ERROR(errorMsg, 
+                  ([self errorWithStr:[NSString stringWithFormat:@"Database \"%@\" does not exist", friendlyName]]));
+        return NO;
+    }
+    
+    iPWSDatabaseModel *model = [openDatabaseModels objectForKey:friendlyName];
+    if (model) {
+        *header = *model.headerRecord;
+        if (numEntries) *numEntries = [model.entries count];
+        return YES;
+    }
+    
+    StringX filePath = [[self databasePathForName:friendlyName] getStringX];
+    int status = PWSfile::PeekHeader(filePath, [passphrase getStringX], *header);
+    if (PWSfile::SUCCESS != status) {
+        NSString *reason;
+        switch (status) {
+            case PWSfile::WRONG_PASSWORD:      reason = @"The passphrase is incorrect"; break;
+            case PWSfile::NOT_PWS3_FILE:       reason = @"The file is not a PasswordSafe database"; break;
+            case PWSfile::UNSUPPORTED_VERSION: reason = @"The version of the database is not supported"; break;
+            default:                           reason = @"The database header could not be read"; break;
+        }
+        SET_ERROR(errorMsg,
+                  ([self errorWithStr:[NSString stringWithFormat:@"Database \"%@\": %@", friendlyName, reason]]));
+        return NO;
+    }
+    if (PWSJournal::Exists(filePath)) header->m_nRecords = -1;
+    if (numEntries) *numEntries = header->m_nRecords;
+    return YES;
+}
+
+// Close the database model by removing it from memory, once its journaled changes are in its file
+- (BOOL)closeDatabaseModelNamed:(NSString *)friendlyName errorMsg:(NSError **)errorMsg {
+    iPWSDatabaseModel *model = [openDatabaseModels objectForKey:friendlyName];
+    BOOL success = !model || [self compactModel:model errorMsg:errorMsg];
+    [self discardDatabaseModelNamed:friendlyName];
+    return success;
 }
 
-// Close all of the open models - useful for locking all databases
-- (void)closeAllDatabaseModels {
+// Close all of the open models - useful for locking all databases.  Reports the first model that failed to compact
+- (BOOL)closeAllDatabaseModels:(NSError **)errorMsg {
+    BOOL success = [self compactAllDatabaseModels:errorMsg];
     [[openDatabaseModels allKeys] enumerateObjectsUsingBlock:^(id name, NSUInteger idx, BOOL *stop) {
         [self notifyModelClosed:name]; 
     }];
     [openDatabaseModels removeAllObjects];
+    return success;
+}
+
+// Compact all of the open models, e.g. when the application resigns active.  Reports the first that failed
+- (BOOL)compactAllDatabaseModels:(NSError **)errorMsg {
+    __block BOOL success = YES;
+    [openDatabaseModels enumerateKeysAndObjectsUsingBlock:^(id name, id model, BOOL *stop) {
+        if (![self compactModel:model errorMsg:(success ? errorMsg : NULL)]) success = NO;
+    }];
+    return success;
 }
 
 //------------------------------------------------------------------------------------
@@ -341,12 +411,17 @@ static NSString *PWSDatabaseFactoryMissingSafesMessage =
         return NO;
     }
 
-    // Remove the file and any mappings
+    // Close the model first, so that nothing writes to the file once it is gone.  A preserved file keeps the model's
+    // latest changes (in its journal, should compacting fail); a removed one takes its journal with it
     BOOL preserveFiles = [[NSUserDefaults standardUserDefaults] boolForKey:@"preserve_files_on_delete"];
-    if (!preserveFiles) {
-        [[NSFileManager defaultManager] removeItemAtPath:[self databasePathForName:friendlyName] error:NULL];
+    if (preserveFiles) {
+        [self closeDatabaseModelNamed:friendlyName errorMsg:NULL];
+    } else {
+        NSString *filePath = [self databasePathForName:friendlyName];
+        [self discardDatabaseModelNamed:friendlyName];
+        [[NSFileManager defaultManager] removeItemAtPath:filePath error:NULL];
+        PWSJournal::Remove([filePath getStringX]);
     }
-    [self closeDatabaseModelNamed:friendlyName];
     [friendlyNameToFilename removeObjectForKey:friendlyName];
 
     // Synchronize and notify
@@ -370,7 +445,8 @@ static NSString *PWSDatabaseFactoryMissingSafesMessage =
     iPWSDatabaseModel *origModel = [self getOpenedDatabaseModelNamed:origFriendlyName errorMsg:errorMsg];
     if (!origModel) return NO;
     
-    // Copy the database file
+    // Copy the database file, which must first include any journaled changes
+    if (![self compactModel:origModel errorMsg:errorMsg]) return NO;
     NSString* newFileName = [self createUniqueFilenameWithPrefix:newFriendlyName];
     if (![[NSFileManager defaultManager] copyItemAtPath:[self databasePathForName:origFriendlyName]
                                                  toPath:[self databasePathForFileName:newFileName] 
@@ -389,6 +465,11 @@ static NSString *PWSDatabaseFactoryMissingSafesMessage =
 - (BOOL)replaceExistingModel:(iPWSDatabaseModel *)modelToBeReplaced 
            withUnmappedModel:(iPWSDatabaseModel *)newModel 
                     errorMsg:(NSError **)errorMsg {
+    // Both files are moved without their journals, so they must first include any journaled changes
+    if (![self compactModel:modelToBeReplaced errorMsg:errorMsg] || ![self compactModel:newModel errorMsg:errorMsg]) {
+        return NO;
+    }
+    
     // First, duplicate the to-be-replaced model into a temporary for disaster recovery
     NSString *theFilename = modelToBeReplaced.fileName;
     NSString *backupFile  = [NSString stringWithFormat:@"%@.preswap", modelToBeReplaced.fileName];
@@ -458,6 +539,21 @@ static NSString *PWSDatabaseFactoryMissingSafesMessage =
     [[NSUserDefaults standardUserDefaults] synchronize]; 
 }
 
+// Fold the model's journaled changes into its file, reporting a failure
+- (BOOL)compactModel:(iPWSDatabaseModel *)model errorMsg:(NSError **)errorMsg {
+    if ([model compact]) return YES;
+    SET_ERROR(errorMsg, ([self errorWithStr:[NSString stringWithFormat:
+        @"Database \"%@\" could not be saved.  Its latest changes are kept and will be applied when it is next opened",
+        model.friendlyName]]));
+    return NO;
+}
+
+// Close the model without folding its journal into its file, which is about to be removed
+- (void)discardDatabaseModelNamed:(NSString *)friendlyName {
+    [openDatabaseModels removeObjectForKey:friendlyName];
+    [self notifyModelClosed:friendlyName];
+}
+
 // Build an error object for the given error string
 - (NSError *)errorWithStr:(NSString *)errorStr {
     NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errorStr forKey:NSLocalizedDescriptionKey];
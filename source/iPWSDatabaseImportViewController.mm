@@ -63,7 +63,7 @@
         psafeFiles            = [[NSMutableArray array] retain];
         NSString *docDir      = databaseFactory.documentsDirectory;
         for (NSString *file in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:docDir error:NULL]) {
-            if (![databaseFactory isFileNameMapped:file]) {
+            if (![databaseFactory isFileNameMapped:file] && ![databaseFactory isAuxiliaryFileName:file]) {
                 [psafeFiles addObject: file];
             }
         }
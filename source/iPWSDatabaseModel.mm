@@ -28,14 +28,19 @@
 //------------------------------------------------------------------------------------
 // Class: iPWSDatabaseModel
 // Description:
-//  Each iPWSDatabaseModel represents a single, password-validated PasswordSafe database.  The underlying file that
-//  stores the database is opened, completely re-written, and closed each time a change is made to the database
-//  due to the API exposed by the underlying C model, but that is not reflected in this class.
+//  Each iPWSDatabaseModel represents a single, password-validated PasswordSafe database.  Each change made to an
+//  entry is appended to a journal kept beside the database file (V3 and later), which is replayed when the database
+//  is opened.  The journal is folded back into the file, which is then completely re-written, when the model is
+//  closed, when the journal grows large, or when the passphrase changes.
 //
 
 #import "iPWSDatabaseModel.h"
 #import "iPWSMacros.h"
 #import "NSString+CppStringAdditions.h"
+#import "corelib/PWSJournal.h"
+#import "os/mem.h"
+
+#include <map>
 
 //------------------------------------------------------------------------------------
 // Private interface
@@ -46,6 +51,9 @@
 - (BOOL)openPWSfileUsingMode:(PWSfile::RWmode)mode;
 - (void)closePWSfile;
 - (BOOL)syncToFile;
+- (BOOL)replayJournal;
+- (BOOL)journalEntry:(iPWSDatabaseEntryModel *)entry op:(PWSJournal::Op)op;
+- (BOOL)journalNeedsCompaction;
 
 // ---- Error reporting
 - (NSError *)errorForStatus:(int)status;
@@ -127,7 +135,7 @@ static NSDictionary *iPWSDatabaseModelErrorCodesMap =
 // Accessors
 // Read the version of the model from the file (passphrase may be required)
 - (PWSfile::VERSION) version {
-    return PWSfile::ReadVersion([self.fileName getStringX], [self.passphrase getStringX]);
+    return PWSfile::ReadVersion([self.fileName getStringX], [self.passphrase getStringX], stretchedKey);
 }
 
 // Read the header from the model's file (passphrase required)
@@ -151,7 +159,13 @@ static NSDictionary *iPWSDatabaseModelErrorCodesMap =
 // Changing the passphrase (public)
 - (BOOL)changePassphrase:(NSString *)newPassphrase {
     if (passphrase != newPassphrase) {
+        // Calibrate for the version the file is about to be re-written as, while the old passphrase still reads it
+        PWSfile::VERSION v = self.version;
+        if (PWSfile::UNKNOWN_VERSION == v) v = PWSfile::VCURRENT;
+        hashIters = MAX(hashIters, PWSfile::CalibrateHashIters(v));
+        
         self.passphrase = newPassphrase;
+        stretchedKey->Clear(); // The re-write stretches the new passphrase with a new salt
         [self notifyChangeWithEntry:nil];
         return [self syncToFile];
     }
@@ -206,6 +220,9 @@ static NSDictionary *iPWSDatabaseModelErrorCodesMap =
     // Initialize the instance by either creating a new file or opening an existing one
     if (self = [super init]) {
         entries           = [[NSMutableArray alloc] init];
+        stretchedKey      = new PWSfile::StretchedKey;
+        pws_os::mlock(stretchedKey, sizeof(*stretchedKey));
+        stretchedKey->Clear();
         self.fileName     = theFileName;
         self.friendlyName = theFriendlyName;
         self.passphrase   = thePassphrase;
@@ -222,12 +239,18 @@ static NSDictionary *iPWSDatabaseModelErrorCodesMap =
                 [self watchEntryForNotifications:entry];
                 item = CItemData(); // The C model does not clear all fields, so do so here
             }
+            hashIters = self.pwsFileHandle->GetNHashIters();
         } else { 
             // The file will be newly created. 
+            hashIters = PWSfile::CalibrateHashIters(PWSfile::VCURRENT);
             if (![self openPWSfileForWriting]) goto last_error;
         }
         
         [self closePWSfile];
+        
+        // Bring in the changes journaled since the file was written.  If the journal is damaged (say, by a crash
+        // mid-write), fold what could be read into the file now so that later changes are journaled cleanly
+        if (exists && ![self replayJournal]) [self syncToFile];
     }
     if (!self) SET_ERROR(errorMsg, [self errorForStatus:PWSfile::FAILURE]);
     return self;
@@ -248,6 +271,11 @@ last_error:
     self.friendlyName  = nil;
     self.fileName      = nil;
     [entries release];
+    if (stretchedKey) {
+        stretchedKey->Clear();
+        pws_os::munlock(stretchedKey, sizeof(*stretchedKey));
+        delete stretchedKey;
+    }
     [super dealloc];
 }
 
@@ -256,15 +284,22 @@ last_error:
 - (BOOL)addDatabaseEntry:(iPWSDatabaseEntryModel *)entry {
     [entries addObject:entry];
     [self watchEntryForNotifications:entry];
+    BOOL success = [self journalEntry:entry op:PWSJournal::JNL_ADD];
     [self notifyChangeWithEntry:entry];
-    return [self syncToFile];
+    return success;
 }
 
 - (BOOL)removeDatabaseEntry:(iPWSDatabaseEntryModel *)entry {
     [entries removeObjectIdenticalTo:entry];    
     [self stopWatchingEntryForNotifications:entry];
+    BOOL success = [self journalEntry:entry op:PWSJournal::JNL_DELETE];
     [self notifyChangeWithEntry:entry];
-    return [self syncToFile];
+    return success;
+}
+
+// Fold any journaled changes into the database file
+- (BOOL)compact {
+    return journalEntries ? [self syncToFile] : YES;
 }
 
 //------------------------------------------------------------------------------------
@@ -284,8 +319,8 @@ last_error:
 }
 
 - (void)entryChanged:(NSNotification *)notification {
+    [self journalEntry:notification.object op:PWSJournal::JNL_UPDATE];
     [self notifyChangeWithEntry:notification.object];
-    [self syncToFile]; 
 }
 
 - (void)watchEntryForNotifications:(iPWSDatabaseEntryModel *)entry {
@@ -331,11 +366,20 @@ last_error:
         return NO;
     }
     
-    // Open the file
+    // Writing re-stretches the passphrase, keep the file's iteration count.  The header also gets the number of
+    // entries, for iPWSDatabaseFactory's peekDatabaseNamed:
+    if (PWSfile::Write == mode) {
+        self.pwsFileHandle->SetNHashIters(hashIters);
+        self.pwsFileHandle->SetRecordCount((int)[entries count]);
+    }
+    
+    // Open the file, reusing the passphrase as last stretched rather than stretching it again
+    self.pwsFileHandle->SetStretchedKey(*stretchedKey);
     if (PWSfile::SUCCESS != self.pwsFileHandle->Open([self.passphrase getStringX])) {
         self.lastError = [self errorForStatus:PWSfile::WRONG_PASSWORD];
         return NO;
     }
+    self.pwsFileHandle->GetStretchedKey(*stretchedKey);
     
     // Read in and cache the header
     headerRecord = self.pwsFileHandle->GetHeader();
@@ -351,21 +395,8 @@ last_error:
 - (BOOL)syncToFile {
     BOOL success = NO;
     
-    // Try to duplicate the current file, any failures are ignored
-    NSString *duplicateFile = nil;
-    NSArray *docDirs = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, true);
-    if ([docDirs count]) {
-        NSString *docDir = [docDirs objectAtIndex:0];
-        char *tmp = tempnam([docDir UTF8String], [[self.fileName lastPathComponent] UTF8String]);
-        duplicateFile = [NSString stringWithFormat:@"%s", tmp];
-        free(tmp);
-        
-        if (![[NSFileManager defaultManager] copyItemAtPath:self.fileName toPath:duplicateFile error:NULL]) {
-            duplicateFile = nil;
-        }
-    }
-
-    // Write out each record
+    // Write out each record.  PWSfile writes to a temporary file that only replaces the current one once it has
+    // been written in full, so a failed write leaves the current file untouched
     if ([self openPWSfileForWriting]) {
         success = YES;
         NSEnumerator *etr = [entries objectEnumerator];
@@ -377,16 +408,94 @@ last_error:
         // Read in and cache the header
         headerRecord = self.pwsFileHandle->GetHeader();
         
-        [self closePWSfile];
+        if (success) {
+            success = (PWSfile::SUCCESS == self.pwsFileHandle->Close());
+        } else {
+            self.pwsFileHandle->Abandon();
+        }
+    }
+    
+    // Remove the journal, which is now in the file
+    if (success) {
+        PWSJournal::Remove([self.fileName getStringX]);
+        journalEntries = 0;
+    }
+    return success;
+}
+
+// Apply the changes journaled since the file was last written.  Returns NO if the journal could not be read in full
+- (BOOL)replayJournal {
+    PWSJournal journal([self.fileName getStringX], PWSfile::Read);
+    int status = journal.Open(*self.pwsFileHandle);
+    if (PWSfile::SUCCESS != status) {
+        // No journal, or one written against an earlier version of the file, means nothing to replay
+        return (PWSfile::CANT_OPEN_FILE == status) || (PWSfile::WRONG_VERSION == status) ||
+               (PWSfile::UNSUPPORTED_VERSION == status);
     }
     
-    // Remove the backup if the write out was successful
-    if (success && duplicateFile) {
-        [[NSFileManager defaultManager] removeItemAtPath:duplicateFile error:NULL];
+    // Reduce the journal to the latest change to each entry, then apply the changes in one pass over the entries
+    std::map<pws_os::CUUID, std::pair<PWSJournal::Op, CItemData> > changes;
+    PWSJournal::Op op;
+    CItemData item;
+    while ((status = journal.ReadEntry(op, item)) == PWSfile::SUCCESS) {
+        changes[item.GetUUID()] = std::make_pair(op, item);
+        item = CItemData(); // The C model does not clear all fields, so do so here
     }
+    journalEntries = journal.GetNumEntries();
+    BOOL success = (PWSfile::END_OF_FILE == status) && (PWSfile::SUCCESS == journal.Close());
+    
+    NSMutableArray *replayed = [NSMutableArray arrayWithCapacity:[entries count] + changes.size()];
+    NSEnumerator *etr = [entries objectEnumerator];
+    iPWSDatabaseEntryModel *entry;
+    while (entry = (iPWSDatabaseEntryModel *)[etr nextObject]) {
+        std::map<pws_os::CUUID, std::pair<PWSJournal::Op, CItemData> >::iterator change =
+            changes.find(entry.dataPtr->GetUUID());
+        if (change == changes.end()) {
+            [replayed addObject:entry];
+            continue;
+        }
+        [self stopWatchingEntryForNotifications:entry];
+        if (PWSJournal::JNL_DELETE != change->second.first) {
+            iPWSDatabaseEntryModel *updated = [iPWSDatabaseEntryModel entryModelWithItemData:&change->second.second];
+            [replayed addObject:updated];
+            [self watchEntryForNotifications:updated];
+        }
+        changes.erase(change);
+    }
+    
+    // Whatever is left was added since the file was written
+    std::map<pws_os::CUUID, std::pair<PWSJournal::Op, CItemData> >::iterator change;
+    for (change = changes.begin(); change != changes.end(); change++) {
+        if (PWSJournal::JNL_DELETE == change->second.first) continue;
+        iPWSDatabaseEntryModel *added = [iPWSDatabaseEntryModel entryModelWithItemData:&change->second.second];
+        [replayed addObject:added];
+        [self watchEntryForNotifications:added];
+    }
+    
+    [entries setArray:replayed];
     return success;
 }
 
+// Record a change to a single entry in the journal rather than re-writing the whole file.  The file is re-written
+// instead if the journal cannot be written to (e.g., the file is older than V3) or is due to be compacted
+- (BOOL)journalEntry:(iPWSDatabaseEntryModel *)entry op:(PWSJournal::Op)op {
+    if ((NULL != self.pwsFileHandle) && ![self journalNeedsCompaction]) {
+        PWSJournal journal([self.fileName getStringX], PWSfile::Write);
+        if ((PWSfile::SUCCESS == journal.Open(*self.pwsFileHandle)) &&
+            [entry writeToPWSJournal:&journal op:op] &&
+            (PWSfile::SUCCESS == journal.Close())) {
+            journalEntries++;
+            return YES;
+        }
+    }
+    return [self syncToFile];
+}
+
+// The journal is folded into the file once replaying it would cost a fair fraction of reading the file itself
+- (BOOL)journalNeedsCompaction {
+    return journalEntries >= MAX(64, [entries count] / 4);
+}
+
 
 //------------------------------------------------------------------------------------
 // Error handling
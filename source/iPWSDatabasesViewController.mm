@@ -49,6 +49,7 @@
 
 //- (void)showDatabaseDetailsForModel:(iPWSDatabaseModel *)model;
 - (void)showDatabaseModel:(iPWSDatabaseModel *)model;
+- (void)showDatabaseSummaryForName:(NSString *)friendlyName passphrase:(NSString *)passphrase;
 
 - (void)promptForPassphraseForName:(NSString *)friendlyName tag:(NSInteger)tag;
 
@@ -69,7 +70,8 @@ static NSString *IMPORT_DROPBOX_DATABASE_BUTTON_STR = @"Import safe from Dropbox
 // and the alertView the following tags
 static NSString *kPassphrasePromptContextFriendlyName = @"kPassphrasePromptContextFriendlyName";
 enum {
-    PASSPHRASE_PROMPT_OPEN_DATABASE_TAG
+    PASSPHRASE_PROMPT_OPEN_DATABASE_TAG,
+    PASSPHRASE_PROMPT_PEEK_DATABASE_TAG
 };
 
 //------------------------------------------------------------------------------------
@@ -171,7 +173,7 @@ enum {
     return [self.databaseFactory.friendlyNames count];
 }
 
-// Each cell is simply the friendly name of the database
+// Each cell is simply the friendly name of the database, with a button for a summary of its header
 - (UITableViewCell *)tableView:(UITableView *)tableView cellForRowAtIndexPath:(NSIndexPath *)indexPath {
     static NSString *CellIdentifier = @"Cell";
     
@@ -182,6 +184,7 @@ enum {
     }
     
     cell.textLabel.text = [self friendlyNameAtIndex:indexPath.row];
+    cell.accessoryType = UITableViewCellAccessoryDetailDisclosureButton;
     return cell;
 }
 
@@ -223,6 +226,17 @@ enum {
     
 }
 
+// When a database's detail button is tapped, summarize it from its header, without opening it
+- (void)tableView:(UITableView *)tableView accessoryButtonTappedForRowWithIndexPath:(NSIndexPath *)indexPath {
+    NSString *friendlyName = [self friendlyNameAtIndex:indexPath.row];
+    if ([self modelForFriendlyName:friendlyName]) {
+        [self showDatabaseSummaryForName:friendlyName passphrase:nil];
+    } else {
+        [self promptForPassphraseForName:friendlyName
+                                     tag:PASSPHRASE_PROMPT_PEEK_DATABASE_TAG];
+    }
+}
+
 // Navigate to the given database model
 - (void)showDatabaseModel:(iPWSDatabaseModel *)model {
     iPWSDatabaseModelViewController *vc = [[iPWSDatabaseModelViewController alloc] 
@@ -233,6 +247,29 @@ enum {
     [vc release];
 }
 
+// Show the name, description, last save and number of entries of a database.  An opened database needs no
+// passphrase
+- (void)showDatabaseSummaryForName:(NSString *)friendlyName passphrase:(NSString *)passphrase {
+    PWSfileHeader header;
+    NSInteger numEntries;
+    NSError *errorMsg;
+    if (![self.databaseFactory peekDatabaseNamed:friendlyName
+                                      passphrase:passphrase
+                                          header:&header
+                                      numEntries:&numEntries
+                                        errorMsg:&errorMsg]) {
+        [self alertForError:errorMsg];
+        return;
+    }
+    
+    NSString *entries = (numEntries < 0) ? @"unknown" : [NSString stringWithFormat:@"%ld", (long)numEntries];
+    NSString *summary = [NSString stringWithFormat:@"%ls\n%ls\nLast saved %@\nby %ls on %ls\nEntries: %@",
+                         header.m_DB_Name.c_str(), header.m_DB_Description.c_str(),
+                         [[NSDate dateWithTimeIntervalSince1970:header.m_whenlastsaved] description],
+                         header.m_lastsavedby.c_str(), header.m_lastsavedon.c_str(), entries];
+    ShowDismissAlertView(friendlyName, summary);
+}
+
 
 //------------------------------------------------------------------------------------
 // Add operations
@@ -302,7 +339,7 @@ enum {
     [v release];
 }
 
-// Called when the passphrase entry view is completed. Either import or open a database or show the details view
+// Called when the passphrase entry view is completed. Either open a database or show its summary
 - (void)alertView:(UIAlertView *)theAlertView clickedButtonAtIndex:(NSInteger)buttonIndex {
     PasswordAlertView *alertView = (PasswordAlertView *)theAlertView;
     if (buttonIndex == alertView.cancelButtonIndex) return;
@@ -310,6 +347,12 @@ enum {
     // Extract the callback context
     NSString *friendlyName = [passphrasePromptContext objectForKey:kPassphrasePromptContextFriendlyName];
     if (!friendlyName) return;
+    
+    // A summary only needs the header, so the database is not opened
+    if (PASSPHRASE_PROMPT_PEEK_DATABASE_TAG == theAlertView.tag) {
+        [self showDatabaseSummaryForName:friendlyName passphrase:alertView.passwordTextField.text];
+        return;
+    }
 
     // Add the database model
     NSError *errorMsg;
@@ -230,6 +230,15 @@
         return;
     }
     
+    // Uploading sends the file alone, so it must include any journaled changes
+    if (![self.model compact]) {
+        ShowDismissAlertView(@"Unable to upload safe",
+                             @"The safe could not be saved before uploading it to Dropbox.  Its latest changes are kept "
+                             @"and will be applied when it is next opened.");
+        [self cancelSynchronization];
+        return;
+    }
+    
     [self updateStatus:@"Uploading file to Dropbox..."];
     self.dbClient = [[[DBRestClient alloc] initWithSession:[DBSession sharedSession]] autorelease];
     self.dbClient.delegate = self;
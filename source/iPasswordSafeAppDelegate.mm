@@ -31,6 +31,7 @@
 #import "iPWSDatabasesViewController.h"
 #import "iPWSDatabaseFactory.h"
 #import "iPWSDropBoxAuthenticator.h"
+#import "DismissAlertView.h"
 
 #import "DropboxSDK/DropboxSDK.h"
 
@@ -106,7 +107,10 @@
     iPWSDatabasesViewController *vc = 
         (iPWSDatabasesViewController *)[navigationController.viewControllers objectAtIndex:0];    
     [navigationController popToViewController:vc animated:NO];
-    [[iPWSDatabaseFactory sharedDatabaseFactory] closeAllDatabaseModels];
+    NSError *errorMsg = nil;
+    if (![[iPWSDatabaseFactory sharedDatabaseFactory] closeAllDatabaseModels:&errorMsg]) {
+        ShowDismissAlertView(@"Unable to save safe", [errorMsg localizedDescription]);
+    }
 }
 
 // All toolbars can (and should) show a lockAllDatabases button as provided here
@@ -132,6 +136,15 @@
     return flexibleSpaceButton;
 }
 
+// Called when the application is about to be interrupted or go into background.  The database files are shared with
+// iTunes, so bring them up to date with any journaled changes
+- (void)applicationWillResignActive:(UIApplication *)application {
+    NSError *errorMsg = nil;
+    if (![[iPWSDatabaseFactory sharedDatabaseFactory] compactAllDatabaseModels:&errorMsg]) {
+        ShowDismissAlertView(@"Unable to save safe", [errorMsg localizedDescription]);
+    }
+}
+
 // Called when the application is about to terminate or go into background, if the preferences indicated, discard all
 // databases from memory
 - (void)applicationDidEnterBackground:(UIApplication *)application {
@@ -11,7 +11,7 @@
 #include "BlowFish.h"
 #include "sha1.h"
 #include "PwsPlatform.h"
-#include "os/mem.h"
+#include "SecureHeap.h"
 #include "Util.h" // for trashMemory
 
 union aword
@@ -440,6 +440,15 @@ void BlowFish::Decrypt(const unsigned char *in, unsigned char *out) const
                       reinterpret_cast<uint32 *>(out + sizeof(uint32)));
 }
 
+void BlowFish::DecryptBlocks(const unsigned char *in, unsigned char *out,
+                             size_t nblocks) const
+{
+    memcpy(out, in, nblocks * BLOCKSIZE);
+    for (size_t i = 0; i < nblocks; i++, out += BLOCKSIZE)
+        Blowfish_decipher(reinterpret_cast<uint32 *>(out),
+                          reinterpret_cast<uint32 *>(out + sizeof(uint32)));
+}
+
 /*
  * Returns a BlowFish object set up for encryption or decryption.
  *
@@ -456,17 +465,16 @@ void BlowFish::Decrypt(const unsigned char *in, unsigned char *out) const
 BlowFish *BlowFish::MakeBlowFish(const unsigned char *pass, unsigned int passlen,
                                  const unsigned char *salt, unsigned int saltlen)
 {
-    unsigned char passkey[SHA1::HASHLEN];
-    pws_os::mlock(passkey, sizeof(passkey));
+    // Locked without a syscall pair, see SecureHeap.h
+    unsigned char *passkey = static_cast<unsigned char *>(SecureHeap::Alloc(SHA1::HASHLEN));
     
     SHA1 context;
     context.Update(pass, passlen);
     context.Update(salt, saltlen);
     context.Final(passkey);
     
-    BlowFish *retval = new BlowFish(passkey, sizeof(passkey));
-    trashMemory(passkey, sizeof(passkey));
-    pws_os::munlock(passkey, sizeof(passkey));
+    BlowFish *retval = new BlowFish(passkey, SHA1::HASHLEN);
+    SecureHeap::Free(passkey); // trashes it
     return retval;
 }
 
@@ -9,6 +9,8 @@
 #ifndef __FISH_H
 #define __FISH_H
 
+#include <cstddef>
+
 /**
  * Fish is an abstract base class for BlowFish and TwoFish
  * (and for any block cipher, but it's cooler to call it "Fish"
@@ -25,6 +27,27 @@ public:
     // (blocksize dependent on cipher)
     virtual void Encrypt(const unsigned char *pt, unsigned char *ct) const = 0;
     virtual void Decrypt(const unsigned char *ct, unsigned char *pt) const = 0;
+    
+    // Following decrypts nblocks consecutive blocks (ECB), ct != pt.
+    // Default is a Decrypt() per block, ciphers can override
+    // with something faster.
+    virtual void DecryptBlocks(const unsigned char *ct, unsigned char *pt,
+                               size_t nblocks) const
+    {
+        const unsigned int BS = GetBlockSize();
+        for (size_t i = 0; i < nblocks; i++)
+            Decrypt(ct + i * BS, pt + i * BS);
+    }
+    
+    // CBC-decrypts nblocks in place. cbcbuffer holds the IV on entry,
+    // and the last ciphertext block (i.e., next IV) on return.
+    // (implemented in Util.cpp, along with the rest of the CBC code)
+    void DecryptCBC(unsigned char *buf, size_t nblocks,
+                    unsigned char *cbcbuffer) const;
+    // Same, for encryption
+    void EncryptCBC(unsigned char *buf, size_t nblocks,
+                    unsigned char *cbcbuffer) const;
 };
 
+
 #endif /* __FISH_H */
@@ -18,26 +18,71 @@
 #include "UTF8Conv.h"
 
 #include <vector>
+#include <memory>
+
+CItem::FieldFish::FieldFish()
+{
+  static_assert(int(BLOCKSIZE) == int(BlowFish::BLOCKSIZE),
+                "FieldFish tweak must match BlowFish block size");
+  PWSrand::GetInstance()->GetRandomData(m_tweak, sizeof(m_tweak));
+}
+
+CItem::FieldFish::~FieldFish()
+{
+  trashMemory(m_tweak, sizeof(m_tweak));
+}
+
+const BlowFish &CItem::FieldFish::SessionFish()
+{
+  // Keyed once, on first use. Thread-safe per C++11 static init rules.
+  struct SessionKey {
+    static BlowFish *Make() {
+      unsigned char key[32];
+      PWSrand::GetInstance()->GetRandomData(key, sizeof(key));
+      BlowFish *bf = BlowFish::MakeBlowFish(key, sizeof(key));
+      trashMemory(key, sizeof(key));
+      return bf;
+    }
+  };
+  static const std::unique_ptr<BlowFish> session_fish(SessionKey::Make());
+  return *session_fish;
+}
+
+void CItem::FieldFish::Encrypt(const unsigned char *pt, unsigned char *ct) const
+{
+  unsigned char block[BLOCKSIZE];
+  for (int i = 0; i < BLOCKSIZE; i++)
+    block[i] = pt[i] ^ m_tweak[i];
+  SessionFish().Encrypt(block, ct);
+  for (int i = 0; i < BLOCKSIZE; i++)
+    ct[i] ^= m_tweak[i];
+  trashMemory(block, sizeof(block));
+}
+
+void CItem::FieldFish::Decrypt(const unsigned char *ct, unsigned char *pt) const
+{
+  unsigned char block[BLOCKSIZE];
+  for (int i = 0; i < BLOCKSIZE; i++)
+    block[i] = ct[i] ^ m_tweak[i];
+  SessionFish().Decrypt(block, pt);
+  for (int i = 0; i < BLOCKSIZE; i++)
+    pt[i] ^= m_tweak[i];
+  trashMemory(block, sizeof(block));
+}
 
 CItem::CItem()
 {
-  PWSrand::GetInstance()->GetRandomData( m_key, sizeof(m_key) );
 }
 
 CItem::CItem(const CItem &that) :
   m_fields(that.m_fields),
-  m_URFL(that.m_URFL)
+  m_URFL(that.m_URFL),
+  m_fish(that.m_fish)
 {
-  memcpy(m_key, that.m_key, sizeof(m_key));
 }
 
 CItem::~CItem()
 {
-  delete m_blowfish;
-  // Following protects against possible use-after-delete
-  // bug, since new BF will be created, rather than
-  // using one with trashed values
-  m_blowfish = nullptr;
 }
 
 CItem& CItem::operator=(const CItem &that)
@@ -45,10 +90,7 @@ CItem& CItem::operator=(const CItem &that)
   if (this != &that) { // Check for self-assignment
     m_fields = that.m_fields;
     m_URFL = that.m_URFL;
-
-    memcpy(m_key, that.m_key, sizeof(m_key));
-    delete m_blowfish;
-    m_blowfish = nullptr;
+    m_fish = that.m_fish;
   }
   return *this;
 }
@@ -124,16 +166,6 @@ size_t CItem::GetSize() const
   return length;
 }
 
-BlowFish *CItem::MakeBlowFish() const
-{
-  // Creating a BlowFish object's relatively expensive, so we use
-  // the singleton design pattern for the life of the CItem object
-  if(!m_blowfish) {
-    m_blowfish = BlowFish::MakeBlowFish(m_key, sizeof(m_key));
-  }
-  return m_blowfish;
-}
-
 void CItem::SetUnknownField(unsigned char type,
                             size_t length,
                             const unsigned char *ufield)
@@ -144,7 +176,7 @@ void CItem::SetUnknownField(unsigned char type,
   **/
 
   CItemField unkrfe(type);
-  unkrfe.Set(ufield, length, MakeBlowFish());
+  unkrfe.Set(ufield, length, GetFish());
   m_URFL.push_back(unkrfe);
 }
 
@@ -172,7 +204,7 @@ void CItem::SetField(int ft, const unsigned char *value, size_t length)
 {
   if (length != 0) {
     m_fields[ft].Set(value, length,
-                     MakeBlowFish(),
+                     GetFish(),
                      static_cast<unsigned char>(ft));
   } else
     m_fields.erase(ft);
@@ -182,7 +214,7 @@ void CItem::SetField(int ft, const StringX &value)
 {
   if (!value.empty()) {
     m_fields[ft].Set(value,
-                     MakeBlowFish(),
+                     GetFish(),
                      static_cast<unsigned char>(ft));
   } else
     m_fields.erase(ft);
@@ -197,13 +229,12 @@ static bool pull_string(StringX &str,
    * PWS_CP_ACP is either set externally or via the --CP_ACP argv
    *
    * We use a static variable purely for efficiency, as this won't change
-   * over the course of the program.
+   * over the course of the program. (Initialized once, thread-safely,
+   * as records may be set up on several threads when loading.)
    */
 
-  static int cp_acp = -1;
-  if (cp_acp == -1) {
-    cp_acp = pws_os::getenv("PWS_CP_ACP", false).empty() ? 0 : 1;
-  }
+  static const int cp_acp =
+    pws_os::getenv("PWS_CP_ACP", false).empty() ? 0 : 1;
   CUTF8Conv utf8conv((cp_acp != 0));
   std::vector<unsigned char> v(data, (data + len));
   v.push_back(0); // null terminate for FromUTF8.
@@ -247,7 +278,7 @@ bool CItem::SetTimeField(int ft, const unsigned char *value,
 void CItem::GetField(const CItemField &field,
                      unsigned char *value, size_t &length) const
 {
-  field.Get(value, length, MakeBlowFish());
+  field.Get(value, length, GetFish());
 }
 
 StringX CItem::GetField(const int ft) const
@@ -259,7 +290,7 @@ StringX CItem::GetField(const int ft) const
 StringX CItem::GetField(const CItemField &field) const
 {
   StringX retval;
-  field.Get(retval, MakeBlowFish());
+  field.Get(retval, GetFish());
   return retval;
 }
 
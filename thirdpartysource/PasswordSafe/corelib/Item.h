@@ -12,12 +12,14 @@
 #define __ITEM_H
 
 #include "ItemField.h"
+#include "Fish.h"
 #include "Util.h"
 #include "StringX.h"
 
 #include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
 
 //-----------------------------------------------------------------------------
 
@@ -139,8 +141,67 @@ public:
   size_t GetSize() const;
   void GetSize(size_t &isize) const {isize = GetSize();}
 
+  static bool IsItemDataField(unsigned char type)
+  {return type >= START && type < LAST_DATA;}
+  static bool IsItemAttField(unsigned char type)
+  {return type >= START_ATT && type < LAST_ATT;}
+
 protected:
-  typedef std::map<int, CItemField> FieldMap;
+  // An item has a dozen or so fields, mostly small. Rather than a node
+  // per field (as with std::map), keep them in a single vector sorted by
+  // field type. Together with CItemField's inline storage, this keeps
+  // most of an item's ciphertext in one contiguous allocation.
+  // Interface is the subset of std::map that we use.
+  class FieldMap
+  {
+  public:
+    typedef std::pair<int, CItemField> value_type;
+    typedef std::vector<value_type>::iterator iterator;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+    iterator begin() {return m_v.begin();}
+    iterator end() {return m_v.end();}
+    const_iterator begin() const {return m_v.begin();}
+    const_iterator end() const {return m_v.end();}
+    size_t size() const {return m_v.size();}
+    bool empty() const {return m_v.empty();}
+    void clear() {m_v.clear();}
+
+    iterator find(int ft)
+    {
+      iterator iter = lower_bound(ft);
+      return (iter != m_v.end() && iter->first == ft) ? iter : m_v.end();
+    }
+    const_iterator find(int ft) const
+    {
+      const_iterator iter = lower_bound(ft);
+      return (iter != m_v.end() && iter->first == ft) ? iter : m_v.end();
+    }
+    CItemField &operator[](int ft)
+    {
+      iterator iter = lower_bound(ft);
+      if (iter == m_v.end() || iter->first != ft)
+        iter = m_v.insert(iter, value_type(ft, CItemField()));
+      return iter->second;
+    }
+    size_t erase(int ft)
+    {
+      iterator iter = find(ft);
+      if (iter == m_v.end())
+        return 0;
+      m_v.erase(iter);
+      return 1;
+    }
+
+  private:
+    static bool TypeLess(const value_type &v, int ft) {return v.first < ft;}
+    iterator lower_bound(int ft)
+    {return std::lower_bound(m_v.begin(), m_v.end(), ft, TypeLess);}
+    const_iterator lower_bound(int ft) const
+    {return std::lower_bound(m_v.begin(), m_v.end(), ft, TypeLess);}
+
+    std::vector<value_type> m_v;
+  };
   typedef FieldMap::const_iterator FieldConstIter;
   typedef FieldMap::iterator FieldIter;
 
@@ -166,24 +227,36 @@ protected:
 
   void GetUnknownField(unsigned char &type, size_t &length,
                        unsigned char * &pdata, const CItemField &item) const;
-  bool IsItemDataField(unsigned char type) const
-  {return type >= START && type < LAST_DATA;}
-  bool IsItemAttField(unsigned char type) const
-  {return type >= START_ATT && type < LAST_ATT;}
 
 private:
   // Helper function for operator==
   bool CompareFields(const CItemField &fthis,
                      const CItem &that, const CItemField &fthat) const;
 
-  // Create local Encryption/Decryption object
-  BlowFish *MakeBlowFish() const;
+  // Encryption/Decryption object for storing stuff in memory.
+  // A BlowFish per item would cost a 4K+ key schedule (and 521 encryptions
+  // to set it up) for every entry, and more for every copy. Instead, all
+  // items share a single BlowFish, randomly keyed once per session,
+  // and each item whitens its blocks with its own random tweak:
+  //   C = E(P ^ T) ^ T
+  // so that, as before, the same field encrypts differently in each item.
+  class FieldFish : public Fish
+  {
+  public:
+    enum {BLOCKSIZE = 8}; // == BlowFish::BLOCKSIZE
+    FieldFish();
+    ~FieldFish();
+    unsigned int GetBlockSize() const {return BLOCKSIZE;}
+    void Encrypt(const unsigned char *pt, unsigned char *ct) const;
+    void Decrypt(const unsigned char *ct, unsigned char *pt) const;
+  private:
+    static const BlowFish &SessionFish();
+    unsigned char m_tweak[BLOCKSIZE];
+  };
+
+  const Fish *GetFish() const {return &m_fish;}
 
-  // random key for storing stuff in memory
-  // We need to keep the key because it's easier to copy
-  // than the BlowFish object for copy c'tor and assignment
-  unsigned char m_key[32];
-  mutable BlowFish *m_blowfish = nullptr;
+  FieldFish m_fish;
 };
 
 #endif /* __ITEM_H */
@@ -15,6 +15,7 @@
 #include "PWSfile.h"
 #include "PWSfileV4.h"
 #include "PWScore.h"
+#include "SecureHeap.h"
 
 #include "os/typedefs.h"
 #include "os/pws_tchar.h"
@@ -26,20 +27,106 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
 using namespace std;
 using pws_os::CUUID;
 
+namespace {
+  // Content that's been read from disk (see CItemAtt::Read), most
+  // recently used first, up to MAXSIZE bytes' worth.
+  // It's kept encrypted with a key of its own, and is looked up by its
+  // HMAC, which differs each time the content's written.
+  class ContentCache
+  {
+  public:
+    enum {MAXSIZE = 16 * 1024 * 1024};
+    ContentCache();
+    bool Get(const unsigned char digest[SHA256::HASHLEN],
+             unsigned char *content, size_t &clen);
+    void Put(const unsigned char digest[SHA256::HASHLEN],
+             const unsigned char *content, size_t clen);
+
+  private:
+    typedef std::pair<std::string, CItemField> Entry;
+    std::mutex m_mutex;
+    std::list<Entry> m_lru;
+    std::map<std::string, std::list<Entry>::iterator> m_index;
+    size_t m_size;
+    std::unique_ptr<BlowFish> m_fish;
+  };
+
+  ContentCache &TheContentCache()
+  {
+    static ContentCache cache;
+    return cache;
+  }
+}
+
+ContentCache::ContentCache() : m_size(0)
+{
+  unsigned char key[32];
+  PWSrand::GetInstance()->GetRandomData(key, sizeof(key));
+  m_fish.reset(BlowFish::MakeBlowFish(key, sizeof(key)));
+  trashMemory(key, sizeof(key));
+}
+
+bool ContentCache::Get(const unsigned char digest[SHA256::HASHLEN],
+                       unsigned char *content, size_t &clen)
+{
+  const std::string key(reinterpret_cast<const char *>(digest),
+                        SHA256::HASHLEN);
+  std::lock_guard<std::mutex> guard(m_mutex);
+
+  auto iter = m_index.find(key);
+  if (iter == m_index.end())
+    return false;
+  m_lru.splice(m_lru.begin(), m_lru, iter->second);
+  iter->second->second.Get(content, clen, m_fish.get());
+  return true;
+}
+
+void ContentCache::Put(const unsigned char digest[SHA256::HASHLEN],
+                       const unsigned char *content, size_t clen)
+{
+  if (clen == 0 || clen > MAXSIZE)
+    return;
+
+  const std::string key(reinterpret_cast<const char *>(digest),
+                        SHA256::HASHLEN);
+  std::lock_guard<std::mutex> guard(m_mutex);
+
+  if (m_index.find(key) != m_index.end())
+    return;
+  while (m_size + clen > MAXSIZE) {
+    m_size -= m_lru.back().second.GetLength();
+    m_index.erase(m_lru.back().first);
+    m_lru.pop_back();
+  }
+  m_lru.push_front(Entry(key, CItemField()));
+  m_lru.front().second.Set(content, clen, m_fish.get());
+  m_index[key] = m_lru.begin();
+  m_size += clen;
+}
+
 //-----------------------------------------------------------------------------
 // Constructors
 
 CItemAtt::CItemAtt()
-  : m_entrystatus(ES_CLEAN), m_offset(-1L), m_refcount(0)
+  : m_entrystatus(ES_CLEAN), m_offset(-1L), m_refcount(0),
+    m_contentOffset(-1L), m_contentLen(0)
 {
 }
 
 CItemAtt::CItemAtt(const CItemAtt &that) :
   CItem(that), m_entrystatus(that.m_entrystatus),
-  m_offset(that.m_offset), m_refcount(that.m_refcount)
+  m_offset(that.m_offset), m_refcount(that.m_refcount),
+  m_contentFile(that.m_contentFile), m_contentOffset(that.m_contentOffset),
+  m_contentLen(that.m_contentLen)
 {
 }
 
@@ -54,6 +141,9 @@ CItemAtt& CItemAtt::operator=(const CItemAtt &that)
     m_entrystatus = that.m_entrystatus;
     m_offset = that.m_offset;
     m_refcount = that.m_refcount;
+    m_contentFile = that.m_contentFile;
+    m_contentOffset = that.m_contentOffset;
+    m_contentLen = that.m_contentLen;
   }
   return *this;
 }
@@ -135,6 +225,8 @@ size_t CItemAtt::GetContentLength() const
 
   if (fiter != m_fields.end())
     return fiter->second.GetLength();
+  else if (IsContentOnDisk())
+    return m_contentLen;
   else
     return 0;
 }
@@ -145,6 +237,9 @@ size_t CItemAtt::GetContentSize() const
 
   if (fiter != m_fields.end())
     return fiter->second.GetSize();
+  else if (IsContentOnDisk()) // decrypted in place, in TwoFish blocks
+    return ((m_contentLen + TwoFish::BLOCKSIZE - 1)/TwoFish::BLOCKSIZE)*
+      TwoFish::BLOCKSIZE;
   else
     return 0;
 }
@@ -156,10 +251,97 @@ bool CItemAtt::GetContent(unsigned char *content, size_t csize) const
   if (!HasContent() || csize < GetContentSize())
     return false;
 
+  if (IsContentOnDisk())
+    return ReadContent(content) == PWSfile::SUCCESS;
+
   GetField(m_fields.find(CONTENT)->second, content, csize);
   return true;
 }
 
+int CItemAtt::LoadContent()
+{
+  if (!IsContentOnDisk())
+    return PWSfile::SUCCESS;
+
+  unsigned char *content =
+    static_cast<unsigned char *>(SecureHeap::Alloc(GetContentSize()));
+  int status = ReadContent(content);
+  if (status == PWSfile::SUCCESS)
+    SetContent(content, m_contentLen); // forgets where it was
+  SecureHeap::Free(content);
+  return status;
+}
+
+int CItemAtt::ReadContent(unsigned char *content) const
+{
+  // content has room for GetContentSize() bytes
+  ASSERT(IsContentOnDisk());
+
+  unsigned char IV[TwoFish::BLOCKSIZE];
+  unsigned char EK[PWSfileV4::KLEN];
+  unsigned char AK[PWSfileV4::KLEN];
+  unsigned char expected_digest[SHA256::HASHLEN];
+  size_t len;
+
+  len = sizeof(IV);
+  CItem::GetField(m_fields.find(ATTIV)->second, IV, len);
+  len = sizeof(expected_digest);
+  CItem::GetField(m_fields.find(CONTENTHMAC)->second, expected_digest, len);
+
+  len = GetContentSize();
+  if (TheContentCache().Get(expected_digest, content, len)) {
+    ASSERT(len == m_contentLen);
+    trashMemory(IV, sizeof(IV));
+    return PWSfile::SUCCESS;
+  }
+
+  len = sizeof(EK);
+  CItem::GetField(m_fields.find(ATTEK)->second, EK, len);
+  len = sizeof(AK);
+  CItem::GetField(m_fields.find(ATTAK)->second, AK, len);
+
+  int status;
+  TwoFish fish(EK, sizeof(EK));
+  trashMemory(EK, sizeof(EK));
+  const size_t nread = PWSfileV4::ReadContent(m_contentFile, m_contentOffset,
+                                              &fish, IV, content, m_contentLen);
+
+  if (nread != GetContentSize()) {
+    status = PWSfile::READ_FAIL;
+  } else {
+    unsigned char calculated_digest[SHA256::HASHLEN] = {0};
+    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+
+    hmac.Init(AK, sizeof(AK));
+    hmac.Update(content, (unsigned long)m_contentLen);
+    hmac.Final(calculated_digest);
+
+    if (memcmp(expected_digest, calculated_digest,
+               sizeof(calculated_digest)) == 0) {
+      TheContentCache().Put(expected_digest, content, m_contentLen);
+      status = PWSfile::SUCCESS;
+    } else {
+      status = PWSfile::BAD_DIGEST;
+    }
+  }
+  if (status != PWSfile::SUCCESS)
+    trashMemory(content, nread);
+  trashMemory(AK, sizeof(AK));
+  trashMemory(IV, sizeof(IV));
+  return status;
+}
+
+void CItemAtt::ForgetContentOnDisk()
+{
+  m_fields.erase(ATTIV);
+  m_fields.erase(ATTEK);
+  m_fields.erase(ATTAK);
+  m_fields.erase(CONTENTHMAC);
+  m_contentFile.clear();
+  m_contentOffset = -1L;
+  m_contentLen = 0;
+}
+
 int CItemAtt::Import(const stringT &fname)
 {
   stringT spath, sdrive, sdir, sfname, sextn;
@@ -225,26 +407,36 @@ int CItemAtt::Export(const stringT &fname) const
   int status = PWScore::SUCCESS;
 
   ASSERT(!fname.empty());
-  ASSERT(IsFieldSet(CONTENT));
+  ASSERT(HasContent());
   // fail safely @runtime:
-  if (!IsFieldSet(CONTENT))
+  if (!HasContent())
     return PWScore::FAILURE;
 
-  const CItemField &field = m_fields.find(CONTENT)->second;
-  std::FILE *fhandle = pws_os::FOpen(fname, L"wb");
-  if (!fhandle)
-    return PWScore::CANT_OPEN_FILE;
+  size_t flen = GetContentSize();
+  unsigned char *value = static_cast<unsigned char *>(SecureHeap::Alloc(flen));
+  std::FILE *fhandle = NULL;
+  size_t nwritten;
+
+  // Content that's on disk is read and checked before we create the file
+  if (IsContentOnDisk()) {
+    status = ReadContent(value);
+    if (status != PWSfile::SUCCESS)
+      goto done;
+    flen = m_contentLen;
+  } else {
+    // flen adjusted to real value
+    CItem::GetField(m_fields.find(CONTENT)->second, value, flen);
+  }
 
-  size_t flen = field.GetLength() + 8; // Add 8 for block size
-  unsigned char *value = new unsigned char[flen];
-  if (value == NULL) {
-    fclose(fhandle);
-    return PWScore::FAILURE;
+  fhandle = pws_os::FOpen(fname, L"wb");
+  if (!fhandle) {
+    status = PWScore::CANT_OPEN_FILE;
+    goto done;
   }
 
-  CItem::GetField(field, value, flen); // flen adjusted to real value
-  size_t nwritten = fwrite(value, flen, 1, fhandle);
+  nwritten = fwrite(value, flen, 1, fhandle);
   if (nwritten != 1) {
+    fclose(fhandle);
     status = PWScore::WRITE_FAIL;
     goto done;
   }
@@ -255,8 +447,7 @@ int CItemAtt::Export(const stringT &fname) const
   }
 
  done:
-  trashMemory(value, flen);
-  delete[] value;
+  SecureHeap::Free(value); // trashes it
   return status;
 }
 
@@ -287,6 +478,7 @@ bool CItemAtt::SetField(unsigned char type, const unsigned char *data,
     if (!SetTimeField(ft, data, len)) return false;
     break;
   case CONTENT:
+    ForgetContentOnDisk();
     CItem::SetField(type, data, len);
     break;
   case ATTIV:
@@ -294,7 +486,7 @@ bool CItemAtt::SetField(unsigned char type, const unsigned char *data,
   case ATTAK:
   case CONTENTHMAC:
     // These fields have no business in the record, created and used
-    // solely for file i/o.
+    // solely for file i/o (and kept by Read() for ReadContent()).
     ASSERT(0);
     return false;
   case END:
@@ -322,7 +514,7 @@ int CItemAtt::Read(PWSfile *in)
   unsigned char EK[PWSfileV4::KLEN] = {0};
   unsigned char AK[PWSfileV4::KLEN] = {0};
 
-  unsigned char *content = NULL;
+  long content_offset = -1L;
   size_t content_len = 0;
   unsigned char expected_digest[SHA256::HASHLEN] = {0};
 
@@ -330,6 +522,7 @@ int CItemAtt::Read(PWSfile *in)
   size_t utf8Len = 0;
 
   Clear();
+  ForgetContentOnDisk();
 
   do {
     fieldLen = static_cast<signed long>(in->ReadField(type, utf8,
@@ -380,16 +573,11 @@ int CItemAtt::Read(PWSfile *in)
           goto exit;
         content_len = getInt32(utf8);
 
-        TwoFish fish(EK, sizeof(EK));
-        trashMemory(EK, sizeof(EK));
-        const unsigned int BS = fish.GetBlockSize();
-
+        // Just note where it is, see ReadContent()
         PWSfileV4 *in4 = dynamic_cast<PWSfileV4 *>(in);
         ASSERT(in4 != NULL);
-        size_t nread = in4->ReadContent(&fish, IV, content, content_len);
-        // nread should be content_len rounded up to nearest BS:
-        ASSERT(nread == (content_len/BS + 1)*BS);
-        if (nread != (content_len/BS + 1)*BS) {
+        content_offset = in4->SkipContent(content_len);
+        if (content_offset < 0) {
           status = PWSfile::READ_FAIL;
           goto exit;
         }
@@ -412,43 +600,33 @@ int CItemAtt::Read(PWSfile *in)
     } // if (fieldLen > 0)
 
     if (utf8 != NULL) {
-      trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-      delete[] utf8; utf8 = NULL; utf8Len = 0;
+      SecureHeap::Free(utf8); utf8 = NULL; utf8Len = 0;
     }
   } while (type != END && fieldLen > 0 && --emergencyExit > 0);
 
   // Post-field read processing:
   // - Ensure we have all we need
-  // - Check HMAC
-  // - Set Content field
+  // - Keep what ReadContent() will need, encrypted like the rest
   // - Clean-up
 
   if (gotContent && gotAK && gotHMAC) {
-    unsigned char calculated_digest[SHA256::HASHLEN] = {0};
-    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
-
-    hmac.Init(AK, sizeof(AK));
-    trashMemory(AK, sizeof(AK));
-    
-    // calculate HMAC
-    hmac.Update(content, (unsigned long)content_len);
-    hmac.Final(calculated_digest);
-
-    if (memcmp(expected_digest, calculated_digest,
-               sizeof(calculated_digest)) == 0) {
-      SetField(CONTENT, content, content_len);
-      status = PWSfile::SUCCESS;
-    } else {
-      status = PWSfile::BAD_DIGEST;
-    }
+    CItem::SetField(ATTIV, IV, sizeof(IV));
+    CItem::SetField(ATTEK, EK, sizeof(EK));
+    CItem::SetField(ATTAK, AK, sizeof(AK));
+    CItem::SetField(CONTENTHMAC, expected_digest, sizeof(expected_digest));
+    m_contentFile = in->GetFilename();
+    m_contentOffset = content_offset;
+    m_contentLen = content_len;
+    status = PWSfile::SUCCESS;
   } else {
     status = PWSfile::READ_FAIL;
   }
 
  exit:
-  trashMemory(content, content_len);
-  delete[] content;
-  delete[] utf8; // if here via goto exit
+  trashMemory(IV, sizeof(IV));
+  trashMemory(EK, sizeof(EK));
+  trashMemory(AK, sizeof(AK));
+  SecureHeap::Free(utf8); // if here via goto exit
 
   if (numread > 0) {
     m_offset = in->GetOffset();
@@ -494,9 +672,8 @@ size_t CItemAtt::WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const
   return retval;
 }
 
-int CItemAtt::Write(PWSfile *out) const
+void CItemAtt::WriteFields(PWSfile *out) const
 {
-  int status = PWSfile::SUCCESS;
   uuid_array_t att_uuid;
 
   ASSERT(HasUUID());
@@ -513,6 +690,19 @@ int CItemAtt::Write(PWSfile *out) const
   WriteIfSet(FILECTIME, out, false);
   WriteIfSet(FILEMTIME, out, false);
   WriteIfSet(FILEATIME, out, false);
+}
+
+int CItemAtt::WriteEnd(PWSfile *out) const
+{
+  if (out->WriteField(END, _T("")) > 0)
+    return PWSfile::SUCCESS;
+  else
+    return PWSfile::FAILURE;
+}
+
+int CItemAtt::Write(PWSfile *out) const
+{
+  WriteFields(out);
 
   FieldConstIter fiter = m_fields.find(CONTENT);
   // XXX TBD - fail if no content, as this is a mandatory field
@@ -526,13 +716,54 @@ int CItemAtt::Write(PWSfile *out) const
     out4->WriteContentFields(content, clength);
     trashMemory(content, clength);
     delete[] content;
+  } else if (IsContentOnDisk()) {
+    PWSfileV4 *out4 = dynamic_cast<PWSfileV4 *>(out);
+    ASSERT(out4 != NULL);
+
+    unsigned char *content =
+      static_cast<unsigned char *>(SecureHeap::Alloc(GetContentSize()));
+    const int status = ReadContent(content);
+    if (status == PWSfile::SUCCESS)
+      out4->WriteContentFields(content, m_contentLen);
+    SecureHeap::Free(content);
+    if (status != PWSfile::SUCCESS)
+      return status;
   }
 
-  if (out->WriteField(END, _T("")) > 0) {
-    status = PWSfile::SUCCESS;
-  } else {
-    status = PWSfile::FAILURE;
+  return WriteEnd(out);
+}
+
+int CItemAtt::Write(PWSfile *out, const StringX &newfile)
+{
+  if (!IsContentOnDisk())
+    return Write(out);
+
+  WriteFields(out);
+
+  PWSfileV4 *out4 = dynamic_cast<PWSfileV4 *>(out);
+  ASSERT(out4 != NULL);
+
+  PWSfileV4::ContentKeys keys;
+  unsigned char *content =
+    static_cast<unsigned char *>(SecureHeap::Alloc(GetContentSize()));
+  int status = ReadContent(content);
+  if (status == PWSfile::SUCCESS)
+    out4->WriteContentFields(content, m_contentLen, &keys);
+  SecureHeap::Free(content);
+
+  if (status == PWSfile::SUCCESS)
+    status = WriteEnd(out);
+
+  if (status == PWSfile::SUCCESS) {
+    // Same content, new keys, in what will be newfile
+    CItem::SetField(ATTIV, keys.IV, sizeof(keys.IV));
+    CItem::SetField(ATTEK, keys.EK, sizeof(keys.EK));
+    CItem::SetField(ATTAK, keys.AK, sizeof(keys.AK));
+    CItem::SetField(CONTENTHMAC, keys.digest, sizeof(keys.digest));
+    m_contentFile = newfile;
+    m_contentOffset = keys.offset;
   }
+  trashMemory(&keys, sizeof(keys));
   return status;
 }
 
@@ -49,11 +49,24 @@ public:
 
   int Read(PWSfile *in);
   int Write(PWSfile *out) const;
+  // As above, and if our content's on disk, notes where it is in out,
+  // which is to become newfile (see PWScore::WriteFile)
+  int Write(PWSfile *out, const StringX &newfile);
 
   int Import(const stringT &fname);
   int Export(const stringT &fname) const;
 
-  bool HasContent() const {return IsFieldSet(CONTENT);}
+  bool HasContent() const {return IsFieldSet(CONTENT) || IsContentOnDisk();}
+
+  // Read() leaves the content on disk, noting where it is and its keys,
+  // so that opening a database doesn't mean decrypting all its
+  // attachments. GetContent() and Export() read it (and check its HMAC)
+  // when needed, keeping the most recently used in a bounded cache.
+  bool IsContentOnDisk() const {return m_contentOffset >= 0;}
+  StringX GetContentFile() const {return m_contentFile;}
+  // Reads the content into memory, as if set via SetContent(),
+  // e.g., before the file it's in is overwritten
+  int LoadContent();
 
   // Convenience: Get the name associated with FieldType
   static stringT FieldName(FieldType ft);
@@ -130,10 +143,18 @@ public:
 private:
   bool SetField(unsigned char type, const unsigned char *data, size_t len);
   size_t WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const;
+  void WriteFields(PWSfile *out) const; // all but the content
+  int WriteEnd(PWSfile *out) const;
+  int ReadContent(unsigned char *content) const; // see IsContentOnDisk()
+  void ForgetContentOnDisk();
 
   EntryStatus m_entrystatus;
   long m_offset; // location on file, for lazy evaluation
   unsigned m_refcount; // how many CItemData objects refer to this?
+  // Where Read() left the content: its IV, EK, AK & HMAC are in m_fields
+  StringX m_contentFile;
+  long m_contentOffset; // -1 if content's in m_fields, or there's none
+  size_t m_contentLen;
 };
 #endif /* __ITEMATT_H */
 //-----------------------------------------------------------------------------
@@ -16,6 +16,7 @@
 #include "VerifyFormat.h"
 #include "PWHistory.h"
 #include "Util.h"
+#include "SecureHeap.h"
 #include "StringXStream.h"
 #include "core.h"
 #include "PWSfile.h"
@@ -146,17 +147,56 @@ void CItemData::SetSpecialPasswords()
     } // IsDependent()
 }
 
+CItemData::RawRecord &CItemData::RawRecord::operator=(RawRecord &&that)
+{
+    if (this != &that) {
+        Clear();
+        m_fields = std::move(that.m_fields);
+    }
+    return *this;
+}
+
+void CItemData::RawRecord::Add(unsigned char type, unsigned char *data, size_t len)
+{
+    Field f = {type, data, len};
+    m_fields.push_back(f);
+}
+
+void CItemData::RawRecord::Clear()
+{
+    for (auto iter = m_fields.begin(); iter != m_fields.end(); iter++) {
+        if (iter->data != NULL) {
+            SecureHeap::Free(iter->data); // trashes it
+        }
+    }
+    m_fields.clear();
+}
+
 int CItemData::Read(PWSfile *in)
 {
-    int status = PWSfile::SUCCESS;
-    
+    RawRecord raw;
+    int status = ReadRaw(in, raw);
+    if (status == PWSfile::SUCCESS)
+        status = SetRaw(raw);
+    else
+        Clear();
+    return status;
+}
+
+/*
+ * Returns SUCCESS if a record was read, END_OF_FILE if there was nothing
+ * to read, or -(bytes read) if an attachment field was found, allowing
+ * caller to rewind and retry (V4).
+ */
+int CItemData::ReadRaw(PWSfile *in, RawRecord &raw)
+{
     signed long numread = 0;
     unsigned char type = END;
     
     int emergencyExit = 255; // to avoid endless loop.
     signed long fieldLen; // <= 0 means end of file reached
     
-    Clear();
+    raw.Clear();
     do {
         unsigned char *utf8 = NULL;
         size_t utf8Len = 0;
@@ -165,58 +205,68 @@ int CItemData::Read(PWSfile *in)
         
         if (fieldLen > 0) {
             numread += fieldLen;
-            if (IsItemDataField(type)) {
-                if (!SetField(type, utf8, utf8Len)) {
-                    status = PWSfile::FAILURE;
-                    break;
-                }
-            } else if (IsItemAttField(type)) {
+            if (IsItemAttField(type)) {
                 // Allow rewind and retry
                 if (utf8 != NULL) {
-                    trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-                    delete[] utf8;
+                    SecureHeap::Free(utf8); // trashes it
                 }
+                raw.Clear();
                 return (int)-numread;
-            } else if (type != END) { // unknown field
-                SetUnknownField(type, utf8Len, utf8);
+            } else if (type != END) {
+                raw.Add(type, utf8, utf8Len); // raw owns utf8 now
+                utf8 = NULL;
             }
         } // if (fieldLen > 0)
         
         if (utf8 != NULL) {
-            trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-            delete[] utf8; utf8 = NULL; utf8Len = 0;
+            SecureHeap::Free(utf8); utf8 = NULL; utf8Len = 0;
         }
     } while (type != END && fieldLen > 0 && --emergencyExit > 0);
     
-    if (numread > 0) {
-        // Determine entry type:
-        // ET_NORMAL (which may later change to ET_ALIASBASE or ET_SHORTCUTBASE)
-        // ET_ALIAS or ET_SHORTCUT
-        // For V4, this is simple, as we have different UUID types
-        // For V3, we need to parse the password
-        ParseSpecialPasswords();
-        if (m_fields.find(UUID) != m_fields.end())
-            m_entrytype = ET_NORMAL; // may change later to ET_*BASE
-        else if (m_fields.find(ALIASUUID) != m_fields.end())
-            m_entrytype = ET_ALIAS;
-        else if (m_fields.find(SHORTCUTUUID) != m_fields.end())
-            m_entrytype = ET_SHORTCUT;
-        else
-            ASSERT(0);
-        return status;
-    } else
-        return PWSfile::END_OF_FILE;
+    return (numread > 0) ? PWSfile::SUCCESS : PWSfile::END_OF_FILE;
 }
 
-size_t CItemData::WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const
+int CItemData::SetRaw(const RawRecord &raw)
+{
+    int status = PWSfile::SUCCESS;
+    
+    Clear();
+    for (auto iter = raw.m_fields.begin(); iter != raw.m_fields.end(); iter++) {
+        if (IsItemDataField(iter->type)) {
+            if (!SetField(iter->type, iter->data, iter->len)) {
+                status = PWSfile::FAILURE;
+                break;
+            }
+        } else { // unknown field
+            SetUnknownField(iter->type, iter->len, iter->data);
+        }
+    }
+    
+    // Determine entry type:
+    // ET_NORMAL (which may later change to ET_ALIASBASE or ET_SHORTCUTBASE)
+    // ET_ALIAS or ET_SHORTCUT
+    // For V4, this is simple, as we have different UUID types
+    // For V3, we need to parse the password
+    ParseSpecialPasswords();
+    if (m_fields.find(UUID) != m_fields.end())
+        m_entrytype = ET_NORMAL; // may change later to ET_*BASE
+    else if (m_fields.find(ALIASUUID) != m_fields.end())
+        m_entrytype = ET_ALIAS;
+    else if (m_fields.find(SHORTCUTUUID) != m_fields.end())
+        m_entrytype = ET_SHORTCUT;
+    else
+        ASSERT(0);
+    return status;
+}
+
+void CItemData::GetIfSet(FieldType ft, RawRecord &raw, bool isUTF8) const
 {
     FieldConstIter fiter = m_fields.find(ft);
-    size_t retval = 0;
     if (fiter != m_fields.end()) {
         const CItemField &field = fiter->second;
         ASSERT(!field.IsEmpty());
         size_t flength = field.GetLength() + BlowFish::BLOCKSIZE;
-        unsigned char *pdata = new unsigned char[flength];
+        unsigned char *pdata = static_cast<unsigned char *>(SecureHeap::Alloc(flength));
         CItem::GetField(field, pdata, flength);
         if (isUTF8) {
             wchar_t *wpdata = reinterpret_cast<wchar_t *>(pdata);
@@ -224,25 +274,31 @@ size_t CItemData::WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const
             wpdata[srclen] = 0;
             size_t dstlen = pws_os::wcstombs(NULL, 0, wpdata, srclen);
             ASSERT(dstlen > 0);
-            char *dst = new char[dstlen+1];
+            char *dst = static_cast<char *>(SecureHeap::Alloc(dstlen+1));
             dstlen = pws_os::wcstombs(dst, dstlen, wpdata, srclen);
             ASSERT(dstlen != size_t(-1));
             //[BR1150, BR1167]: Discard the terminating NULLs in text fields
             if (dstlen && !dst[dstlen-1])
                 dstlen--;
-            retval = out->WriteField(static_cast<unsigned char>(ft), reinterpret_cast<unsigned char *>(dst), dstlen);
-            trashMemory(dst, dstlen);
-            delete[] dst;
+            raw.Add(static_cast<unsigned char>(ft), reinterpret_cast<unsigned char *>(dst), dstlen);
+            SecureHeap::Free(pdata); // trashes it
         } else {
-            retval = out->WriteField(static_cast<unsigned char>(ft), pdata, field.GetLength());
+            raw.Add(static_cast<unsigned char>(ft), pdata, field.GetLength());
         }
-        trashMemory(pdata, flength);
-        delete[] pdata;
     }
-    return retval;
 }
 
-int CItemData::WriteCommon(PWSfile *out) const
+// Adds a copy of data to raw
+static void AddRawField(CItemData::RawRecord &raw, unsigned char type,
+                        const unsigned char *data, size_t len)
+{
+    unsigned char *copy = static_cast<unsigned char *>(SecureHeap::Alloc(len));
+    if (len != 0)
+        memcpy(copy, data, len);
+    raw.Add(type, copy, len);
+}
+
+void CItemData::GetCommon(const PWSfile *out, RawRecord &raw) const
 {
     int i;
     
@@ -255,7 +311,7 @@ int CItemData::WriteCommon(PWSfile *out) const
         END};
     
     for (i = 0; TextFields[i] != END; i++)
-        WriteIfSet(TextFields[i], out, true);
+        GetIfSet(TextFields[i], raw, true);
     
     for (i = 0; TimeFields[i] != END; i++) {
         time_t t = 0;
@@ -264,10 +320,10 @@ int CItemData::WriteCommon(PWSfile *out) const
             if (out->timeFieldLen() == 4) {
                 unsigned char buf[4];
                 putInt32(buf, static_cast<int32>(t));
-                out->WriteField(static_cast<unsigned char>(TimeFields[i]), buf, out->timeFieldLen());
+                AddRawField(raw, static_cast<unsigned char>(TimeFields[i]), buf, out->timeFieldLen());
             } else if (out->timeFieldLen() == PWStime::TIME_LEN) {
                 PWStime pwt(t);
-                out->WriteField(static_cast<unsigned char>(TimeFields[i]), pwt, pwt.GetLength());
+                AddRawField(raw, static_cast<unsigned char>(TimeFields[i]), pwt, pwt.GetLength());
             } else ASSERT(0);
         } // t != 0
     }
@@ -277,14 +333,14 @@ int CItemData::WriteCommon(PWSfile *out) const
     GetXTimeInt(i32);
     if (i32 > 0 && i32 <= 3650) {
         putInt(buf32, i32);
-        out->WriteField(XTIME_INT, buf32, sizeof(int32));
+        AddRawField(raw, XTIME_INT, buf32, sizeof(int32));
     }
     
     i32 = 0;
     GetKBShortcut(i32);
     if (i32 != 0) {
         putInt(buf32, i32);
-        out->WriteField(KBSHORTCUT, buf32, sizeof(int32));
+        AddRawField(raw, KBSHORTCUT, buf32, sizeof(int32));
     }
     
     int16 i16 = 0;
@@ -292,29 +348,35 @@ int CItemData::WriteCommon(PWSfile *out) const
     GetDCA(i16);
     if (i16 >= PWSprefs::minDCA && i16 <= PWSprefs::maxDCA) {
         putInt(buf16, i16);
-        out->WriteField(DCA, buf16, sizeof(int16));
+        AddRawField(raw, DCA, buf16, sizeof(int16));
     }
     i16 = 0;
     GetShiftDCA(i16);
     if (i16 >= PWSprefs::minDCA && i16 <= PWSprefs::maxDCA) {
         putInt(buf16, i16);
-        out->WriteField(SHIFTDCA, buf16, sizeof(int16));
+        AddRawField(raw, SHIFTDCA, buf16, sizeof(int16));
     }
-    WriteIfSet(PROTECTED, out, false);
+    GetIfSet(PROTECTED, raw, false);
     
-    WriteUnknowns(out);
-    // Assume that if previous write failed, last one will too.
-    if (out->WriteField(END, _T("")) > 0) {
-        return PWSfile::SUCCESS;
-    } else {
-        return PWSfile::FAILURE;
-    }
+    GetUnknowns(raw);
 }
 
 int CItemData::Write(PWSfile *out) const
 {
-    int status = PWSfile::SUCCESS;
-    
+    RawRecord raw;
+    GetRaw(out, raw);
+    return WriteRaw(out, raw);
+}
+
+int CItemData::Write(PWSfileV4 *out) const
+{
+    RawRecord raw;
+    GetRaw(out, raw);
+    return WriteRaw(out, raw);
+}
+
+void CItemData::GetRaw(const PWSfile *out, RawRecord &raw) const
+{
     // Map different UUID types (V4 concept) to original V3 UUID
     uuid_array_t item_uuid;
     FieldType ft = END;
@@ -330,7 +392,8 @@ int CItemData::Write(PWSfile *out) const
     else ASSERT(0);
     GetUUID(item_uuid, ft);
     
-    out->WriteField(UUID, item_uuid, sizeof(uuid_array_t));
+    raw.Clear();
+    AddRawField(raw, UUID, item_uuid, sizeof(uuid_array_t));
     
     // We need to cast away constness to change Password field
     // for dependent entries
@@ -341,15 +404,13 @@ int CItemData::Write(PWSfile *out) const
     const StringX saved_password = GetPassword();
     self->SetSpecialPasswords(); // encode baseuuid in password if IsDependent
     
-    status = WriteCommon(out);
+    GetCommon(out, raw);
     
     self->SetPassword(saved_password);
-    return status;
 }
 
-int CItemData::Write(PWSfileV4 *out) const
+void CItemData::GetRaw(const PWSfileV4 *out, RawRecord &raw) const
 {
-    int status = PWSfile::SUCCESS;
     uuid_array_t item_uuid;
     
     ASSERT(HasUUID());
@@ -366,27 +427,38 @@ int CItemData::Write(PWSfileV4 *out) const
     else ASSERT(0);
     GetUUID(item_uuid, ft);
     
-    out->WriteField(static_cast<unsigned char>(ft), item_uuid,
-                    sizeof(uuid_array_t));
+    raw.Clear();
+    AddRawField(raw, static_cast<unsigned char>(ft), item_uuid,
+                sizeof(uuid_array_t));
     if (IsDependent()) {
         uuid_array_t base_uuid;
         ASSERT(IsFieldSet(BASEUUID));
         GetUUID(base_uuid, BASEUUID);
-        out->WriteField(BASEUUID, base_uuid, sizeof(uuid_array_t));
+        AddRawField(raw, BASEUUID, base_uuid, sizeof(uuid_array_t));
     }
     
     if (IsFieldSet(ATTREF)) {
         uuid_array_t ref_uuid;
         GetUUID(ref_uuid, ATTREF);
-        out->WriteField(ATTREF, ref_uuid, sizeof(uuid_array_t));
+        AddRawField(raw, ATTREF, ref_uuid, sizeof(uuid_array_t));
     }
     
-    status = WriteCommon(out);
-    
-    return status;
+    GetCommon(out, raw);
+}
+
+int CItemData::WriteRaw(PWSfile *out, const RawRecord &raw)
+{
+    for (auto iter = raw.m_fields.begin(); iter != raw.m_fields.end(); iter++)
+        out->WriteField(iter->type, iter->data, iter->len);
+    // Assume that if previous write failed, last one will too.
+    if (out->WriteField(END, _T("")) > 0) {
+        return PWSfile::SUCCESS;
+    } else {
+        return PWSfile::FAILURE;
+    }
 }
 
-int CItemData::WriteUnknowns(PWSfile *out) const
+void CItemData::GetUnknowns(RawRecord &raw) const
 {
     for (auto uiter = m_URFL.begin();
          uiter != m_URFL.end();
@@ -395,11 +467,10 @@ int CItemData::WriteUnknowns(PWSfile *out) const
         size_t length = 0;
         unsigned char *pdata = NULL;
         GetUnknownField(type, length, pdata, *uiter);
-        out->WriteField(type, pdata, length);
+        AddRawField(raw, type, pdata, length);
         trashMemory(pdata, length);
         delete[] pdata;
     }
-    return PWSfile::SUCCESS;
 }
 
 //-----------------------------------------------------------------------------
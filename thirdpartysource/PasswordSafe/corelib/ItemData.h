@@ -74,10 +74,39 @@ public:
     
     ~CItemData();
     
-    int Read(PWSfile *in);
-    int Write(PWSfile *out) const;
+    // A record's fields as read from file, before they're set in a CItemData.
+    // Owns the (plaintext!) field data, and trashes it when done.
+    class RawRecord
+    {
+    public:
+        RawRecord() {}
+        RawRecord(RawRecord &&that) : m_fields(std::move(that.m_fields)) {}
+        RawRecord &operator=(RawRecord &&that);
+        ~RawRecord() {Clear();}
+        void Add(unsigned char type, unsigned char *data, size_t len); // takes data
+        void Clear();
+        bool empty() const {return m_fields.empty();}
+    private:
+        friend class CItemData;
+        RawRecord(const RawRecord &) = delete;
+        RawRecord &operator=(const RawRecord &) = delete;
+        struct Field {unsigned char type; unsigned char *data; size_t len;};
+        std::vector<Field> m_fields;
+    };
+    
+    int Read(PWSfile *in); // ReadRaw() + SetRaw()
+    // Following split Read() for pipelined loading: ReadRaw() has to be
+    // called in file order, SetRaw() can then be done on another thread.
+    static int ReadRaw(PWSfile *in, RawRecord &raw);
+    int SetRaw(const RawRecord &raw);
+    int Write(PWSfile *out) const; // GetRaw() + WriteRaw()
     int Write(PWSfileV4 *out) const;
-    int WriteCommon(PWSfile *out) const;
+    // Following split Write() for pipelined saving: GetRaw() can be done
+    // on another thread, WriteRaw() then has to be called in file order.
+    // GetRaw() only uses out to tell which format to write.
+    void GetRaw(const PWSfile *out, RawRecord &raw) const;
+    void GetRaw(const PWSfileV4 *out, RawRecord &raw) const;
+    static int WriteRaw(PWSfile *out, const RawRecord &raw);
     
     // Convenience: Get the name associated with FieldType
     static stringT FieldName(FieldType ft);
@@ -327,8 +356,9 @@ private:
     
     void UpdatePasswordHistory(); // used by UpdatePassword()
     
-    int WriteUnknowns(PWSfile *out) const;
-    size_t WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const;
+    void GetCommon(const PWSfile *out, RawRecord &raw) const;
+    void GetUnknowns(RawRecord &raw) const;
+    void GetIfSet(FieldType ft, RawRecord &raw, bool isUTF8) const;
 };
 
 inline bool CItemData::IsTextField(unsigned char t)
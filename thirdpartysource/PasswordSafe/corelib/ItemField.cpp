@@ -8,78 +8,95 @@
 /// \file ItemField.cpp
 //-----------------------------------------------------------------------------
 
-#include <math.h>
-
 #include "ItemField.h"
 #include "Util.h"
 #include "Fish.h"
 #include "PWSrand.h"
+#include "SecureHeap.h"
 #include "os/funcwrap.h"
 
-//Returns the number of bytes of 8 byte blocks needed to store 'size' bytes
-size_t CItemField::GetBlockSize(size_t size) const
+void CItemField::CopyData(const CItemField &that)
+{
+    // Assumes m_Length == that.m_Length and nothing allocated
+    if (IsInline()) {
+        memcpy(m_u.Inline, that.m_u.Inline, INLINE_SIZE);
+    } else {
+        size_t bs = GetBlockSize(m_Length);
+        m_u.Data = new unsigned char[bs];
+        memcpy(m_u.Data, that.m_u.Data, bs);
+    }
+}
+
+void CItemField::Release()
 {
-    return static_cast<size_t>(ceil(static_cast<double>(size) / 8.0)) * 8;
+    if (!IsInline())
+        delete[] m_u.Data;
+    m_u.Data = NULL;
+    m_Length = 0;
 }
 
 CItemField::CItemField(const CItemField &that)
 : m_Type(that.m_Type), m_Length(that.m_Length)
 {
-    if (m_Length > 0) {
-        size_t bs = GetBlockSize(m_Length);
-        m_Data = new unsigned char[bs];
-        memcpy(m_Data, that.m_Data, bs);
-    } else {
-        m_Data = NULL;
-    }
+    CopyData(that);
+}
+
+CItemField::CItemField(CItemField &&that)
+: m_Type(that.m_Type), m_Length(that.m_Length), m_u(that.m_u)
+{
+    // that's heap buffer (if any) is now ours
+    that.m_u.Data = NULL;
+    that.m_Length = 0;
 }
 
 CItemField &CItemField::operator=(const CItemField &that)
 {
     if (this != &that) {
+        Release();
         m_Type = that.m_Type;
         m_Length = that.m_Length;
-        delete[] m_Data;
-        if (m_Length > 0) {
-            size_t bs = GetBlockSize(m_Length);
-            m_Data = new unsigned char[bs];
-            memcpy(m_Data, that.m_Data, bs);
-        } else {
-            m_Data = NULL;
-        }
+        CopyData(that);
     }
     return *this;
 }
 
-void CItemField::Empty()
+CItemField &CItemField::operator=(CItemField &&that)
 {
-    if (m_Data != NULL) {
-        delete[] m_Data;
-        m_Data = NULL;
-        m_Length = 0;
+    if (this != &that) {
+        Release();
+        m_Type = that.m_Type;
+        m_Length = that.m_Length;
+        m_u = that.m_u;
+        that.m_u.Data = NULL;
+        that.m_Length = 0;
     }
+    return *this;
+}
+
+void CItemField::Empty()
+{
+    Release();
 }
 
 void CItemField::Set(const unsigned char* value, size_t length,
                      const Fish *bf, unsigned char type)
 {
-    size_t BlockLength;
-    
-    m_Length = length;
-    BlockLength = GetBlockSize(m_Length);
+    Release();
     
-    delete[] m_Data;
-    
-    if (m_Length == 0) {
-        m_Data = NULL;
-    } else {
-        m_Data = new unsigned char[BlockLength];
-        if (m_Data == NULL) { // out of memory - try to fail gracefully
-            m_Length = 0; // at least keep structure consistent
-            return;
+    if (length > 0) {
+        size_t BlockLength = GetBlockSize(length);
+        unsigned char *data;
+        
+        if (BlockLength <= INLINE_SIZE) {
+            data = m_u.Inline;
+        } else {
+            data = m_u.Data = new unsigned char[BlockLength];
         }
+        m_Length = static_cast<uint32>(length);
         
-        unsigned char *tempmem = new unsigned char[BlockLength];
+        unsigned char tempbuf[INLINE_SIZE];
+        unsigned char *tempmem = (BlockLength <= INLINE_SIZE) ?
+            tempbuf : static_cast<unsigned char *>(SecureHeap::Alloc(BlockLength));
         // invariant: BlockLength >= plainlength
         memcpy_s(tempmem, BlockLength, value, m_Length);
         
@@ -88,10 +105,12 @@ void CItemField::Set(const unsigned char* value, size_t length,
         
         //Do the actual encryption
         for (size_t x = 0; x < BlockLength; x += 8)
-            bf->Encrypt(tempmem + x, m_Data + x);
+            bf->Encrypt(tempmem + x, data + x);
         
-        trashMemory(tempmem, BlockLength);
-        delete[] tempmem;
+        if (tempmem != tempbuf)
+            SecureHeap::Free(tempmem); // trashes it
+        else
+            trashMemory(tempmem, BlockLength);
     }
     if (type != 0xff)
         m_Type = type;
@@ -107,9 +126,9 @@ void CItemField::Set(const StringX &value, const Fish *bf, unsigned char type)
 
 void CItemField::Get(unsigned char *value, size_t &length, const Fish *bf) const
 {
-    // Sanity check: length is 0 iff data ptr is NULL
-    ASSERT((m_Length == 0 && m_Data == NULL) ||
-           (m_Length > 0 && m_Data != NULL));
+    // Sanity check: length is 0 iff data ptr is NULL (for out-of-line data)
+    ASSERT(m_Length > 0 || m_u.Data == NULL);
+    ASSERT(IsInline() || m_u.Data != NULL);
     /*
      * length is an in/out parameter:
      * In: size of value array - must be at least BlockLength
@@ -122,43 +141,56 @@ void CItemField::Get(unsigned char *value, size_t &length, const Fish *bf) const
     } else { // we have data to decrypt
         size_t BlockLength = GetBlockSize(m_Length);
         ASSERT(length >= BlockLength);
-        unsigned char *tempmem = new unsigned char[BlockLength];
+        const unsigned char *data = Data();
+        unsigned char tempbuf[INLINE_SIZE];
+        unsigned char *tempmem = IsInline() ?
+            tempbuf : static_cast<unsigned char *>(SecureHeap::Alloc(BlockLength));
         
         size_t x;
         for (x = 0; x < BlockLength; x += 8)
-            bf->Decrypt(m_Data + x, tempmem + x);
+            bf->Decrypt(data + x, tempmem + x);
         
         for (x = 0; x < BlockLength; x++)
             value[x] = (x < m_Length) ? tempmem[x] : 0;
         
         length = m_Length;
-        delete [] tempmem;
+        if (tempmem != tempbuf)
+            SecureHeap::Free(tempmem); // trashes it
+        else
+            trashMemory(tempmem, BlockLength);
     }
 }
 
 void CItemField::Get(StringX &value, const Fish *bf) const
 {
-    // Sanity check: length is 0 iff data ptr is NULL
-    ASSERT((m_Length == 0 && m_Data == NULL) ||
-           (m_Length > 0 && m_Data != NULL && m_Length % sizeof(TCHAR) == 0));
+    // Sanity check: length is 0 iff data ptr is NULL (for out-of-line data)
+    ASSERT(m_Length > 0 || m_u.Data == NULL);
+    ASSERT(IsInline() || m_u.Data != NULL);
+    ASSERT(m_Length % sizeof(TCHAR) == 0);
     
     if (m_Length == 0) {
         value = _T("");
     } else { // we have data to decrypt
         size_t BlockLength = GetBlockSize(m_Length);
-        unsigned char *tempmem = new unsigned char[BlockLength];
+        const unsigned char *data = Data();
+        // tempbuf is a TCHAR array so that pt below is suitably aligned
+        TCHAR tempbuf[INLINE_SIZE / sizeof(TCHAR)];
+        unsigned char *tempmem = IsInline() ?
+            reinterpret_cast<unsigned char *>(tempbuf) :
+            static_cast<unsigned char *>(SecureHeap::Alloc(BlockLength));
         TCHAR *pt = reinterpret_cast<TCHAR *>(tempmem);
         size_t x;
         
         // decrypt block by block
         for (x = 0; x < BlockLength; x += 8)
-            bf->Decrypt(m_Data + x, tempmem + x);
+            bf->Decrypt(data + x, tempmem + x);
         
         // copy to value TCHAR by TCHAR
-        for (x = 0; x < m_Length/sizeof(TCHAR); x++)
-            value += pt[x];
+        value.append(pt, m_Length/sizeof(TCHAR));
         
-        trashMemory(tempmem, BlockLength);
-        delete [] tempmem;
+        if (!IsInline())
+            SecureHeap::Free(tempmem); // trashes it
+        else
+            trashMemory(tempmem, BlockLength);
     }
 }
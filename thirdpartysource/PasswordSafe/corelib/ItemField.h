@@ -12,6 +12,7 @@
 #define __ITEMFIELD_H
 
 #include "StringX.h"
+#include "os/typedefs.h"
 
 //-----------------------------------------------------------------------------
 
@@ -26,12 +27,14 @@ class Fish;
 class CItemField
 {
 public:
-    explicit CItemField(unsigned char type = 0xff): m_Type(type), m_Length(0), m_Data(NULL)
-    {}
+    explicit CItemField(unsigned char type = 0xff): m_Type(type), m_Length(0)
+    {m_u.Data = NULL;}
     CItemField(const CItemField &that); // copy ctor
-    ~CItemField() {if (m_Length > 0) delete[] m_Data;}
+    CItemField(CItemField &&that);      // move ctor
+    ~CItemField() {Release();}
     
     CItemField &operator=(const CItemField &that);
+    CItemField &operator=(CItemField &&that);
     
     void Set(const StringX &value, const Fish *bf, unsigned char type = 0xff);
     void Set(const unsigned char* value, size_t length, const Fish *bf, unsigned char type = 0xff);
@@ -45,12 +48,25 @@ public:
     void Empty();
     
 private:
+    // Fields whose encrypted form fits in INLINE_SIZE bytes (times, UUIDs,
+    // short strings...) are stored in the object itself, saving a heap
+    // allocation per field, and per copy.
+    enum {INLINE_SIZE = 16};
+    
     //Number of 8 byte blocks needed for size
-    size_t GetBlockSize(size_t size) const;
+    static size_t GetBlockSize(size_t size) {return ((size + 7) / 8) * 8;}
+    bool IsInline() const {return GetBlockSize(m_Length) <= INLINE_SIZE;}
+    unsigned char *Data() {return IsInline() ? m_u.Inline : m_u.Data;}
+    const unsigned char *Data() const {return IsInline() ? m_u.Inline : m_u.Data;}
+    void CopyData(const CItemField &that);
+    void Release();
     
     unsigned char m_Type; // almost const
-    size_t m_Length;
-    unsigned char *m_Data;
+    uint32 m_Length;
+    union {
+        unsigned char *Data; // when !IsInline()
+        unsigned char Inline[INLINE_SIZE];
+    } m_u;
 };
 
 #endif /* __ITEMFIELD_H */
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+#include "PWSJournal.h"
+#include "PWSrand.h"
+#include "Util.h"
+#include "SecureHeap.h"
+
+#include "os/debug.h"
+#include "os/file.h"
+
+static const char JNLTAG[4] = {'P','W','S','J'}; // ASCII chars, not wchar
+static const TCHAR JNL_SUFFIX[] = _T(".jnl");
+
+StringX PWSJournal::JournalName(const StringX &dbname)
+{
+    return dbname + JNL_SUFFIX;
+}
+
+bool PWSJournal::Exists(const StringX &dbname)
+{
+    return pws_os::FileExists(JournalName(dbname).c_str());
+}
+
+bool PWSJournal::Remove(const StringX &dbname)
+{
+    const stringT fname(JournalName(dbname).c_str());
+    return !pws_os::FileExists(fname) || pws_os::DeleteAFile(fname);
+}
+
+PWSJournal::PWSJournal(const StringX &dbname, RWmode mode)
+: PWSfile(JournalName(dbname), mode, V30), m_nEntries(0)
+{
+    m_IV = m_ipthing;
+    m_terminal = NULL;
+}
+
+PWSJournal::~PWSJournal()
+{
+    trashMemory(m_key, sizeof(m_key));
+    trashMemory(m_hkey, sizeof(m_hkey));
+}
+
+int PWSJournal::Open(const StringX &)
+{
+    ASSERT(0); // see Open(const PWSfile &)
+    return FAILURE;
+}
+
+int PWSJournal::Open(const PWSfile &db)
+{
+    unsigned char base[SHA256::HASHLEN];
+
+    m_status = SUCCESS;
+    m_nEntries = 0;
+    if (!db.GetJournalKeys(m_key, m_hkey, base))
+        return UNSUPPORTED_VERSION;
+
+    // The header's HMAC starts the chain
+    m_hmac.Init(m_hkey, sizeof(m_hkey));
+    m_hmac.Update(reinterpret_cast<const unsigned char *>(JNLTAG),
+                  sizeof(JNLTAG));
+    m_hmac.Update(base, sizeof(base));
+    m_hmac.Final(m_chain);
+
+    if (m_rw == Read) {
+        FOpen();
+        if (m_fd == NULL)
+            return CANT_OPEN_FILE;
+        m_status = ReadHeader(base);
+    } else {
+        m_status = OpenForAppend(base);
+    }
+    if (m_status != SUCCESS) {
+        PWSfile::Close();
+        return m_status;
+    }
+
+    m_fish = new TwoFish(m_key, sizeof(m_key));
+    return SUCCESS;
+}
+
+int PWSJournal::Close()
+{
+    const int rc = PWSfile::Close();
+    // A bad entry trumps whatever else happened
+    return (m_status != SUCCESS) ? m_status : rc;
+}
+
+int PWSJournal::ReadHeader(const unsigned char base[SHA256::HASHLEN])
+{
+    char tag[sizeof(JNLTAG)];
+    unsigned char b[SHA256::HASHLEN], h[SHA256::HASHLEN];
+
+    if (fread(tag, sizeof(tag), 1, m_fd) != 1 ||
+        fread(b, sizeof(b), 1, m_fd) != 1 ||
+        fread(h, sizeof(h), 1, m_fd) != 1)
+        return TRUNCATED_FILE;
+    if (memcmp(tag, JNLTAG, sizeof(tag)) != 0)
+        return FAILURE;
+    if (memcmp(b, base, sizeof(b)) != 0)
+        return WRONG_VERSION; // stale, database's been rewritten since
+    if (memcmp(h, m_chain, sizeof(h)) != 0)
+        return BAD_DIGEST;
+    return SUCCESS;
+}
+
+int PWSJournal::WriteHeader(const unsigned char base[SHA256::HASHLEN])
+{
+    if (fwrite(JNLTAG, sizeof(JNLTAG), 1, m_fd) != 1 ||
+        fwrite(base, SHA256::HASHLEN, 1, m_fd) != 1 ||
+        fwrite(m_chain, sizeof(m_chain), 1, m_fd) != 1 ||
+        !pws_os::FSync(m_fd))
+        return WRITE_FAIL;
+    return SUCCESS;
+}
+
+int PWSJournal::OpenForAppend(const unsigned char base[SHA256::HASHLEN])
+{
+    /**
+     * If there's a journal for this generation of the database, we carry
+     * on from its last entry's HMAC, which is simply the file's last
+     * SHA256::HASHLEN bytes. This doesn't re-verify the chain: that's
+     * done when the journal's read, and a journal that fails then should
+     * be folded into the database (and removed) before it's appended to.
+     */
+    const long hdrLen = long(sizeof(JNLTAG) + 2 * SHA256::HASHLEN);
+    const stringT fname(m_filename.c_str());
+    int status = CANT_OPEN_FILE;
+
+    m_fd = pws_os::FOpen(fname, _T("rb"));
+    if (m_fd != NULL) {
+        status = ReadHeader(base);
+        if (status == SUCCESS &&
+            pws_os::fileLength(m_fd) > ulong64(hdrLen) &&
+            (fseek(m_fd, -long(sizeof(m_chain)), SEEK_END) != 0 ||
+             fread(m_chain, sizeof(m_chain), 1, m_fd) != 1))
+            status = READ_FAIL;
+        fclose(m_fd);
+        m_fd = NULL;
+    }
+
+    if (status == SUCCESS) {
+        m_fd = pws_os::FOpen(fname, _T("ab"));
+        return (m_fd != NULL) ? SUCCESS : CANT_OPEN_FILE;
+    }
+
+    // No journal, or not one we can append to: start a new one.
+    // Not via FOpen(), as entries must be on disk as soon as they're
+    // written, not when we're closed.
+    m_fd = pws_os::FOpen(fname, _T("wb"));
+    if (m_fd == NULL)
+        return CANT_OPEN_FILE;
+    return WriteHeader(base);
+}
+
+size_t PWSJournal::WriteCBC(unsigned char type, const StringX &data)
+{
+    const unsigned char *utf8(nullptr);
+    size_t utf8Len(0);
+
+    bool status = m_utf8conv.ToUTF8(data, utf8, utf8Len);
+    if (!status)
+        pws_os::Trace(_T("ToUTF8(%ls) failed\n"), data.c_str());
+    return WriteCBC(type, utf8, utf8Len);
+}
+
+size_t PWSJournal::WriteCBC(unsigned char type, const unsigned char *data,
+                            size_t length)
+{
+    m_hmac.Update(&type, 1);
+    if (length > 0)
+        m_hmac.Update(data, static_cast<unsigned long>(length));
+    return PWSfile::WriteCBC(type, data, length);
+}
+
+size_t PWSJournal::ReadCBC(unsigned char &type, unsigned char* &data,
+                           size_t &length)
+{
+    size_t numRead = PWSfile::ReadCBC(type, data, length);
+
+    if (numRead > 0) {
+        m_hmac.Update(&type, 1);
+        if (length > 0)
+            m_hmac.Update(data, static_cast<unsigned long>(length));
+    }
+    return numRead;
+}
+
+int PWSJournal::WriteEntry(Op op, const CItemData &item)
+{
+    ASSERT(m_fd != NULL && m_rw == Write);
+    if (m_status != SUCCESS)
+        return m_status;
+
+    // Each entry gets its own IV: entries depend on each other only
+    // via the HMAC chain.
+    PWSrand::GetInstance()->GetRandomData(m_ipthing, sizeof(m_ipthing));
+    if (fwrite(m_ipthing, sizeof(m_ipthing), 1, m_fd) != 1)
+        return m_status = WRITE_FAIL;
+
+    m_hmac.Init(m_hkey, sizeof(m_hkey));
+    m_hmac.Update(m_chain, sizeof(m_chain));
+    m_hmac.Update(m_ipthing, sizeof(m_ipthing));
+
+    int status = SUCCESS;
+    try { // _writecbc throws on write error
+        const unsigned char opb = static_cast<unsigned char>(op);
+        WriteField(JNL_OPFIELD, &opb, sizeof(opb));
+        if (op == JNL_DELETE) {
+            uuid_array_t uuid;
+            item.GetUUID(uuid);
+            WriteField(CItemData::UUID, uuid, sizeof(uuid));
+            if (WriteField(CItemData::END, _T("")) == 0)
+                status = WRITE_FAIL;
+        } else {
+            // Write(PWSfile *) is the V3 flavour, which leaves out
+            // a V4 entry's attachment reference
+            if (item.HasAttRef()) {
+                uuid_array_t ref_uuid;
+                item.GetUUID(ref_uuid, CItemData::ATTREF);
+                WriteField(CItemData::ATTREF, ref_uuid, sizeof(ref_uuid));
+            }
+            status = item.Write(this);
+        }
+    } catch (...) {
+        status = WRITE_FAIL;
+    }
+
+    if (status == SUCCESS) {
+        m_hmac.Final(m_chain);
+        // On disk before we say it's saved
+        if (fwrite(m_chain, sizeof(m_chain), 1, m_fd) != 1 ||
+            !pws_os::FSync(m_fd))
+            status = WRITE_FAIL;
+    }
+    if (status == SUCCESS)
+        m_nEntries++;
+    else
+        m_status = status; // Journal's torn, refuse to append to it
+    return status;
+}
+
+int PWSJournal::ReadEntry(Op &op, CItemData &item)
+{
+    ASSERT(m_fd != NULL && m_rw == Read);
+    if (m_status != SUCCESS)
+        return m_status;
+
+    const size_t nIV = fread(m_ipthing, 1, sizeof(m_ipthing), m_fd);
+    if (nIV == 0 && feof(m_fd))
+        return END_OF_FILE;
+    if (nIV != sizeof(m_ipthing))
+        return m_status = BAD_DIGEST;
+
+    m_hmac.Init(m_hkey, sizeof(m_hkey));
+    m_hmac.Update(m_chain, sizeof(m_chain));
+    m_hmac.Update(m_ipthing, sizeof(m_ipthing));
+
+    unsigned char type = CItemData::END;
+    unsigned char *opb = NULL;
+    size_t oplen = 0;
+    unsigned char opv = 0;
+    if (ReadField(type, opb, oplen) > 0 && type == JNL_OPFIELD && oplen == 1)
+        opv = opb[0];
+    if (opb != NULL) {
+        SecureHeap::Free(opb);
+    }
+
+    CItemData::RawRecord raw;
+    if (opv < JNL_ADD || opv > JNL_DELETE ||
+        CItemData::ReadRaw(this, raw) != SUCCESS)
+        return m_status = BAD_DIGEST;
+
+    unsigned char digest[SHA256::HASHLEN], h[SHA256::HASHLEN];
+    m_hmac.Final(digest);
+    if (fread(h, sizeof(h), 1, m_fd) != 1 ||
+        memcmp(h, digest, sizeof(h)) != 0)
+        return m_status = BAD_DIGEST;
+    memcpy(m_chain, digest, sizeof(m_chain));
+
+    m_nEntries++;
+    op = static_cast<Op>(opv);
+    return item.SetRaw(raw);
+}
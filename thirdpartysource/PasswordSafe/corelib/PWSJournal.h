@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+#ifndef __PWSJOURNAL_H
+#define __PWSJOURNAL_H
+
+// PWSJournal.h
+// An encrypted, append-only log of changes made to a V3 or V4 database
+// since it was last written, kept next to it in a sidecar file. Saving
+// an edit costs one entry instead of a rewrite of the whole database.
+//
+// A journal is keyed to the generation of the database it was started
+// against (see PWSfile::GetJournalKeys), so once the database is
+// rewritten, its journal's simply ignored - and should be removed.
+//
+// Format: "PWSJ" | database HMAC (32) | HMAC(tag | database HMAC)
+// followed by entries, each of which is
+// IV (16) | CBC fields: op, record's fields, END | HMAC (32)
+// where each entry's HMAC is over the previous one's (or the header's)
+// and its own IV & plaintext fields, chaining the entries together.
+//-----------------------------------------------------------------------------
+
+#include "PWSfile.h"
+#include "TwoFish.h"
+#include "sha256.h"
+#include "hmac.h"
+#include "UTF8Conv.h"
+
+class PWSJournal : public PWSfile
+{
+public:
+    enum Op {JNL_ADD = 1, JNL_UPDATE = 2, JNL_DELETE = 3};
+
+    static StringX JournalName(const StringX &dbname);
+    static bool Exists(const StringX &dbname);
+    // Call once dbname's been rewritten, folding in the journal's changes
+    static bool Remove(const StringX &dbname);
+
+    PWSJournal(const StringX &dbname, RWmode mode);
+    ~PWSJournal();
+
+    // Journals are keyed by their database rather than a passkey.
+    // db must have been read or written successfully (and closed).
+    // Read returns CANT_OPEN_FILE if there's no journal, and
+    // WRONG_VERSION if it's from another generation of the database.
+    // Write appends to the current journal, or starts a new one.
+    int Open(const PWSfile &db);
+    virtual int Open(const StringX &passkey);
+    virtual int Close();
+
+    // Deleting an entry only records item's UUID.
+    int WriteEntry(Op op, const CItemData &item);
+    // Returns SUCCESS, END_OF_FILE after the last entry, or BAD_DIGEST
+    // if an entry fails verification, e.g., if we crashed mid-append.
+    // Nothing is read past a bad entry.
+    int ReadEntry(Op &op, CItemData &item);
+
+    // Entries aren't records - use WriteEntry() and ReadEntry()
+    virtual int WriteRecord(const CItemData &) {return UNSUPPORTED_VERSION;}
+    virtual int ReadRecord(CItemData &) {return UNSUPPORTED_VERSION;}
+
+    // Entries hold V4-sized times, which V3 reads just as well
+    virtual size_t timeFieldLen() const {return 5;}
+
+    size_t GetNumEntries() const {return m_nEntries;}
+
+private:
+    enum {JNL_OPFIELD = 0xfe}; // first field of every entry
+    unsigned char m_key[SHA256::HASHLEN];
+    unsigned char m_hkey[SHA256::HASHLEN];
+    unsigned char m_chain[SHA256::HASHLEN]; // last entry's HMAC
+    unsigned char m_ipthing[TwoFish::BLOCKSIZE]; // for CBC, per entry
+    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> m_hmac;
+    CUTF8Conv m_utf8conv;
+    size_t m_nEntries;
+
+    virtual size_t WriteCBC(unsigned char type, const StringX &data);
+    virtual size_t WriteCBC(unsigned char type, const unsigned char *data,
+                            size_t length);
+    virtual size_t ReadCBC(unsigned char &type, unsigned char* &data,
+                           size_t &length);
+
+    int ReadHeader(const unsigned char base[SHA256::HASHLEN]);
+    int WriteHeader(const unsigned char base[SHA256::HASHLEN]);
+    int OpenForAppend(const unsigned char base[SHA256::HASHLEN]);
+};
+#endif /* __PWSJOURNAL_H */
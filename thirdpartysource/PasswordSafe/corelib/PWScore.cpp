@@ -9,8 +9,10 @@
 //-----------------------------------------------------------------------------
 
 #include "PWScore.h"
+#include "PWSJournal.h"
 #include "core.h"
 #include "TwoFish.h"
+#include "sha256.h"
 #include "PWSprefs.h"
 #include "PWHistory.h"
 #include "PWSrand.h"
@@ -20,6 +22,7 @@
 #include "Report.h"
 #include "VerifyFormat.h"
 #include "StringXStream.h"
+#include "SecureHeap.h"
 
 #include "os/pws_tchar.h"
 #include "os/typedefs.h"
@@ -28,6 +31,7 @@
 #include "os/file.h"
 #include "os/mem.h"
 #include "os/logit.h"
+#include "os/env.h"
 
 #include <iostream>
 #include <iomanip>
@@ -37,6 +41,11 @@
 #include <algorithm>
 #include <set>
 #include <iterator>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <errno.h>
 
 extern const TCHAR *GROUPTITLEUSERINCHEVRONS;
 
@@ -128,13 +137,14 @@ struct st_ValidateResults {
 PWScore::PWScore() :
 m_isAuxCore(false),
 m_currfile(_T("")),
-m_passkey(NULL), m_passkey_len(0),
+m_passkey(NULL), m_passkey_len(0), m_stretchedKey(NULL),
 m_hashIters(MIN_HASH_ITERATIONS),
 m_lockFileHandle(INVALID_HANDLE_VALUE),
 m_lockFileHandle2(INVALID_HANDLE_VALUE),
 m_LockCount(0), m_LockCount2(0),
 m_ReadFileVersion(PWSfile::UNKNOWN_VERSION),
 m_bIsReadOnly(false), m_bIsOpen(false),
+m_bGTUIndexValid(false),
 m_nRecordsWithUnknownFields(0),
 m_bNotifyDB(false), m_pUIIF(NULL), m_pFileSig(NULL),
 m_iAppHotKey(0), m_DBCurrentState(CLEAN)
@@ -148,6 +158,7 @@ m_iAppHotKey(0), m_DBCurrentState(CLEAN)
             pws_os::Trace(_T("pws_os::mcryptProtect failed"));
         }
     }
+    PWSrand::GetInstance()->GetRandomData(m_GTUKey, sizeof(m_GTUKey));
     m_undo_iter = m_redo_iter = m_vpcommands.end();
     m_undo_DBState_iter = m_redo_DBState_iter = m_vDBState.end();
 }
@@ -163,6 +174,7 @@ PWScore::~PWScore()
         m_passkey = NULL;
         m_passkey_len = 0;
     }
+    ClearStretchedKey();
     
     m_UHFL.clear();
     m_vModifiedNodes.clear();
@@ -233,7 +245,7 @@ void PWScore::SortDependents(UUIDVector &dlist, std::vector<StringX> &vsxDepende
     UUIDVectorIter diter;
     
     for (diter = dlist.begin(); diter != dlist.end(); diter++) {
-        iter = Find(*diter);
+        iter = m_pwlist.find(*diter);
         if (iter != GetEntryEndIter()) {
             StringX sx_dependent;
             sx_dependent = _T("[") +
@@ -253,6 +265,7 @@ void PWScore::DoAddEntry(const CItemData &item, const CItemAtt *att)
     // Also "UndoDeleteEntry" !
     ASSERT(m_pwlist.find(item.GetUUID()) == m_pwlist.end());
     m_pwlist[item.GetUUID()] = item;
+    IndexEntry(item);
     
     if (item.NumberUnknownFields() > 0)
         IncrementNumRecordsWithUnknownFields();
@@ -338,7 +351,7 @@ void PWScore::DoDeleteEntry(const CItemData &item)
             ItemMMap deps(m_base2shortcuts_mmap.lower_bound(entry_uuid),
                           m_base2shortcuts_mmap.upper_bound(entry_uuid));
             for (ItemMMapIter iter = deps.begin(); iter != deps.end(); iter++) {
-                CItemData depItem = Find(iter->second)->second;
+                CItemData depItem = m_pwlist.find(iter->second)->second;
                 // Set deleted for GUIRefreshEntry() which will remove from display
                 depItem.SetStatus(CItemData::ES_DELETED);
                 GUIRefreshEntry(depItem);
@@ -354,6 +367,7 @@ void PWScore::DoDeleteEntry(const CItemData &item)
             VERIFY(DelKBShortcut(iKBShortcut, item.GetUUID()));
         
         m_pwlist.erase(pos); // at last!
+        UnindexEntry(entry_uuid);
         
         if (item.NumberUnknownFields() > 0)
             DecrementNumRecordsWithUnknownFields();
@@ -377,6 +391,7 @@ void PWScore::DoReplaceEntry(const CItemData &old_ci, const CItemData &new_ci)
     // Assumes that old_uuid == new_uuid
     ASSERT(old_ci.GetUUID() == new_ci.GetUUID());
     m_pwlist[old_ci.GetUUID()] = new_ci;
+    IndexEntry(new_ci);
     if (old_ci.GetEntryType() != new_ci.GetEntryType() || old_ci.GetStatus() != new_ci.GetStatus() ||
         old_ci.IsProtected() != new_ci.IsProtected())
         GUIRefreshEntry(new_ci);
@@ -439,9 +454,11 @@ void PWScore::ClearDBData()
         m_passkey_len = 0;
     }
     m_passkey = NULL;
+    ClearStretchedKey();
     
     //Composed of ciphertext, so doesn't need to be overwritten
     m_pwlist.clear();
+    InvalidateGTUIndex();
     m_attlist.clear();
     
     // Clear out out dependents mappings
@@ -505,6 +522,149 @@ void PWScore::NewFile(const StringX &passkey)
     ClearDBData();
     SetPassKey(passkey);
     m_ReadFileVersion = PWSfile::VCURRENT;
+    SetHashIters(PWSfile::CalibrateHashIters(m_ReadFileVersion));
+}
+
+/*
+ * Pipelined loading and saving, used by ReadFile() and WriteFile() for
+ * V3 and later:
+ * Reading or writing records (CBC, HMAC) has to be done in file order,
+ * on one thread. What follows reading - UTF-8 conversion, field parsing
+ * and re-encryption for in-memory storage (CItemData::SetRaw()) - and
+ * what precedes writing - the reverse (CItemData::GetRaw()) - is
+ * independent per record, and is done by a pool of workers, a batch of
+ * records at a time. Finished batches are handed back in the order they
+ * were pushed, so the file thread sees the same sequence it would have
+ * without this.
+ * There's one worker per core but one, up to 8, and no pipeline on a
+ * single core. PWS_RECORD_WORKERS, if set, overrides the number of
+ * workers (0 for none), so that tests can compare both paths anywhere.
+ */
+template <typename In, typename Out>
+class RecordPipeline
+{
+public:
+    enum {BATCHSIZE = 64, MAXINFLIGHT = 16}; // records, batches
+    typedef std::vector<In> InBatch;
+    typedef std::vector<Out> OutBatch;
+    typedef std::function<void(In &, Out &)> Stage; // run by workers
+    
+    RecordPipeline(unsigned nWorkers, Stage stage);
+    ~RecordPipeline();
+    
+    void Push(InBatch &batch); // takes batch's contents
+    // Gets next batch in order. If bWait, blocks until it's ready,
+    // returning false iff all batches have been popped and Finish() called.
+    bool Pop(OutBatch &results, bool bWait);
+    void Finish(); // no more Push()es
+    size_t InFlight() const {return m_nPushed - m_nPopped;} // caller's thread only
+    
+private:
+    void Work();
+    
+    Stage m_stage;
+    std::mutex m_mutex;
+    std::condition_variable m_cvWork, m_cvDone;
+    std::deque<std::pair<size_t, InBatch> > m_todo;
+    std::map<size_t, OutBatch> m_done;
+    size_t m_nPushed, m_nPopped;
+    bool m_bFinished;
+    std::vector<std::thread> m_workers;
+};
+
+template <typename In, typename Out>
+RecordPipeline<In, Out>::RecordPipeline(unsigned nWorkers, Stage stage)
+: m_stage(stage), m_nPushed(0), m_nPopped(0), m_bFinished(false)
+{
+    for (unsigned i = 0; i < nWorkers; i++)
+        m_workers.push_back(std::thread(&RecordPipeline::Work, this));
+}
+
+template <typename In, typename Out>
+RecordPipeline<In, Out>::~RecordPipeline()
+{
+    Finish();
+    for (auto iter = m_workers.begin(); iter != m_workers.end(); iter++)
+        iter->join();
+}
+
+template <typename In, typename Out>
+void RecordPipeline<In, Out>::Push(InBatch &batch)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_todo.push_back(std::make_pair(m_nPushed++, std::move(batch)));
+    batch.clear();
+    m_cvWork.notify_one();
+}
+
+template <typename In, typename Out>
+bool RecordPipeline<In, Out>::Pop(OutBatch &results, bool bWait)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (bWait)
+        m_cvDone.wait(lock, [this] {
+            return m_done.find(m_nPopped) != m_done.end() ||
+                   (m_bFinished && m_nPopped == m_nPushed);
+        });
+    auto iter = m_done.find(m_nPopped);
+    if (iter == m_done.end())
+        return false;
+    results = std::move(iter->second);
+    m_done.erase(iter);
+    m_nPopped++;
+    return true;
+}
+
+template <typename In, typename Out>
+void RecordPipeline<In, Out>::Finish()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bFinished = true;
+    m_cvWork.notify_all();
+    m_cvDone.notify_all();
+}
+
+template <typename In, typename Out>
+void RecordPipeline<In, Out>::Work()
+{
+    for (;;) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cvWork.wait(lock, [this] {return !m_todo.empty() || m_bFinished;});
+        if (m_todo.empty())
+            return; // finished
+        std::pair<size_t, InBatch> job(m_todo.front().first,
+                                       std::move(m_todo.front().second));
+        m_todo.pop_front();
+        lock.unlock();
+        
+        OutBatch results(job.second.size());
+        for (size_t i = 0; i < job.second.size(); i++)
+            m_stage(job.second[i], results[i]);
+        job.second.clear(); // trashes plaintext, if any
+        
+        lock.lock();
+        m_done[job.first] = std::move(results);
+        m_cvDone.notify_one();
+    }
+}
+
+struct LoadedRecord {
+    LoadedRecord() : status(PWSfile::SUCCESS) {}
+    int status;
+    CItemData item;
+};
+typedef RecordPipeline<CItemData::RawRecord, LoadedRecord> LoadPipeline;
+typedef RecordPipeline<const CItemData *, CItemData::RawRecord> SavePipeline;
+
+static unsigned RecordWorkers()
+{
+    const stringT env = pws_os::getenv("PWS_RECORD_WORKERS", false);
+    if (!env.empty()) {
+        const int n = _ttoi(env.c_str());
+        return n < 0 ? 0 : std::min(unsigned(n), 8u);
+    }
+    const unsigned nCores = std::thread::hardware_concurrency();
+    return nCores > 1 ? std::min(nCores - 1, 8u) : 0;
 }
 
 // functor object type for for_each:
@@ -568,12 +728,20 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
     m_hdr.m_RUEList = m_RUEList;
     
     out->SetHeader(m_hdr);
+    out->SetRecordCount(static_cast<int>(m_pwlist.size()));
     out->SetUnknownHeaderFields(m_UHFL);
     out->SetNHashIters(GetHashIters());
     out->SetDBFilters(m_MapDBFilters);
     out->SetPasswordPolicies(m_MapPSWDPLC);
     out->SetEmptyGroups(m_vEmptyGroups);
     
+    PWSfile::StretchedKey sk;
+    if (GetStretchedKey(sk))
+        out->SetStretchedKey(sk);
+    sk.Clear();
+    
+    std::vector<CItemAtt> moved_atts; // see below
+    
     try { // exception thrown on write error
         status = out->Open(GetPassKey());
         
@@ -586,15 +754,69 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
             return status;
         }
         
-        RecordWriter write_record(out, this, version);
-        for_each(m_pwlist.begin(), m_pwlist.end(), write_record);
+        if (out->GetStretchedKey(sk))
+            SetStretchedKey(sk);
+        sk.Clear();
+        
+        const unsigned nWorkers = RecordWorkers();
+        
+        if (version >= PWSfile::V30 && nWorkers > 0) {
+            // See RecordPipeline above.
+            // Workers get entries' fields, we write them in order.
+            SavePipeline pipeline(nWorkers,
+                                  [out](const CItemData *&pci, CItemData::RawRecord &raw)
+                                  {out->GetRawRecord(*pci, raw);});
+            SavePipeline::InBatch batch;
+            SavePipeline::OutBatch raws;
+            auto writeRaws = [&]() {
+                for (auto iter = raws.begin(); iter != raws.end(); iter++)
+                    out->WriteRawRecord(*iter);
+                raws.clear(); // trashes plaintext
+            };
+            
+            for (auto iter = m_pwlist.begin(); iter != m_pwlist.end(); iter++) {
+                batch.push_back(&iter->second);
+                if (batch.size() == SavePipeline::BATCHSIZE)
+                    pipeline.Push(batch);
+                
+                // Write whatever's ready, wait if we're too far ahead
+                while (pipeline.Pop(raws,
+                                    pipeline.InFlight() > SavePipeline::MAXINFLIGHT))
+                    writeRaws();
+            }
+            if (!batch.empty())
+                pipeline.Push(batch);
+            
+            pipeline.Finish();
+            while (pipeline.Pop(raws, true))
+                writeRaws();
+            
+            for (auto iter = m_pwlist.begin(); iter != m_pwlist.end(); iter++)
+                iter->second.ClearStatus();
+        } else {
+            RecordWriter write_record(out, this, version);
+            for_each(m_pwlist.begin(), m_pwlist.end(), write_record);
+        }
         
-        // Write attachments (only from V4)
+        // Write attachments (only from V4).
+        // Those whose content was left in the file we're replacing (see
+        // CItemAtt::Read) are copied from it, and will have to refer to
+        // the copy once it's been replaced.
         if (version >= PWSfile::V40)
             for_each(m_attlist.begin(), m_attlist.end(),
                      [&](std::pair<CUUID const, CItemAtt> &p)
                      {
-                         p.second.Write(out);
+                         int astatus;
+                         if (p.second.IsContentOnDisk() &&
+                             p.second.GetContentFile() == filename) {
+                             CItemAtt att(p.second);
+                             astatus = att.Write(out, filename);
+                             moved_atts.push_back(att);
+                         } else
+                             astatus = p.second.Write(out);
+                         // Fails if content left on disk can't be read
+                         if (astatus != PWSfile::SUCCESS)
+                             throw(EIO);
                      } );
         
         // Update header if V30 or later (no headers before V30)
@@ -604,7 +826,7 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
     }
     
     catch (...) {
-        out->Close();
+        out->Abandon(); // leaves filename as it was
         delete out;
         
         if (version < m_ReadFileVersion) // Exporting - restore saved header
@@ -613,9 +835,23 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
         return FAILURE;
     }
     
-    out->Close();
+    // Replaces filename, if all's well
+    const int closeStatus = out->Close();
     delete out;
     
+    if (closeStatus != PWSfile::SUCCESS) {
+        if (version < m_ReadFileVersion) // Exporting - restore saved header
+            m_hdr = saved_hdr;
+        
+        return closeStatus;
+    }
+    
+    for (auto &att : moved_atts)
+        m_attlist[att.GetUUID()] = att;
+    
+    // Anything journaled against the previous file is in this one
+    PWSJournal::Remove(filename);
+    
     // Update info only if written version is same as read version
     // (otherwise we're exporting, not saving)
     if (version == m_ReadFileVersion) {
@@ -791,14 +1027,14 @@ int PWScore::WriteExportFile(const StringX &filename, OrderedItemList *pOIL,
         
     }
     catch (...) {
-        out->Close();
+        out->Abandon();
         delete out;
         return FAILURE;
     }
-    out->Close();
+    status = out->Close();
     delete out;
     
-    return SUCCESS;
+    return status;
 }
 
 void PWScore::ClearCommands()
@@ -995,9 +1231,14 @@ int PWScore::CheckPasskey(const StringX &filename, const StringX &passkey)
 {
     int status;
     
-    if (!filename.empty())
-        status = PWSfile::CheckPasskey(filename, passkey, m_ReadFileVersion);
-    else { // can happen if tries to export b4 save
+    if (!filename.empty()) {
+        PWSfile::StretchedKey sk;
+        GetStretchedKey(sk);
+        status = PWSfile::CheckPasskey(filename, passkey, m_ReadFileVersion, &sk);
+        if (status == PWSfile::SUCCESS && sk.IsSet())
+            SetStretchedKey(sk);
+        sk.Clear();
+    } else { // can happen if tries to export b4 save
         size_t t_passkey_len = passkey.length();
         if (t_passkey_len != m_passkey_len) // trivial test
             return WRONG_PASSWORD;
@@ -1108,7 +1349,7 @@ void PWScore::ProcessReadEntry(CItemData &ci_temp,
     }
     
     // Finally, add it to the list!
-    m_pwlist.insert(std::make_pair(ci_temp.GetUUID(), ci_temp));
+    IndexEntry(m_pwlist.insert(std::make_pair(ci_temp.GetUUID(), ci_temp)).first->second);
 }
 
 static void ReportReadErrors(CReport *pRpt,
@@ -1178,6 +1419,12 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
         return status;
     }
     
+    // CheckPasskey() has usually just stretched a_passkey for us
+    PWSfile::StretchedKey sk;
+    if (GetStretchedKey(sk))
+        in->SetStretchedKey(sk);
+    sk.Clear();
+    
     status = in->Open(a_passkey);
     
     // in the old times we could open even 1.x files
@@ -1235,6 +1482,9 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
     ClearDBData(); // Before overwriting old data, but after opening the file...
     
     SetPassKey(a_passkey); // so user won't be prompted for saves
+    if (in->GetStretchedKey(sk))
+        SetStretchedKey(sk); // ...nor wait for them
+    sk.Clear();
     
     CItemData ci_temp;
     bool go = true;
@@ -1256,53 +1506,128 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
         pRpt->StartReport(cs_title.c_str(), m_currfile.c_str());
     }
     
-    do {
-        ci_temp.Clear(); // Rather than creating a new one each time.
-        status = in->ReadRecord(ci_temp);
-        switch (status) {
-            case PWSfile::FAILURE:
-            {
-                // Show a useful(?) error message - better than
-                // silently losing data (but not by much)
-                // Best if title intact. What to do if not?
-                if (m_pReporter != NULL) {
-                    stringT cs_msg, cs_caption;
-                    LoadAString(cs_caption, IDSC_READ_ERROR);
-                    Format(cs_msg, IDSC_ENCODING_PROBLEM, ci_temp.GetTitle().c_str());
-                    cs_msg = cs_caption + _S(": ") + cs_caption;
-                    (*m_pReporter)(cs_msg);
-                }
+    auto processEntry = [&](int rstatus, CItemData &ci) {
+        if (rstatus == PWSfile::FAILURE) {
+            // Show a useful(?) error message - better than
+            // silently losing data (but not by much)
+            // Best if title intact. What to do if not?
+            if (m_pReporter != NULL) {
+                stringT cs_msg, cs_caption;
+                LoadAString(cs_caption, IDSC_READ_ERROR);
+                Format(cs_msg, IDSC_ENCODING_PROBLEM, ci.GetTitle().c_str());
+                cs_msg = cs_caption + _S(": ") + cs_caption;
+                (*m_pReporter)(cs_msg);
             }
-                // deliberate fall-through
-            case PWSfile::SUCCESS:
-                ProcessReadEntry(ci_temp, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
-                break;
-            case PWSfile::WRONG_RECORD: {
-                // See if this is a V4 attachment:
-                CItemAtt att;
-                status = att.Read(in);
-                if (status == PWSfile::SUCCESS) {
-                    m_attlist.insert(std::make_pair(att.GetUUID(), att));
-                } else {
-                    // XXX report problem!
-                }
+        }
+        ProcessReadEntry(ci, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
+    };
+    
+    auto readAttachment = [&]() {
+        // See if this is a V4 attachment:
+        CItemAtt att;
+        int astatus = att.Read(in);
+        if (astatus == PWSfile::SUCCESS) {
+            m_attlist.insert(std::make_pair(att.GetUUID(), att));
+        } else {
+            // XXX report problem!
+        }
+    };
+    
+    const unsigned nWorkers = RecordWorkers();
+    
+    if (m_ReadFileVersion >= PWSfile::V30 && nWorkers > 0) {
+        // See RecordPipeline, before WriteFile().
+        // We read, workers set up entries, we process them in order.
+        LoadPipeline pipeline(nWorkers,
+                              [](CItemData::RawRecord &raw, LoadedRecord &result)
+                              {result.status = result.item.SetRaw(raw);});
+        LoadPipeline::InBatch batch;
+        LoadPipeline::OutBatch results;
+        
+        do {
+            CItemData::RawRecord raw;
+            status = in->ReadRawRecord(raw);
+            switch (status) {
+                case PWSfile::SUCCESS:
+                    batch.push_back(std::move(raw));
+                    break;
+                case PWSfile::WRONG_RECORD:
+                    readAttachment();
+                    break;
+                case PWSfile::END_OF_FILE:
+                    go = false;
+                    break;
+                default:
+                    break;
+            } // switch
+            
+            if (batch.size() == LoadPipeline::BATCHSIZE ||
+                (!go && !batch.empty()))
+                pipeline.Push(batch);
+            
+            // Process whatever's ready, wait if we're too far ahead
+            while (pipeline.Pop(results,
+                                pipeline.InFlight() > LoadPipeline::MAXINFLIGHT)) {
+                for (auto iter = results.begin(); iter != results.end(); iter++)
+                    processEntry(iter->status, iter->item);
             }
-                break;
-            case PWSfile::END_OF_FILE:
-                go = false;
-                break;
-            default:
-                break;
-        } // switch
-    } while (go);
-    
-    ParseDependants();
+        } while (go);
+        
+        pipeline.Finish();
+        while (pipeline.Pop(results, true)) {
+            for (auto iter = results.begin(); iter != results.end(); iter++)
+                processEntry(iter->status, iter->item);
+        }
+    } else {
+        do {
+            ci_temp.Clear(); // Rather than creating a new one each time.
+            status = in->ReadRecord(ci_temp);
+            switch (status) {
+                case PWSfile::FAILURE:
+                case PWSfile::SUCCESS:
+                    processEntry(status, ci_temp);
+                    break;
+                case PWSfile::WRONG_RECORD:
+                    readAttachment();
+                    break;
+                case PWSfile::END_OF_FILE:
+                    go = false;
+                    break;
+                default:
+                    break;
+            } // switch
+        } while (go);
+    }
     
     m_nRecordsWithUnknownFields = in->GetNumRecordsWithUnknownFields();
     in->GetUnknownHeaderFields(m_UHFL);
     int closeStatus = in->Close(); // in V3 & later this checks integrity
+    
+    // Apply changes journaled since the file was written (V3 & later).
+    // They're only in the file once it's saved, so flag the DB as changed.
+    if (closeStatus == SUCCESS && m_ReadFileVersion >= PWSfile::V30) {
+        PWSJournal jnl(a_filename, PWSfile::Read);
+        if (jnl.Open(*in) == PWSfile::SUCCESS) {
+            PWSJournal::Op op;
+            int jstatus;
+            ci_temp.Clear();
+            while ((jstatus = jnl.ReadEntry(op, ci_temp)) == PWSfile::SUCCESS ||
+                   jstatus == PWSfile::FAILURE) {
+                m_pwlist.erase(ci_temp.GetUUID());
+                UnindexEntry(ci_temp.GetUUID());
+                if (op != PWSJournal::JNL_DELETE)
+                    processEntry(jstatus, ci_temp);
+                ci_temp.Clear();
+            }
+            // A torn journal also needs saving over
+            if (jnl.Close() != PWSfile::SUCCESS || jnl.GetNumEntries() > 0)
+                m_DBCurrentState = DIRTY;
+        }
+    }
     delete in;
     
+    ParseDependants();
+    
     ReportReadErrors(pRpt, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID);
     
     // Validate rest of things in the database (excluding duplicate UUIDs fixed above
@@ -1488,71 +1813,170 @@ bool PWScore::BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
     
     bu_fname +=  _T(".ibak");
     
-    // Current file becomes backup
+    // Current file is copied to the backup, rather than renamed: it has
+    // to stay where it is until WriteFile() replaces it, as attachments
+    // we've not loaded are read from it then.
     // Directories along the specified backup path are created as needed
-    return pws_os::RenameFile(m_currfile.c_str(), bu_fname);
+    return pws_os::CopyAFile(m_currfile.c_str(), bu_fname);
 }
 
 void PWScore::ChangePasskey(const StringX &newPasskey)
 {
     SetPassKey(newPasskey);
+    // Catch up with faster hardware, but never weaken what's there
+    SetHashIters(std::max(GetHashIters(),
+                          PWSfile::CalibrateHashIters(m_ReadFileVersion)));
     WriteCurFile(); // Save immediately!
 }
 
-// functor object type for find_if:
-struct FieldsMatch {
-    bool operator()(std::pair<CUUID, CItemData> p) {
-        const CItemData &item = p.second;
-        return (m_group == item.GetGroup() &&
-                m_title == item.GetTitle() &&
-                m_user  == item.GetUser());
+// Keyed, so that no-one can choose group/title/user values that make
+// m_GTUIndex degenerate into a list
+static size_t KeyedHash(const unsigned char *key, size_t keylen,
+                        unsigned char tag, const StringX *fields[], int n)
+{
+    SHA256 sha;
+    unsigned char digest[SHA256::HASHLEN];
+    size_t retval;
+    
+    sha.Update(key, keylen);
+    sha.Update(&tag, 1);
+    for (int i = 0; i < n; i++) {
+        // Length-prefixed, so that "ab"+"c" differs from "a"+"bc"
+        const uint32 len = static_cast<uint32>(fields[i]->length());
+        sha.Update(reinterpret_cast<const unsigned char *>(&len), sizeof(len));
+        sha.Update(reinterpret_cast<const unsigned char *>(fields[i]->data()),
+                   len * sizeof(TCHAR));
+    }
+    sha.Final(digest);
+    memcpy(&retval, digest, sizeof(retval));
+    return retval;
+}
+
+size_t PWScore::GTUHash(const StringX &group, const StringX &title,
+                        const StringX &user) const
+{
+    const StringX *fields[] = {&group, &title, &user};
+    return KeyedHash(m_GTUKey, sizeof(m_GTUKey), 'G', fields, 3);
+}
+
+size_t PWScore::TitleHash(const StringX &title) const
+{
+    const StringX *fields[] = {&title};
+    return KeyedHash(m_GTUKey, sizeof(m_GTUKey), 'T', fields, 1);
+}
+
+void PWScore::IndexEntry(const CItemData &ci)
+{
+    if (!m_bGTUIndexValid)
+        return;
+    
+    const CUUID entry_uuid = ci.GetUUID();
+    UnindexEntry(entry_uuid);
+    const StringX sxTitle = ci.GetTitle();
+    const size_t gtu = GTUHash(ci.GetGroup(), sxTitle, ci.GetUser());
+    const size_t t = TitleHash(sxTitle);
+    m_GTUIndex.insert(std::make_pair(gtu, entry_uuid));
+    m_GTUIndex.insert(std::make_pair(t, entry_uuid));
+    m_GTUHashes[entry_uuid] = std::make_pair(gtu, t);
+}
+
+void PWScore::UnindexEntry(const CUUID &entry_uuid)
+{
+    if (!m_bGTUIndexValid)
+        return;
+    
+    auto hiter = m_GTUHashes.find(entry_uuid);
+    if (hiter == m_GTUHashes.end())
+        return;
+    
+    const size_t hashes[] = {hiter->second.first, hiter->second.second};
+    for (size_t h : hashes) {
+        auto range = m_GTUIndex.equal_range(h);
+        for (auto iter = range.first; iter != range.second; iter++) {
+            if (iter->second == entry_uuid) {
+                m_GTUIndex.erase(iter);
+                break;
+            }
+        }
+    }
+    m_GTUHashes.erase(hiter);
+}
+
+void PWScore::InvalidateGTUIndex()
+{
+    m_bGTUIndexValid = false;
+    m_GTUIndex.clear();
+    m_GTUHashes.clear();
+    m_GTUSuspects.clear();
+}
+
+void PWScore::UpdateGTUIndex()
+{
+    if (!m_bGTUIndexValid) {
+        InvalidateGTUIndex();
+        m_bGTUIndexValid = true;
+        m_GTUIndex.reserve(2 * m_pwlist.size());
+        for (auto iter = m_pwlist.begin(); iter != m_pwlist.end(); iter++)
+            IndexEntry(iter->second);
+        return;
     }
-    FieldsMatch(const StringX &a_group, const StringX &a_title,
-                const StringX &a_user) :
-    m_group(a_group), m_title(a_title), m_user(a_user) {}
     
-private:
-    FieldsMatch& operator=(const FieldsMatch&); // Do not implement
-    const StringX &m_group;
-    const StringX &m_title;
-    const StringX &m_user;
-};
+    for (auto iter = m_GTUSuspects.begin(); iter != m_GTUSuspects.end(); iter++) {
+        ItemListIter pos = m_pwlist.find(*iter);
+        if (pos != m_pwlist.end())
+            IndexEntry(pos->second);
+        else
+            UnindexEntry(*iter);
+    }
+    m_GTUSuspects.clear();
+}
+
+ItemListIter PWScore::Find(const CUUID &entry_uuid)
+{
+    // Caller may change the entry's group/title/user behind our back
+    if (m_bGTUIndexValid) {
+        if (m_GTUSuspects.size() < m_pwlist.size())
+            m_GTUSuspects.push_back(entry_uuid);
+        else // cheaper to start over
+            InvalidateGTUIndex();
+    }
+    return m_pwlist.find(entry_uuid);
+}
 
 // Finds stuff based on group, title & user fields only
 ItemListIter PWScore::Find(const StringX &a_group,const StringX &a_title,
                            const StringX &a_user)
 {
-    FieldsMatch fields_match(a_group, a_title, a_user);
+    UpdateGTUIndex();
     
-    ItemListIter retval = find_if(m_pwlist.begin(), m_pwlist.end(),
-                                  fields_match);
+    // If there's more than one, return the first in m_pwlist, as before
+    ItemListIter retval(m_pwlist.end());
+    auto range = m_GTUIndex.equal_range(GTUHash(a_group, a_title, a_user));
+    for (auto iter = range.first; iter != range.second; iter++) {
+        ItemListIter found = m_pwlist.find(iter->second);
+        ASSERT(found != m_pwlist.end());
+        const CItemData &item = found->second;
+        if ((retval == m_pwlist.end() || found->first < retval->first) &&
+            a_title == item.GetTitle() &&
+            a_group == item.GetGroup() &&
+            a_user  == item.GetUser())
+            retval = found;
+    }
     return retval;
 }
 
-struct TitleMatch {
-    bool operator()(std::pair<CUUID, CItemData> p) {
-        const CItemData &item = p.second;
-        return (m_title == item.GetTitle());
-    }
-    
-    TitleMatch(const StringX &a_title) :
-    m_title(a_title) {}
-    
-private:
-    TitleMatch& operator=(const TitleMatch&); // Do not implement
-    const StringX &m_title;
-};
-
 ItemListIter PWScore::GetUniqueBase(const StringX &a_title, bool &bMultiple)
 {
+    UpdateGTUIndex();
+    
     ItemListIter retval(m_pwlist.end());
     int num(0);
-    TitleMatch TitleMatch(a_title);
     
-    ItemListIter found(m_pwlist.begin());
-    do {
-        found = find_if(found, m_pwlist.end(), TitleMatch);
-        if (found != m_pwlist.end()) {
+    auto range = m_GTUIndex.equal_range(TitleHash(a_title));
+    for (auto iter = range.first; iter != range.second; iter++) {
+        ItemListIter found = m_pwlist.find(iter->second);
+        ASSERT(found != m_pwlist.end());
+        if (a_title == found->second.GetTitle()) {
             num++;
             if (num == 1) {
                 // Save first
@@ -1562,61 +1986,42 @@ ItemListIter PWScore::GetUniqueBase(const StringX &a_title, bool &bMultiple)
                 retval = m_pwlist.end();
                 break;
             }
-            found++;
-        } else
-            break;
-    } while (found != m_pwlist.end());
+        }
+    }
     
     // It is 1 if only 1, but 0 if none & 2 if more than 1 (we just stopped at the second)
     bMultiple = (num > 1);
     return retval;
 }
 
-struct GroupTitle_TitleUserMatch {
-    bool operator()(std::pair<CUUID, CItemData> p) {
-        const CItemData &item = p.second;
-        return ((m_gt == item.GetGroup() && m_tu == item.GetTitle()) ||
-                (m_gt == item.GetTitle() && m_tu == item.GetUser()));
-    }
-    
-    GroupTitle_TitleUserMatch(const StringX &a_grouptitle,
-                              const StringX &a_titleuser) :
-    m_gt(a_grouptitle),  m_tu(a_titleuser) {}
-    
-private:
-    GroupTitle_TitleUserMatch& operator=(const GroupTitle_TitleUserMatch&); // Do not implement
-    const StringX &m_gt;
-    const StringX &m_tu;
-};
-
 ItemListIter PWScore::GetUniqueBase(const StringX &grouptitle,
                                     const StringX &titleuser, bool &bMultiple)
 {
-    ItemListIter retval(m_pwlist.end());
-    int num(0);
-    GroupTitle_TitleUserMatch GroupTitle_TitleUserMatch(grouptitle, titleuser);
-    
-    ItemListIter found(m_pwlist.begin());
-    do {
-        found = find_if(found, m_pwlist.end(), GroupTitle_TitleUserMatch);
-        if (found != m_pwlist.end()) {
-            num++;
-            if (num == 1) {
-                // Save first
-                retval = found;
-            } else {
-                // More than 1, set to end()
-                retval = m_pwlist.end();
-                break;
+    UpdateGTUIndex();
+    
+    // Matches are entries with group == grouptitle && title == titleuser,
+    // or with title == grouptitle && user == titleuser, so the candidates
+    // are those titled either.
+    std::set<CUUID> matches;
+    const size_t hashes[] = {TitleHash(titleuser), TitleHash(grouptitle)};
+    for (int i = 0; i < (grouptitle == titleuser ? 1 : 2) && matches.size() < 2; i++) {
+        auto range = m_GTUIndex.equal_range(hashes[i]);
+        for (auto iter = range.first; iter != range.second; iter++) {
+            ItemListIter found = m_pwlist.find(iter->second);
+            ASSERT(found != m_pwlist.end());
+            const CItemData &item = found->second;
+            const StringX sxTitle = item.GetTitle();
+            if ((grouptitle == item.GetGroup() && titleuser == sxTitle) ||
+                (grouptitle == sxTitle && titleuser == item.GetUser())) {
+                matches.insert(found->first);
+                if (matches.size() > 1)
+                    break;
             }
-            found++;
-        } else
-            break;
-    } while (found != m_pwlist.end());
+        }
+    }
     
-    // It is 1 if only 1, but 0 if none & 2 if more than 1 (we just stopped at the second)
-    bMultiple = (num > 1);
-    return retval;
+    bMultiple = (matches.size() > 1);
+    return (matches.size() == 1) ? m_pwlist.find(*matches.begin()) : m_pwlist.end();
 }
 
 void PWScore::EncryptPassword(const unsigned char *plaintext, size_t len,
@@ -1667,6 +2072,8 @@ void PWScore::SetPassKey(const StringX &new_passkey)
         delete[] m_passkey;
     }
     
+    ClearStretchedKey(); // stretched from the old one
+    
     m_passkey_len = new_passkey.length() * sizeof(TCHAR);
     
     size_t BlockLength = ((m_passkey_len + (BS - 1)) / BS) * BS;
@@ -1675,6 +2082,53 @@ void PWScore::SetPassKey(const StringX &new_passkey)
     EncryptPassword(reinterpret_cast<const unsigned char *>(plaintext), m_passkey_len, m_passkey);
 }
 
+void PWScore::SetStretchedKey(const PWSfile::StretchedKey &sk)
+{
+    // Kept like m_passkey, but in locked memory: it's as good as the
+    // passkey for opening m_currfile
+    const unsigned int BS = TwoFish::BLOCKSIZE;
+    const size_t BlockLength = ((sizeof(sk) + (BS - 1)) / BS) * BS;
+    if (m_stretchedKey == NULL) {
+        m_stretchedKey = new unsigned char[BlockLength];
+        pws_os::mlock(m_stretchedKey, BlockLength);
+    }
+    EncryptPassword(reinterpret_cast<const unsigned char *>(&sk), sizeof(sk),
+                    m_stretchedKey);
+}
+
+bool PWScore::GetStretchedKey(PWSfile::StretchedKey &sk) const
+{
+    sk.Clear();
+    if (m_stretchedKey == NULL)
+        return false;
+    
+    const unsigned int BS = TwoFish::BLOCKSIZE;
+    unsigned char plain[((sizeof(PWSfile::StretchedKey) + (BS - 1)) / BS) * BS];
+    if (!pws_os::mcryptUnprotect(m_session_key, sizeof(m_session_key))) {
+        pws_os::Trace(_T("pws_os::mcryptUnprotect failed"));
+    }
+    TwoFish tf(m_session_key, sizeof(m_session_key));
+    if (!pws_os::mcryptProtect(m_session_key, sizeof(m_session_key))) {
+        pws_os::Trace(_T("pws_os::mcryptProtect failed"));
+    }
+    tf.DecryptBlocks(m_stretchedKey, plain, sizeof(plain) / BS);
+    memcpy(&sk, plain, sizeof(sk));
+    trashMemory(plain, sizeof(plain));
+    return sk.IsSet();
+}
+
+void PWScore::ClearStretchedKey()
+{
+    if (m_stretchedKey != NULL) {
+        const unsigned int BS = TwoFish::BLOCKSIZE;
+        const size_t BlockLength = ((sizeof(PWSfile::StretchedKey) + (BS - 1)) / BS) * BS;
+        trashMemory(m_stretchedKey, BlockLength);
+        pws_os::munlock(m_stretchedKey, BlockLength);
+        delete[] m_stretchedKey;
+        m_stretchedKey = NULL;
+    }
+}
+
 StringX PWScore::GetPassKey() const
 {
     StringX retval(_T(""));
@@ -1688,21 +2142,12 @@ StringX PWScore::GetPassKey() const
         if (!pws_os::mcryptProtect(m_session_key, sizeof(m_session_key))) {
             pws_os::Trace(_T("pws_os::mcryptProtect failed"));
         }
-        unsigned char curblock[BS];
-        for (unsigned int x = 0; x < BlockLength; x += BS) {
-            unsigned int i;
-            for (i = 0; i < BS; i++) {
-                curblock[i] = m_passkey[x + i];
-            }
-            
-            tf.Decrypt(curblock, curblock);
-            for (i = 0; i < BS; i += sizeof(TCHAR)) {
-                if (x + i < m_passkey_len) {
-                    retval += *(reinterpret_cast<TCHAR*>(curblock + i));
-                }
-            }
-        }
-        trashMemory(curblock, sizeof(curblock));
+        unsigned char *plain =
+            static_cast<unsigned char *>(SecureHeap::Alloc(BlockLength));
+        tf.DecryptBlocks(m_passkey, plain, BlockLength / BS);
+        retval.assign(reinterpret_cast<const TCHAR *>(plain),
+                      m_passkey_len / sizeof(TCHAR));
+        SecureHeap::Free(plain); // trashes it
     }
     return retval;
 }
@@ -2186,6 +2631,7 @@ bool PWScore::Validate(const size_t iMAXCHARS, CReport *pRpt, st_ValidateResults
             // We assume that this is run during file read. If not, then we
             // need to run using the Command mechanism for Undo/Redo.
             m_pwlist[fixedItem.GetUUID()] = fixedItem;
+            IndexEntry(fixedItem);
         }
     } // iteration over m_pwlist
     
@@ -2827,6 +3273,7 @@ int PWScore::DoAddDependentEntries(UUIDVector &dependentlist, CReport *pRpt,
                         // Invalid - delete!
                         if (pmapDeletedItems != NULL)
                             pmapDeletedItems->insert(ItemList_Pair(*paiter, *pci_curitem));
+                        UnindexEntry(iter->first);
                         m_pwlist.erase(iter);
                         continue;
                     }
@@ -2851,6 +3298,7 @@ int PWScore::DoAddDependentEntries(UUIDVector &dependentlist, CReport *pRpt,
                         // Invalid - delete!
                         if (pmapDeletedItems != NULL)
                             pmapDeletedItems->insert(ItemList_Pair(*paiter, *pci_curitem));
+                        UnindexEntry(iter->first);
                         m_pwlist.erase(iter);
                         continue;
                     }
@@ -2960,6 +3408,7 @@ void PWScore::UndoAddDependentEntries(ItemList *pmapDeletedItems,
          add_iter != pmapDeletedItems->end();
          add_iter++) {
         m_pwlist[add_iter->first] = add_iter->second;
+        IndexEntry(add_iter->second);
     }
     
     for (restore_iter = pmapSaveTypePW->begin();
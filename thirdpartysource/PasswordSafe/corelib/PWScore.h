@@ -25,6 +25,8 @@
 
 #include "coredefs.h"
 
+#include <unordered_map>
+
 // Parameter list for ParseBaseEntryPWD
 struct BaseEntryParms {
     // All fields except "InputType" are 'output'.
@@ -138,6 +140,8 @@ public:
                        const stringT &userBackupPrefix,
                        const stringT &userBackupDir, stringT &bu_fname);
     
+    // New databases, and new passphrases, get a calibrated number of
+    // hash iterations: see PWSfile::CalibrateHashIters()
     void NewFile(const StringX &passkey);
     int WriteCurFile() {return WriteFile(m_currfile, m_ReadFileVersion);}
     int WriteFile(const StringX &filename, PWSfile::VERSION version,
@@ -293,8 +297,9 @@ public:
     {return m_bUniqueGTUValidated;}
     
     // Access to individual entries in database
+    // (non-const access may change group/title/user, see m_GTUIndex)
     ItemListIter GetEntryIter()
-    {return m_pwlist.begin();}
+    {m_bGTUIndexValid = false; return m_pwlist.begin();}
     ItemListConstIter GetEntryIter() const
     {return m_pwlist.begin();}
     ItemListIter GetEntryEndIter()
@@ -320,8 +325,7 @@ public:
     // Find in m_pwlist by group, title and user name, exact match
     ItemListIter Find(const StringX &a_group,
                       const StringX &a_title, const StringX &a_user);
-    ItemListIter Find(const pws_os::CUUID &entry_uuid)
-    {return m_pwlist.find(entry_uuid);}
+    ItemListIter Find(const pws_os::CUUID &entry_uuid); // see m_GTUIndex
     ItemListConstIter Find(const pws_os::CUUID &entry_uuid) const
     {return m_pwlist.find(entry_uuid);}
     
@@ -528,6 +532,15 @@ private:
     bool Validate(const size_t iMAXCHARS, CReport *pRpt, st_ValidateResults &st_vr);
     
     void ParseDependants(); // populate data structures as needed - called in ReadFile()
+
+    // Maintain m_GTUIndex. All are no-ops until it's first used.
+    void IndexEntry(const CItemData &ci); // (re)index
+    void UnindexEntry(const pws_os::CUUID &entry_uuid);
+    void InvalidateGTUIndex();
+    void UpdateGTUIndex(); // build it, or reindex suspects
+    size_t GTUHash(const StringX &group, const StringX &title,
+                   const StringX &user) const;
+    size_t TitleHash(const StringX &title) const;
     void ResetAllAliasPasswords(const pws_os::CUUID &base_uuid);
     
     StringX GetPassKey() const; // returns cleartext - USE WITH CARE
@@ -536,6 +549,12 @@ private:
     void EncryptPassword(const unsigned char *plaintext, size_t len,
                          unsigned char *ciphertext) const;
     
+    // The passkey as last stretched for m_currfile, so that unlocking
+    // stretches it once, and saving doesn't at all. Cleared by SetPassKey.
+    void SetStretchedKey(const PWSfile::StretchedKey &sk);
+    bool GetStretchedKey(PWSfile::StretchedKey &sk) const;
+    void ClearStretchedKey();
+    
     int MergeDependents(PWScore *pothercore, MultiCommands *pmulticmds,
                         uuid_array_t &base_uuid, uuid_array_t &new_base_uuid,
                         const bool bTitleRenamed, stringT &timeStr,
@@ -545,6 +564,7 @@ private:
     
     unsigned char *m_passkey; // encrypted by session key
     size_t m_passkey_len; // Length of cleartext passkey
+    unsigned char *m_stretchedKey; // encrypted by session key, mlock'd
     
     uint32 m_hashIters; // for new or currently open db.
     
@@ -573,6 +593,21 @@ private:
     //  Key = entry's uuid; Value = entry's CItemData
     ItemList m_pwlist;
     
+    // Secondary index for Find(group, title, user) and GetUniqueBase(),
+    // so that they decrypt only the candidates' fields.
+    //  Key = keyed hash of an entry's group/title/user, and of its title;
+    //  Value = entry's uuid
+    // Hits are always checked against the entry itself. Entries may be
+    // changed in place via non-const Find(uuid) and GetEntryIter(), so
+    // the former mark their entry as suspect, and the latter the index
+    // as invalid; either is fixed up lazily by UpdateGTUIndex().
+    typedef std::unordered_multimap<size_t, pws_os::CUUID> GTUIndex;
+    GTUIndex m_GTUIndex;
+    std::map<pws_os::CUUID, std::pair<size_t, size_t> > m_GTUHashes; // for unindexing
+    std::vector<pws_os::CUUID> m_GTUSuspects;
+    bool m_bGTUIndexValid;
+    unsigned char m_GTUKey[16]; // random per core, so hashes can't be chosen
+    
     // Attachments, if any
     AttList m_attlist;
     
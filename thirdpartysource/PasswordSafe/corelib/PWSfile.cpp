@@ -15,18 +15,24 @@
 #include "os/dir.h"  // for splitpath
 
 #include "sha1.h" // for simple encrypt/decrypt
+#include "hmac.h"
 #include "PWSrand.h"
+#include "SecureHeap.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <limits>
+#include <algorithm>
+#include <chrono>
 
 PWSfile *PWSfile::MakePWSfile(const StringX &a_filename, const StringX &passkey,
                               VERSION &version, RWmode mode, int &status,
                               Asker *pAsker, Reporter *pReporter)
 {
     PWSfile *retval = NULL;
+    StretchedKey sk; // V4's version check stretches passkey, keep it for Open()
+    sk.Clear();
     
     if (mode == Read && !pws_os::FileExists(a_filename.c_str())) {
         status = CANT_OPEN_FILE;
@@ -49,7 +55,7 @@ PWSfile *PWSfile::MakePWSfile(const StringX &a_filename, const StringX &passkey,
             break;
         case UNKNOWN_VERSION:
             ASSERT(mode == Read);
-            version = PWSfile::ReadVersion(a_filename, passkey);
+            version = PWSfile::ReadVersion(a_filename, passkey, &sk);
             switch (version) {
                 case V40:
                     status = SUCCESS;
@@ -78,17 +84,21 @@ PWSfile *PWSfile::MakePWSfile(const StringX &a_filename, const StringX &passkey,
     if (retval != NULL) {
         retval->m_pAsker = pAsker;
         retval->m_pReporter = pReporter;
+        if (sk.IsSet())
+            retval->SetStretchedKey(sk);
     }
+    sk.Clear();
     return retval;
 }
 
-PWSfile::VERSION PWSfile::ReadVersion(const StringX &filename, const StringX &passkey)
+PWSfile::VERSION PWSfile::ReadVersion(const StringX &filename, const StringX &passkey,
+                                      StretchedKey *sk)
 {
     if (pws_os::FileExists(filename.c_str())) {
         VERSION v;
         if (PWSfileV3::IsV3x(filename, v))
             return v;
-        else if (PWSfileV4::IsV4x(filename, passkey, v))
+        else if (PWSfileV4::IsV4x(filename, passkey, v, sk))
             return v;
         else if (PWSfileV1V2::CheckPasskey(filename, passkey) == SUCCESS)
             return V20;
@@ -100,15 +110,74 @@ PWSfile::VERSION PWSfile::ReadVersion(const StringX &filename, const StringX &pa
 
 PWSfile::PWSfile(const StringX &filename, RWmode mode, VERSION v)
 : m_filename(filename), m_passkey(_T("")), m_fd(NULL),
+m_map(NULL), m_mapLength(0), m_mapPos(NULL),
 m_curversion(v), m_rw(mode), m_defusername(_T("")),
 m_fish(NULL), m_terminal(NULL), m_status(SUCCESS),
-m_nRecordsWithUnknownFields(0)
+m_nRecordsWithUnknownFields(0), m_nRecords(0), m_nRecordsToWrite(-1),
+m_bJournalKeys(false), m_bJournalBase(false), m_bCommit(false)
 {
+    m_stretchedKey.Clear();
 }
 
 PWSfile::~PWSfile()
 {
     Close(); // idempotent
+    trashMemory(m_jkey, sizeof(m_jkey));
+    trashMemory(m_jhkey, sizeof(m_jhkey));
+    m_stretchedKey.Clear();
+}
+
+void PWSfile::StretchedKey::Set(VERSION v, const unsigned char *a_salt,
+                                uint32 N, const StringX &passkey,
+                                const unsigned char *a_Ptag)
+{
+    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+    
+    memcpy(salt, a_salt, sizeof(salt));
+    nHashIters = N;
+    version = v;
+    memcpy(Ptag, a_Ptag, sizeof(Ptag));
+    hmac.Doit(Ptag, sizeof(Ptag),
+              reinterpret_cast<const unsigned char *>(passkey.c_str()),
+              static_cast<unsigned long>(passkey.length() * sizeof(TCHAR)),
+              check);
+}
+
+bool PWSfile::StretchedKey::IsFor(VERSION v, const StringX &passkey) const
+{
+    if (!IsSet() || version != v)
+        return false;
+    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+    unsigned char digest[SHA256::HASHLEN];
+    hmac.Doit(Ptag, sizeof(Ptag),
+              reinterpret_cast<const unsigned char *>(passkey.c_str()),
+              static_cast<unsigned long>(passkey.length() * sizeof(TCHAR)),
+              digest);
+    const bool retval = (memcmp(digest, check, sizeof(check)) == 0);
+    trashMemory(digest, sizeof(digest));
+    return retval;
+}
+
+bool PWSfile::StretchedKey::Matches(VERSION v, const unsigned char *a_salt,
+                                    uint32 N, const StringX &passkey) const
+{
+    return (nHashIters == N &&
+            memcmp(salt, a_salt, sizeof(salt)) == 0 &&
+            IsFor(v, passkey));
+}
+
+void PWSfile::StretchedKey::Clear()
+{
+    trashMemory(this, sizeof(*this));
+    nHashIters = 0;
+}
+
+bool PWSfile::GetStretchedKey(StretchedKey &sk) const
+{
+    if (!m_stretchedKey.IsSet())
+        return false;
+    sk = m_stretchedKey;
+    return true;
 }
 
 void PWSfile::HashRandom256(unsigned char *p256)
@@ -127,16 +196,64 @@ void PWSfile::HashRandom256(unsigned char *p256)
     salter.Final(p256);
 }
 
+void PWSfile::SetJournalKeys(const unsigned char *K, const unsigned char *L,
+                             unsigned long keylen)
+{
+    // The journal's keys are derived from, rather than equal to, the
+    // database's, so nothing's ever encrypted or MAC'd under both.
+    static const unsigned char JKEY[] = "PWS journal key";
+    static const unsigned char JHKEY[] = "PWS journal hmac";
+    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+    
+    hmac.Doit(K, keylen, JKEY, sizeof(JKEY) - 1, m_jkey);
+    hmac.Doit(L, keylen, JHKEY, sizeof(JHKEY) - 1, m_jhkey);
+    m_bJournalKeys = true;
+}
+
+void PWSfile::SetJournalBase(const unsigned char digest[SHA256::HASHLEN])
+{
+    memcpy(m_jbase, digest, sizeof(m_jbase));
+    m_bJournalBase = true;
+}
+
+bool PWSfile::GetJournalKeys(unsigned char key[SHA256::HASHLEN],
+                             unsigned char hkey[SHA256::HASHLEN],
+                             unsigned char base[SHA256::HASHLEN]) const
+{
+    if (!m_bJournalKeys || !m_bJournalBase)
+        return false;
+    memcpy(key, m_jkey, sizeof(m_jkey));
+    memcpy(hkey, m_jhkey, sizeof(m_jhkey));
+    memcpy(base, m_jbase, sizeof(m_jbase));
+    return true;
+}
+
 void PWSfile::FOpen()
 {
     ASSERT(!m_filename.empty());
-    const TCHAR* m = (m_rw == Read) ? _T("rb") : _T("wb");
+    m_bJournalKeys = m_bJournalBase = false; // stale from here on
     if (m_fd != NULL) {
+        pws_os::UnmapFile(m_map, m_mapLength);
+        m_map = m_mapPos = NULL;
         fclose(m_fd);
         m_fd = NULL;
     }
-    m_fd = pws_os::FOpen(m_filename.c_str(), m);
-    m_fileLength = pws_os::fileLength(m_fd);
+    if (m_rw == Write) {
+        // Write to a file alongside the one we're replacing, so that a
+        // failed or interrupted save leaves the latter untouched.
+        // Its name's unique, so that overlapping saves don't collide.
+        stringT tmpfilename;
+        m_bCommit = false;
+        m_fd = pws_os::FOpenTemp(m_filename.c_str(), tmpfilename);
+        m_tmpfilename = (m_fd != NULL) ? tmpfilename.c_str() : _T("");
+    } else
+        m_fd = pws_os::FOpen(m_filename.c_str(), _T("rb"));
+    if (m_fd != NULL) {
+        // Records are read or written a block or two at a time - have
+        // stdio do so in larger chunks. Must precede any other I/O on m_fd.
+        setvbuf(m_fd, NULL, _IOFBF, (m_rw == Read) ? 64 * 1024 : 256 * 1024);
+    }
+    m_fileLength = (m_fd != NULL) ? pws_os::fileLength(m_fd) : 0;
 }
 
 int PWSfile::Close()
@@ -146,13 +263,92 @@ int PWSfile::Close()
     int rc(SUCCESS);
     
     if (m_fd != NULL) {
+        pws_os::UnmapFile(m_map, m_mapLength);
+        m_map = m_mapPos = NULL;
         rc = pws_os::FClose(m_fd, m_rw == Write);
         m_fd = NULL;
     }
     
+    if (!m_tmpfilename.empty()) {
+        // POSIX rename() atomically replaces the original, if any, but
+        // that's only on disk once the directory is
+        const stringT tmpfilename(m_tmpfilename.c_str());
+        if (rc == SUCCESS && m_bCommit &&
+            pws_os::RenameFile(tmpfilename, m_filename.c_str())) {
+            if (!pws_os::FSyncDir(m_filename.c_str()))
+                rc = WRITE_FAIL;
+        } else {
+            pws_os::DeleteAFile(tmpfilename);
+            if (rc == SUCCESS) // nothing's been saved
+                rc = WRITE_FAIL;
+        }
+        m_tmpfilename.clear();
+        m_bCommit = false;
+    }
     return rc;
 }
 
+void PWSfile::Abandon()
+{
+    m_bCommit = false;
+    PWSfile::Close();
+}
+
+void PWSfile::MapForRead()
+{
+    ASSERT(m_fd != NULL && m_rw == Read && m_map == NULL);
+    m_map = pws_os::MapFile(m_filename.c_str(), m_fd, m_mapLength);
+    const long pos = ftell(m_fd);
+    if (m_map != NULL && (pos < 0 || ulong64(pos) > m_mapLength)) {
+        // Cut short since we opened it: stdio will find out
+        pws_os::UnmapFile(m_map, m_mapLength);
+        m_map = NULL;
+        m_mapLength = 0;
+    }
+    if (m_map != NULL) {
+        // Carry on from wherever stdio got to
+        m_mapPos = m_map + pos;
+    } else {
+        pws_os::Trace0(_T("PWSfile::MapForRead: can't map the file, using stdio\n"));
+    }
+}
+
+size_t PWSfile::FRead(void *buf, size_t size, size_t count)
+{
+    if (m_map == NULL)
+        return fread(buf, size, count, m_fd);
+    
+    // Same semantics as fread: returns # of whole items read
+    const size_t avail = size_t(m_map + m_mapLength - m_mapPos);
+    const size_t n = (size == 0) ? 0 : std::min(count, avail / size);
+    memcpy(buf, m_mapPos, n * size);
+    m_mapPos += n * size;
+    return n;
+}
+
+int PWSfile::FSeek(long offset, int whence)
+{
+    if (m_map == NULL)
+        return fseek(m_fd, offset, whence);
+    
+    long base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = long(m_mapPos - m_map); break;
+        case SEEK_END: base = long(m_mapLength); break;
+        default: return -1;
+    }
+    if (base + offset < 0 || ulong64(base + offset) > m_mapLength)
+        return -1;
+    m_mapPos = m_map + base + offset;
+    return 0;
+}
+
+long PWSfile::FTell() const
+{
+    return (m_map == NULL) ? ftell(m_fd) : long(m_mapPos - m_map);
+}
+
 size_t PWSfile::WriteCBC(unsigned char type, const unsigned char *data,
                          size_t length)
 {
@@ -168,8 +364,12 @@ size_t PWSfile::ReadCBC(unsigned char &type, unsigned char* &data,
     size_t retval;
     
     ASSERT(m_fish != NULL && m_IV != NULL);
-    retval = _readcbc(m_fd, buffer, buffer_len, type,
-                      m_fish, m_IV, m_terminal, m_fileLength);
+    if (m_map != NULL)
+        retval = _readcbc(m_mapPos, m_map + m_mapLength, buffer, buffer_len, type,
+                          m_fish, m_IV, m_terminal, m_fileLength);
+    else
+        retval = _readcbc(m_fd, buffer, buffer_len, type,
+                          m_fish, m_IV, m_terminal, m_fileLength);
     
     if (buffer_len > 0) {
         if (buffer_len < length || data == NULL)
@@ -178,20 +378,20 @@ size_t PWSfile::ReadCBC(unsigned char &type, unsigned char* &data,
         // probably an error.
         if (data != NULL) {
             memcpy(data, buffer, length);
-            trashMemory(buffer, buffer_len);
-            delete[] buffer;
+            SecureHeap::Free(buffer); // trashes it
         } else { // NULL data means pass buffer directly to caller
-            data = buffer; // caller must trash & delete[]!
+            data = buffer; // caller must SecureHeap::Free()!
         }
     } else {
-        // no need to delete[] buffer, since _readcbc will not allocate if
+        // no need to free buffer, since _readcbc will not allocate if
         // buffer_len is zero
     }
     return retval;
 }
 
 int PWSfile::CheckPasskey(const StringX &filename,
-                          const StringX &passkey, VERSION &version)
+                          const StringX &passkey, VERSION &version,
+                          StretchedKey *sk)
 {
     /**
      * We start with V3 because it's the quickest to rule out
@@ -204,11 +404,11 @@ int PWSfile::CheckPasskey(const StringX &filename,
     
     int status;
     version = UNKNOWN_VERSION;
-    status = PWSfileV3::CheckPasskey(filename, passkey);
+    status = PWSfileV3::CheckPasskey(filename, passkey, NULL, NULL, NULL, sk);
     if (status == SUCCESS) {
         version = V30;
     } else {
-        status = PWSfileV4::CheckPasskey(filename, passkey);
+        status = PWSfileV4::CheckPasskey(filename, passkey, NULL, NULL, NULL, sk);
         if (status == SUCCESS)
             version = V40;
         else {
@@ -220,6 +420,75 @@ int PWSfile::CheckPasskey(const StringX &filename,
     return status;
 }
 
+int PWSfile::PeekHeader(const StringX &filename, const StringX &passkey,
+                        PWSfileHeader &hdr)
+{
+    VERSION version = UNKNOWN_VERSION;
+    int status;
+    PWSfile *in = MakePWSfile(filename, passkey, version, Read, status);
+    if (status != SUCCESS) {
+        delete in;
+        // Only a V4 file's version depends on the passkey, so it's only
+        // the passkey's fault if the file's laid out as V4
+        if (status == FAILURE && version == UNKNOWN_VERSION)
+            status = PWSfileV4::IsV4Layout(filename) ? WRONG_PASSWORD : NOT_PWS3_FILE;
+        return status;
+    }
+    if (version != V30 && version != V40) {
+        delete in;
+        return UNSUPPORTED_VERSION;
+    }
+    
+    // Open() reads the header and stops at its END field
+    status = in->Open(passkey);
+    if (status == SUCCESS)
+        hdr = in->GetHeader();
+    // Not in->Close(), which would fail to verify the HMAC
+    in->PWSfile::Close();
+    delete in;
+    return status;
+}
+
+uint32 PWSfile::CalibrateHashIters(VERSION version, uint32 targetMillis)
+{
+    switch (version) {
+        case V30:
+            return PWSfileV3::CalibrateHashIters(targetMillis);
+        case V40:
+            return PWSfileV4::CalibrateHashIters(targetMillis);
+        default:
+            return MIN_HASH_ITERATIONS;
+    }
+}
+
+uint32 PWSfile::CalibrateHashIters(StretchFn stretch, uint32 targetMillis)
+{
+    /**
+     * Double N until a stretch takes long enough to time reliably, then
+     * scale. Stretching's linear in N, so a few ms of it are as good as
+     * the full targetMillis, and the whole calibration costs ~2x that.
+     */
+    const double sampleMillis = 8.0;
+    uint32 N = MIN_HASH_ITERATIONS;
+    double elapsed;
+    
+    for (;;) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        stretch(N);
+        elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (elapsed >= sampleMillis || N >= MAX_USABLE_HASH_ITERS)
+            break;
+        N *= 2;
+    }
+    
+    const double scaled = (elapsed > 0) ? N * (targetMillis / elapsed) : MAX_USABLE_HASH_ITERS;
+    if (scaled <= MIN_HASH_ITERATIONS)
+        return MIN_HASH_ITERATIONS;
+    if (scaled >= MAX_USABLE_HASH_ITERS)
+        return MAX_USABLE_HASH_ITERS;
+    return static_cast<uint32>(scaled);
+}
+
 void PWSfile::GetUnknownHeaderFields(UnknownFieldList &UHFL)
 {
     if (!m_UHFL.empty())
@@ -238,7 +507,7 @@ void PWSfile::SetUnknownHeaderFields(UnknownFieldList &UHFL)
 
 long PWSfile::GetOffset() const
 {
-    long retval = ftell(m_fd);
+    long retval = FTell();
     ASSERT(ulong64(retval) <= pws_os::fileLength(m_fd));
     return retval;
 }
@@ -286,22 +555,33 @@ size_t _ret = fwrite(p, sz, cnt, stream); \
 if (_ret != cnt) { status = false; goto exit;} \
 }
 
-// std::numeric_limits<>::max() && m'soft's silly macros don't work together
-#ifdef max
-#undef max
-#endif
+// Encrypt() and Decrypt() stream the file through a buffer this big,
+// so that memory use doesn't depend on the file's size.
+static const size_t CRYPT_CHUNK = 64 * 1024; // multiple of CRYPT_BS
+static const size_t CRYPT_BS = 8; // BlowFish
+// randstuff, randhash, salt, IV
+static const ulong64 CRYPT_HDRLEN = 8 + SHA1::HASHLEN + SaltLength + 8;
 
+/*
+ * The format's that of a header followed by a single _writecbc() record:
+ * a length block, then the data, its last block padded with randomness
+ * (a lone block of it for an empty file).
+ * The length field's only 32 bits wide. For bigger files, we store the
+ * length's low 32 bits, and Decrypt() recovers the rest from the file's
+ * size. Files under 4GB are therefore unchanged.
+ */
 bool PWSfile::Encrypt(const stringT &fn, const StringX &passwd, stringT &errmess)
 {
-    ulong64 len = 0;
-    size_t slen = 0;
-    unsigned char* buf = NULL;
+    ulong64 len = 0, left;
+    unsigned char *buf = NULL;
     Fish *fish = NULL;
     bool status = true;
     const stringT out_fn = fn + CIPHERTEXT_SUFFIX;
     unsigned char *pwd = NULL;
     size_t passlen = 0;
     FILE *out = NULL;
+    bool created = false; // remove out_fn if we fail
+    unsigned char lengthblock[CRYPT_BS];
     
     FILE *in = pws_os::FOpen(fn, _T("rb"));
     if (in == NULL) {
@@ -310,33 +590,11 @@ bool PWSfile::Encrypt(const stringT &fn, const StringX &passwd, stringT &errmess
     
     len = pws_os::fileLength(in);
     
-    if (len > std::numeric_limits<uint32>::max()) {
-        fclose(in);
-        errno = EFBIG;
-        status = false;
-        goto exit;
-    }
-    
-    slen = static_cast<size_t>(len);
-    buf = new unsigned char[slen];
-    
-    fread(buf, 1, slen, in);
-    if (ferror(in)) { // this is how to detect fread errors
-        status = false;
-        int save_error = errno;
-        fclose(in);
-        errno = save_error;
-        goto exit;
-    }
-    if (fclose(in) != 0) {
-        status = false;
-        goto exit;
-    }
-    
     out = pws_os::FOpen(out_fn, _T("wb"));
     if (out == NULL) {
         status = false; goto exit;
     }
+    created = true;
     unsigned char randstuff[StuffSize];
     unsigned char randhash[SHA1::HASHLEN];   // HashSize
     PWSrand::GetInstance()->GetRandomData( randstuff, 8 );
@@ -358,34 +616,76 @@ bool PWSfile::Encrypt(const stringT &fn, const StringX &passwd, stringT &errmess
     fish = BlowFish::MakeBlowFish(pwd, reinterpret_cast<unsigned int &>(passlen), thesalt, SaltLength);
     trashMemory(pwd, passlen);
     delete[] pwd; // gross - ConvertString allocates.
-    try {
-        _writecbc(out, buf, slen, 0, fish, ipthing);
-    } catch (...) { // _writecbc throws an exception if it fails to write
-        fclose(out);
-        errno = EIO;
+    
+    PWSrand::GetInstance()->GetRandomData(lengthblock, sizeof(lengthblock));
+    putInt32(lengthblock, static_cast<int32>(len)); // low 32 bits, see above
+    lengthblock[sizeof(int32)] = 0; // type
+    fish->EncryptCBC(lengthblock, 1, ipthing);
+    SAFE_FWRITE(lengthblock, 1, sizeof(lengthblock), out);
+    
+    buf = static_cast<unsigned char *>(SecureHeap::Alloc(CRYPT_CHUNK));
+    left = len;
+    do {
+        const size_t n = (left < CRYPT_CHUNK) ? static_cast<size_t>(left) : CRYPT_CHUNK;
+        if (fread(buf, 1, n, in) != n) { // error, or file shrank under us
+            if (!ferror(in))
+                errno = EIO;
+            status = false;
+            goto exit;
+        }
+        left -= n;
+        size_t blen = ((n + CRYPT_BS - 1) / CRYPT_BS) * CRYPT_BS;
+        if (blen == 0) // empty file, pre-3 compatible
+            blen = CRYPT_BS;
+        if (blen > n)
+            PWSrand::GetInstance()->GetRandomData(buf + n, static_cast<unsigned long>(blen - n));
+        fish->EncryptCBC(buf, blen / CRYPT_BS, ipthing);
+        SAFE_FWRITE(buf, 1, blen, out);
+    } while (left > 0);
+    
+    if (fclose(in) != 0) {
+        in = NULL;
         status = false;
         goto exit;
     }
+    in = NULL;
     status = (fclose(out) == 0);
+    out = NULL;
 exit:
-    if (!status)
+    if (!status) {
+        const int save_errno = errno;
+        if (in != NULL)
+            fclose(in);
+        if (out != NULL)
+            fclose(out);
+        if (created)
+            pws_os::DeleteAFile(out_fn);
+        errno = save_errno;
         errmess = ErrorMessages();
+    }
     delete fish;
-    delete[] buf;
+    SecureHeap::Free(buf);
     return status;
 }
 
 bool PWSfile::Decrypt(const stringT &fn, const StringX &passwd, stringT &errmess)
 {
-    ulong64 file_len;
-    size_t len;
+    ulong64 file_len, data_len, len, left;
+    uint32 pad;
     unsigned char* buf = NULL;
+    Fish *fish = NULL;
     bool status = true;
+    const stringT out_fn = fn.substr(0, fn.length() - CIPHERTEXT_SUFFIX.length());
+    FILE *out = NULL;
+    bool created = false; // remove out_fn if we fail
+    unsigned char *pwd = NULL;
+    size_t passlen = 0;
     unsigned char salt[SaltLength];
     unsigned char ipthing[8];
     unsigned char randstuff[StuffSize];
     unsigned char randhash[SHA1::HASHLEN];
     unsigned char temphash[SHA1::HASHLEN];
+    unsigned char lengthblock[CRYPT_BS];
     
     FILE *in = pws_os::FOpen(fn, _T("rb"));
     if (in == NULL) {
@@ -395,7 +695,9 @@ bool PWSfile::Decrypt(const stringT &fn, const StringX &passwd, stringT &errmess
     
     file_len = pws_os::fileLength(in);
     
-    if (file_len < (8 + sizeof(randhash) + 8 + SaltLength)) {
+    // Header, length block and at least one block of data
+    if (file_len < CRYPT_HDRLEN + 2 * CRYPT_BS ||
+        (file_len - CRYPT_HDRLEN) % CRYPT_BS != 0) {
         fclose(in);
         LoadAString(errmess, IDSC_FILE_TOO_SHORT);
         return false;
@@ -412,55 +714,79 @@ bool PWSfile::Decrypt(const stringT &fn, const StringX &passwd, stringT &errmess
         return false;
     }
     
-    { // decryption in a block, since we use goto
-        fread(salt,    1, SaltLength, in);
-        fread(ipthing, 1, 8,          in);
-        
-        unsigned char dummyType;
-        unsigned char *pwd = NULL;
-        size_t passlen = 0;
-        ConvertString(passwd, pwd, passlen);
-        Fish *fish = BlowFish::MakeBlowFish(pwd, reinterpret_cast<unsigned int &>(passlen), salt, SaltLength);
-        trashMemory(pwd, passlen);
-        delete[] pwd; // gross - ConvertString allocates.
-        if (_readcbc(in, buf, len,dummyType, fish, ipthing, 0, file_len) == 0) {
-            delete fish;
-            delete[] buf; // if not yet allocated, delete[] NULL, which is OK
-            return false;
-        }
-        delete fish;
+    fread(salt,    1, SaltLength, in);
+    fread(ipthing, 1, 8,          in);
+    
+    ConvertString(passwd, pwd, passlen);
+    fish = BlowFish::MakeBlowFish(pwd, reinterpret_cast<unsigned int &>(passlen), salt, SaltLength);
+    trashMemory(pwd, passlen);
+    delete[] pwd; // gross - ConvertString allocates.
+    
+    if (fread(lengthblock, 1, sizeof(lengthblock), in) != sizeof(lengthblock)) {
+        status = false;
+        goto exit;
+    }
+    fish->DecryptCBC(lengthblock, 1, ipthing);
+    
+    // Recover the length from its low 32 bits (see Encrypt()): the data
+    // is padded by less than a block, save for an empty file's one block.
+    data_len = file_len - CRYPT_HDRLEN - CRYPT_BS;
+    pad = static_cast<uint32>(data_len) - static_cast<uint32>(getInt32(lengthblock));
+    trashMemory(lengthblock, sizeof(lengthblock));
+    if (pad < CRYPT_BS) {
+        len = data_len - pad;
+    } else if (pad == CRYPT_BS && data_len == CRYPT_BS) {
+        len = 0;
+    } else {
         fclose(in);
-    } // decrypt
+        delete fish;
+        LoadAString(errmess, IDSC_FILE_TOO_SHORT); // truncated, most likely
+        return false;
+    }
     
-    { // write decrypted data
-        size_t suffix_len = CIPHERTEXT_SUFFIX.length();
-        size_t filepath_len = fn.length();
-        
-        stringT out_fn = fn;
-        out_fn = out_fn.substr(0,filepath_len - suffix_len);
-        
-        FILE *out = pws_os::FOpen(out_fn, _T("wb"));
-        if (out != NULL) {
-            size_t fret = fwrite(buf, 1, len, out);
-            if (fret != len) {
-                int save_errno = errno;
-                fclose(out);
-                errno = save_errno;
-                goto exit;
-            }
-            if (fclose(out) != 0) {
-                status = false;
-                goto exit;
-            }
-        } else { // open failed
+    out = pws_os::FOpen(out_fn, _T("wb"));
+    if (out == NULL) {
+        status = false;
+        goto exit;
+    }
+    created = true;
+    
+    buf = static_cast<unsigned char *>(SecureHeap::Alloc(CRYPT_CHUNK));
+    left = data_len;
+    while (left > 0) {
+        const size_t n = (left < CRYPT_CHUNK) ? static_cast<size_t>(left) : CRYPT_CHUNK;
+        if (fread(buf, 1, n, in) != n) {
+            if (!ferror(in))
+                errno = EIO;
             status = false;
             goto exit;
         }
-    } // write decrypted
+        left -= n;
+        fish->DecryptCBC(buf, n / CRYPT_BS, ipthing);
+        // Don't write out the last block's padding
+        const size_t nw = (len < n) ? static_cast<size_t>(len) : n;
+        SAFE_FWRITE(buf, 1, nw, out);
+        len -= nw;
+    }
+    
+    fclose(in);
+    in = NULL;
+    status = (fclose(out) == 0);
+    out = NULL;
 exit:
-    if (!status)
+    if (!status) {
+        const int save_errno = errno;
+        if (in != NULL)
+            fclose(in);
+        if (out != NULL)
+            fclose(out);
+        if (created)
+            pws_os::DeleteAFile(out_fn);
+        errno = save_errno;
         errmess = ErrorMessages();
-    delete[] buf; // allocated by _readcbc
+    }
+    delete fish;
+    SecureHeap::Free(buf);
     return status;
 }
 
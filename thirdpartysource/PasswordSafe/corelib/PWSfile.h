@@ -34,6 +34,9 @@
 // MAX_USABLE_HASH_ITERS is a guesstimate on what's acceptable to a user
 // with a reasonably powerful CPU. Real limit's 2^32-1.
 #define MAX_USABLE_HASH_ITERS (1 << 22)
+// New databases and passphrases get as many iterations as this machine
+// can stretch in DEFAULT_UNLOCK_MILLISECONDS, see CalibrateHashIters().
+#define DEFAULT_UNLOCK_MILLISECONDS 250
 
 #define V3_SUFFIX      _T("psafe3")
 #define V4_SUFFIX      _T("psafe4")
@@ -94,15 +97,61 @@ public:
         HDR_EMPTYGROUP            = 0x11,     // added in format 0x030B
         HDR_YUBI_SK               = 0x12,     // Yubi-specific: format 0x030c
         HDR_LAST,                             // Start of unknown fields!
+        HDR_NRECORDS              = 0xf0,     // iPasswordSafe: see SetRecordCount()
         HDR_END                   = 0xff};    // header field types, per formatV{2,3}.txt
     
+    /**
+     * A passkey stretched with a V3 or V4 salt, which Open() and
+     * CheckPasskey() can reuse instead of stretching the same passkey
+     * again. It's plain data, so that its owner can keep it encrypted
+     * (PWScore does so under its session key), and it's as sensitive
+     * as the passkey: trash it when done.
+     */
+    struct StretchedKey {
+        unsigned char salt[SHA256::HASHLEN];
+        uint32 nHashIters; // zero if not set
+        VERSION version; // V30 or V40, which stretch differently
+        unsigned char Ptag[SHA256::HASHLEN]; // P'
+        unsigned char check[SHA256::HASHLEN]; // HMAC(P', passkey)
+        
+        void Set(VERSION v, const unsigned char *salt, uint32 N,
+                 const StringX &passkey, const unsigned char *Ptag);
+        bool IsSet() const {return nHashIters != 0;}
+        // True if this was stretched from passkey for a v file
+        bool IsFor(VERSION v, const StringX &passkey) const;
+        // True if this is a v file's P' for passkey, salt and N
+        bool Matches(VERSION v, const unsigned char *salt, uint32 N,
+                     const StringX &passkey) const;
+        void Clear();
+    };
+    
     static PWSfile *MakePWSfile(const StringX &a_filename, const StringX &passkey,
                                 VERSION &version, RWmode mode, int &status,
                                 Asker *pAsker = NULL, Reporter *pReporter = NULL);
     
-    static VERSION ReadVersion(const StringX &filename, const StringX &passkey);
+    // If sk's non-NULL, it's used if it Matches() the file, and is set
+    // to the key that unlocked a V3 or V4 file (see StretchedKey).
+    static VERSION ReadVersion(const StringX &filename, const StringX &passkey,
+                               StretchedKey *sk = NULL);
     static int CheckPasskey(const StringX &filename,
-                            const StringX &passkey, VERSION &version);
+                            const StringX &passkey, VERSION &version,
+                            StretchedKey *sk = NULL);
+    // Following reads a V3 or V4 file's header and stops there, for
+    // listing databases without decrypting their records: one key
+    // stretch per file. hdr.m_nRecords is -1 unless the file was written
+    // with SetRecordCount(). A file that isn't laid out as V3 or V4
+    // gets NOT_PWS3_FILE, rather than blaming the passkey.
+    // Only the passkey's checked: the header isn't authenticated until
+    // the whole file's been read, so don't trust it beyond display.
+    static int PeekHeader(const StringX &filename, const StringX &passkey,
+                          PWSfileHeader &hdr);
+    
+    // Times a few ms of version's key stretching on this machine, and
+    // returns the number of iterations that would take targetMillis,
+    // within [MIN_HASH_ITERATIONS, MAX_USABLE_HASH_ITERS].
+    // Versions without key stretching get MIN_HASH_ITERATIONS.
+    static uint32 CalibrateHashIters(VERSION version,
+                                     uint32 targetMillis = DEFAULT_UNLOCK_MILLISECONDS);
     
     // Following for 'legacy' use of pwsafe as file encryptor/decryptor
     static bool Encrypt(const stringT &fn, const StringX &passwd, stringT &errmess);
@@ -112,12 +161,32 @@ public:
     
     virtual int Open(const StringX &passkey) = 0;
     virtual int Close();
+    // A database being written goes to a temporary file, which only
+    // replaces the original once it's been written in full and synced
+    // to disk (see FOpen). Call this instead of Close() after a write
+    // error, to discard it and leave the original as it was.
+    void Abandon();
     
     virtual int WriteRecord(const CItemData &item) = 0;
     virtual int ReadRecord(CItemData &item) = 0;
+    // Following reads a record's fields without setting them in a CItemData
+    // (see CItemData::ReadRaw). Only V3 and later support this.
+    virtual int ReadRawRecord(CItemData::RawRecord &)
+    {return UNSUPPORTED_VERSION;}
+    // Following split WriteRecord() the same way, for pipelined saving
+    // (see CItemData::GetRaw). GetRawRecord() may be called on any thread.
+    virtual int GetRawRecord(const CItemData &, CItemData::RawRecord &) const
+    {return UNSUPPORTED_VERSION;}
+    virtual int WriteRawRecord(const CItemData::RawRecord &)
+    {return UNSUPPORTED_VERSION;}
     
     const PWSfileHeader &GetHeader() const {return m_hdr;}
     void SetHeader(const PWSfileHeader &h) {m_hdr = h;}
+    // Call before Open() for writing with the number of records that'll
+    // be written, to have it saved in the header (V3 and later), tied to
+    // this save's time, so that a save by an application that doesn't
+    // know the field leaves it stale rather than wrong.
+    void SetRecordCount(int n) {m_nRecordsToWrite = n;}
     
     void SetDefUsername(const StringX &du) {m_defusername = du;} // for V17 conversion (read) only
     void SetCurVersion(VERSION v) {m_curversion = v;}
@@ -127,11 +196,28 @@ public:
     {return m_nRecordsWithUnknownFields;}
     
     long GetOffset() const;
+    const StringX &GetFilename() const {return m_filename;}
+    
+    // Following lets a PWSJournal be keyed to the generation of the
+    // database this object last read or wrote (V3 and later).
+    // Returns false until Close() has succeeded.
+    bool GetJournalKeys(unsigned char key[SHA256::HASHLEN],
+                        unsigned char hkey[SHA256::HASHLEN],
+                        unsigned char base[SHA256::HASHLEN]) const;
     
     // Following implemented in V3 and later
     virtual uint32 GetNHashIters() const {return 0;}
     virtual void SetNHashIters(uint32 ) {}
     
+    // Call before Open() with a key from an earlier GetStretchedKey().
+    // Reading uses it if it's for the file's salt & iteration count,
+    // writing reuses its salt if it's for the iteration count. Either
+    // way, it has to be for Open()'s passkey, so a new passkey or
+    // iteration count gets a new salt.
+    void SetStretchedKey(const StretchedKey &sk) {m_stretchedKey = sk;}
+    // After Open(), the key that was used to read or write the file
+    bool GetStretchedKey(StretchedKey &sk) const;
+    
     void SetDBFilters(const PWSFilters &MapDBFilters) { m_MapDBFilters = MapDBFilters;}
     const PWSFilters *GetDBFilters() const {return &m_MapDBFilters;}
     
@@ -157,6 +243,16 @@ public:
 protected:
     PWSfile(const StringX &filename, RWmode mode, VERSION v = UNKNOWN_VERSION);
     void FOpen(); // calls right variant of m_fd = fopen(m_filename);
+    // Lets PWSfile::Close() replace m_filename with what's been written.
+    // Subclasses call this once they've written a file in full.
+    void Commit() {m_bCommit = true;}
+    // Once the header's been read via stdio, V3 & V4 read the rest of the
+    // file via a read-only mapping, if we can get one.
+    // FRead(), FSeek() and FTell() work on whichever is in use.
+    void MapForRead();
+    size_t FRead(void *buf, size_t size, size_t count);
+    int FSeek(long offset, int whence);
+    long FTell() const;
     virtual size_t WriteCBC(unsigned char type, const StringX &data) = 0;
     virtual size_t WriteCBC(unsigned char type, const unsigned char *data,
                             size_t length);
@@ -164,10 +260,21 @@ protected:
                            size_t &length);
     
     static void HashRandom256(unsigned char *p256); // when we don't want to expose our RNG
+    // Scales the time stretch(N) takes for a measurable N up to targetMillis
+    typedef void (*StretchFn)(uint32 N);
+    static uint32 CalibrateHashIters(StretchFn stretch, uint32 targetMillis);
+    // V3 & V4 call these with their K & L once they have them,
+    // and with the file's HMAC when it's been written or verified.
+    void SetJournalKeys(const unsigned char *K, const unsigned char *L,
+                        unsigned long keylen);
+    void SetJournalBase(const unsigned char digest[SHA256::HASHLEN]);
     
     const StringX m_filename;
     StringX m_passkey;
     FILE *m_fd;
+    const unsigned char *m_map; // NULL unless MapForRead() succeeded
+    ulong64 m_mapLength;
+    const unsigned char *m_mapPos;
     VERSION m_curversion;
     const RWmode m_rw;
     StringX m_defusername; // for V17 conversion (read) only
@@ -180,14 +287,24 @@ protected:
     // Save unknown header fields on read to put back on write unchanged
     UnknownFieldList m_UHFL;
     int m_nRecordsWithUnknownFields;
+    int m_nRecords; // read or written so far, V3 and later
+    int m_nRecordsToWrite; // see SetRecordCount(), -1 if not set
     PWSFilters m_MapDBFilters;
     PSWDPolicyMap m_MapPSWDPLC;
     std::vector<StringX> m_vEmptyGroups;
     ulong64 m_fileLength;
     Asker *m_pAsker;
     Reporter *m_pReporter;
+    StretchedKey m_stretchedKey; // see SetStretchedKey()
     
 private:
+    unsigned char m_jkey[SHA256::HASHLEN];
+    unsigned char m_jhkey[SHA256::HASHLEN];
+    unsigned char m_jbase[SHA256::HASHLEN];
+    bool m_bJournalKeys, m_bJournalBase;
+    StringX m_tmpfilename; // what we're writing, until Close() renames it
+    bool m_bCommit;
+
     PWSfile& operator=(const PWSfile&); // Do not implement
 };
 
@@ -13,7 +13,8 @@ PWSfileHeader::PWSfileHeader()
     m_prefString(_T("")), m_whenlastsaved(0),
     m_lastsavedby(_T("")), m_lastsavedon(_T("")),
     m_whatlastsaved(_T("")),
-    m_DB_Name(_T("")), m_DB_Description(_T("")), m_yubi_sk(NULL)
+    m_DB_Name(_T("")), m_DB_Description(_T("")), m_yubi_sk(NULL),
+    m_nRecords(-1)
 {
 }
 
@@ -25,7 +26,8 @@ PWSfileHeader::PWSfileHeader(const PWSfileHeader &h)
     m_prefString(h.m_prefString), m_whenlastsaved(h.m_whenlastsaved),
     m_lastsavedby(h.m_lastsavedby), m_lastsavedon(h.m_lastsavedon),
     m_whatlastsaved(h.m_whatlastsaved),
-    m_DB_Name(h.m_DB_Name), m_DB_Description(h.m_DB_Description), m_RUEList(h.m_RUEList)
+    m_DB_Name(h.m_DB_Name), m_DB_Description(h.m_DB_Description), m_RUEList(h.m_RUEList),
+    m_nRecords(h.m_nRecords)
 {
   if (h.m_yubi_sk != NULL) {
     m_yubi_sk = new unsigned char[YUBI_SK_LEN];
@@ -57,6 +59,7 @@ PWSfileHeader &PWSfileHeader::operator=(const PWSfileHeader &h)
     m_DB_Name = h.m_DB_Name;
     m_DB_Description = h.m_DB_Description;
     m_RUEList = h.m_RUEList;
+    m_nRecords = h.m_nRecords;
     if (h.m_yubi_sk != NULL) {
       if (m_yubi_sk)
         trashMemory(m_yubi_sk, YUBI_SK_LEN);
@@ -83,7 +86,8 @@ bool PWSfileHeader::operator==(const PWSfileHeader &h) const
                  m_whatlastsaved == h.m_whatlastsaved &&
                  m_DB_Name == h.m_DB_Name &&
                  m_DB_Description == h.m_DB_Description &&
-                 m_RUEList == h.m_RUEList);
+                 m_RUEList == h.m_RUEList &&
+                 m_nRecords == h.m_nRecords);
   if (!retval)
     return false;
   if (m_yubi_sk == NULL && h.m_yubi_sk == NULL)
@@ -43,6 +43,8 @@ struct PWSfileHeader {
     // Named Password Policies
     // Empty groups
   unsigned char *m_yubi_sk;             // YubiKey HMAC key, added in 0x030a / 3.27Y
+  int m_nRecords;                       // Records as of m_whenlastsaved, -1 if unknown
+                                        // (see PWSfile::SetRecordCount)
 };
 
 #endif /* __PWSFILEHEADER_H */
@@ -7,6 +7,7 @@
  */
 #include "PWSfileV1V2.h"
 #include "PWSrand.h"
+#include "SecureHeap.h"
 #include "core.h"
 #include "os/file.h"
 #include "os/utf8conv.h"
@@ -183,6 +184,9 @@ exit:
 
 int PWSfileV1V2::Close()
 {
+    // No trailer to write, what's been written is all there is
+    if (m_rw == Write && m_fd != NULL && m_status == SUCCESS)
+        Commit();
     return PWSfile::Close();
 }
 
@@ -390,11 +394,10 @@ size_t PWSfileV1V2::ReadCBC(unsigned char &type, StringX &data)
         data = wc;
         trashMemory(wc, wcLen);
         delete[] wc;
-        trashMemory(buffer, buffer_len);
-        delete[] buffer;
+        SecureHeap::Free(buffer); // trashes it
     } else {
         data = _T("");
-        // no need to delete[] buffer, since _readcbc will not allocate if
+        // no need to free buffer, since _readcbc will not allocate if
         // buffer_len is zero
     }
     return retval;
@@ -8,6 +8,7 @@
 #include "PWSfileV3.h"
 #include "PWSrand.h"
 #include "Util.h"
+#include "SecureHeap.h"
 #include "SysInfo.h"
 #include "PWScore.h"
 #include "PWSFilters.h"
@@ -120,6 +121,7 @@ int PWSfileV3::Close()
     
     // Write or verify HMAC, depending on RWmode.
     if (m_rw == Write) {
+        ASSERT(m_nRecordsToWrite < 0 || m_nRecords == m_nRecordsToWrite);
         size_t fret;
         fret = fwrite(TERMINAL_BLOCK, sizeof(TERMINAL_BLOCK), 1, m_fd);
         if (fret != 1) {
@@ -131,15 +133,20 @@ int PWSfileV3::Close()
             PWSfile::Close();
             return FAILURE;
         }
-        return PWSfile::Close();
+        Commit();
+        const int rc = PWSfile::Close();
+        if (rc == SUCCESS)
+            SetJournalBase(digest);
+        return rc;
     } else { // Read
         // We're here *after* TERMINAL_BLOCK has been read
         // and detected (by _readcbc) - just read hmac & verify
         unsigned char d[SHA256::HASHLEN];
-        fread(d, sizeof(d), 1, m_fd);
-        if (memcmp(d, digest, SHA256::HASHLEN) == 0)
+        FRead(d, sizeof(d), 1);
+        if (memcmp(d, digest, SHA256::HASHLEN) == 0) {
+            SetJournalBase(digest);
             return PWSfile::Close();
-        else {
+        } else {
             PWSfile::Close();
             return BAD_DIGEST;
         }
@@ -199,7 +206,8 @@ err:
 
 int PWSfileV3::CheckPasskey(const StringX &filename,
                             const StringX &passkey, FILE *a_fd,
-                            unsigned char *aPtag, uint32 *nITER)
+                            unsigned char *aPtag, uint32 *nITER,
+                            StretchedKey *sk)
 {
     PWS_LOGIT;
     
@@ -238,7 +246,10 @@ int PWSfileV3::CheckPasskey(const StringX &filename,
         if (aPtag == NULL)
             aPtag = Ptag;
         
-        StretchKey(salt, sizeof(salt), passkey, N, aPtag);
+        if (sk != NULL && sk->Matches(V30, salt, N, passkey))
+            memcpy(aPtag, sk->Ptag, SHA256::HASHLEN);
+        else
+            StretchKey(salt, sizeof(salt), passkey, N, aPtag);
     }
     unsigned char HPtag[SHA256::HASHLEN];
     H.Update(aPtag, SHA256::HASHLEN);
@@ -249,6 +260,8 @@ int PWSfileV3::CheckPasskey(const StringX &filename,
         retval = WRONG_PASSWORD;
         goto err;
     }
+    if (sk != NULL)
+        sk->Set(V30, salt, getInt32(Nb), passkey, aPtag);
 err:
     if (a_fd == NULL) // if we opened the file, we close it...
         fclose(fd);
@@ -277,7 +290,26 @@ int PWSfileV3::WriteRecord(const CItemData &item)
 {
     ASSERT(m_fd != NULL);
     ASSERT(m_curversion == V30);
-    return item.Write(this);
+    const int status = item.Write(this);
+    if (status == SUCCESS)
+        m_nRecords++;
+    return status;
+}
+
+int PWSfileV3::GetRawRecord(const CItemData &item, CItemData::RawRecord &raw) const
+{
+    item.GetRaw(this, raw);
+    return SUCCESS;
+}
+
+int PWSfileV3::WriteRawRecord(const CItemData::RawRecord &raw)
+{
+    ASSERT(m_fd != NULL);
+    ASSERT(m_curversion == V30);
+    const int status = CItemData::WriteRaw(this, raw);
+    if (status == SUCCESS)
+        m_nRecords++;
+    return status;
 }
 
 size_t PWSfileV3::ReadCBC(unsigned char &type, unsigned char* &data,
@@ -296,7 +328,20 @@ int PWSfileV3::ReadRecord(CItemData &item)
 {
     ASSERT(m_fd != NULL);
     ASSERT(m_curversion == V30);
-    return item.Read(this);
+    const int status = item.Read(this);
+    if (status == SUCCESS)
+        m_nRecords++;
+    return status;
+}
+
+int PWSfileV3::ReadRawRecord(CItemData::RawRecord &raw)
+{
+    ASSERT(m_fd != NULL);
+    ASSERT(m_curversion == V30);
+    const int status = CItemData::ReadRaw(this, raw);
+    if (status == SUCCESS)
+        m_nRecords++;
+    return status;
 }
 
 void PWSfileV3::StretchKey(const unsigned char *salt, unsigned long saltLen,
@@ -323,15 +368,24 @@ void PWSfileV3::StretchKey(const unsigned char *salt, unsigned long saltLen,
     delete[] pstr;
     
     ASSERT(N >= MIN_HASH_ITERATIONS); // minimal value we're willing to use
-    for (unsigned int i = 0; i < N; i++) {
-        SHA256 H;
-        // The 2nd param in next line was sizeof(X) in Beta-1
-        // (bug #1451422). This change broke the ability to read beta-1
-        // generated databases. If this is really needed, we should
-        // hack the read functionality to try both variants (ugh).
-        H.Update(X, SHA256::HASHLEN);
-        H.Final(X);
-    }
+    // X = SHA256(X), N times. Each round hashes all SHA256::HASHLEN bytes
+    // of X: Beta-1 hashed sizeof(X) (bug #1451422). This change broke the
+    // ability to read beta-1 generated databases. If this is really
+    // needed, we should hack the read functionality to try both
+    // variants (ugh).
+    SHA256::Iterate(X, N);
+}
+
+void PWSfileV3::TimedStretch(uint32 N)
+{
+    unsigned char salt[PWSaltLength] = {0};
+    unsigned char Ptag[SHA256::HASHLEN];
+    StretchKey(salt, sizeof(salt), _T("calibrate"), N, Ptag);
+}
+
+uint32 PWSfileV3::CalibrateHashIters(uint32 targetMillis)
+{
+    return PWSfile::CalibrateHashIters(TimedStretch, targetMillis);
 }
 
 // Following specific for PWSfileV3::WriteHeader
@@ -365,17 +419,25 @@ int PWSfileV3::WriteHeader()
     static_assert(int(PWSaltLength) == int(SHA256::HASHLEN),
                   "can't call HashRandom256");
     
-    HashRandom256(salt);
+    unsigned char Ptag[SHA256::HASHLEN];
+    
+    // Reuse the salt and P' we were given, rather than stretch the
+    // same passkey again on every save
+    if (m_stretchedKey.nHashIters == NumHashIters &&
+        m_stretchedKey.IsFor(V30, m_passkey)) {
+        memcpy(salt, m_stretchedKey.salt, sizeof(salt));
+        memcpy(Ptag, m_stretchedKey.Ptag, sizeof(Ptag));
+    } else {
+        HashRandom256(salt);
+        StretchKey(salt, sizeof(salt), m_passkey, NumHashIters, Ptag);
+        m_stretchedKey.Set(V30, salt, NumHashIters, m_passkey, Ptag);
+    }
     SAFE_FWRITE(salt, 1, sizeof(salt), m_fd);
     
     unsigned char Nb[sizeof(NumHashIters)];
     putInt32(Nb, NumHashIters);
     SAFE_FWRITE(Nb, 1, sizeof(Nb), m_fd);
     
-    unsigned char Ptag[SHA256::HASHLEN];
-    
-    StretchKey(salt, sizeof(salt), m_passkey, NumHashIters, Ptag);
-    
     {
         unsigned char HPtag[SHA256::HASHLEN];
         SHA256 H;
@@ -399,6 +461,7 @@ int PWSfileV3::WriteHeader()
         TF.Encrypt(L + 16, B3B4 + 16);
         SAFE_FWRITE(B3B4, 1, sizeof(B3B4), m_fd);
         m_hmac.Init(L, sizeof(L));
+        SetJournalKeys(m_key, L, sizeof(L));
     }
     {
         // See discussion in HashRandom256 to understand why we hash
@@ -462,6 +525,16 @@ int PWSfileV3::WriteHeader()
     if (numWritten <= 0) { m_status = FAILURE; goto end; }
     m_hdr.m_whenlastsaved = time_now;
     
+    // and how many records it has then (see SetRecordCount)
+    if (m_nRecordsToWrite >= 0) {
+        unsigned char nbuf[sizeof(int32) + sizeof(buf)];
+        putInt32(nbuf, m_nRecordsToWrite);
+        memcpy(nbuf + sizeof(int32), buf, sizeof(buf));
+        numWritten = WriteCBC(HDR_NRECORDS, nbuf, sizeof(nbuf));
+        if (numWritten <= 0) { m_status = FAILURE; goto end; }
+    }
+    m_hdr.m_nRecords = m_nRecordsToWrite;
+    
     // Write out who saved it!
     {
         const SysInfo *si = SysInfo::GetInstance();
@@ -587,7 +660,7 @@ int PWSfileV3::ReadHeader()
     
     unsigned char Ptag[SHA256::HASHLEN];
     m_status = CheckPasskey(m_filename, m_passkey, m_fd,
-                            Ptag, &m_nHashIters);
+                            Ptag, &m_nHashIters, &m_stretchedKey);
     
     if (m_status != SUCCESS) {
         Close();
@@ -609,9 +682,13 @@ int PWSfileV3::ReadHeader()
     TF.Decrypt(B3B4 + 16, L + 16);
     
     m_hmac.Init(L, sizeof(L));
+    SetJournalKeys(m_key, L, sizeof(L));
     
     fread(m_ipthing, 1, sizeof(m_ipthing), m_fd);
     
+    // Header fields and records are read from here on
+    MapForRead();
+    
     m_fish = new TwoFish(m_key, sizeof(m_key));
     
     unsigned char fieldType;
@@ -620,6 +697,8 @@ int PWSfileV3::ReadHeader()
     unsigned char *utf8 = NULL;
     size_t utf8Len = 0;
     bool found0302UserHost = false; // to resolve potential conflicts
+    int nRecords = -1;
+    time_t nRecordsWhen = 0; // HDR_NRECORDS only counts if saved with the file
     
     do {
         if (ReadCBC(fieldType, utf8, utf8Len) == 0)
@@ -631,14 +710,14 @@ int PWSfileV3::ReadHeader()
                 // This hack keeps bwd compatibility.
                 if (utf8Len != sizeof(VersionNum) &&
                     utf8Len != sizeof(int32)) {
-                    delete[] utf8;
+                    SecureHeap::Free(utf8);
                     Close();
                     return FAILURE;
                 }
                 if (utf8[1] !=
                     static_cast<unsigned char>((VersionNum & 0xff00) >> 8)) {
                     //major version mismatch
-                    delete[] utf8;
+                    SecureHeap::Free(utf8);
                     Close();
                     return UNSUPPORTED_VERSION;
                 }
@@ -650,7 +729,7 @@ int PWSfileV3::ReadHeader()
                 
             case HDR_UUID: /* UUID */
                 if (utf8Len != sizeof(uuid_array_t)) {
-                    delete[] utf8;
+                    SecureHeap::Free(utf8);
                     Close();
                     return FAILURE;
                 }
@@ -841,7 +920,7 @@ int PWSfileV3::ReadHeader()
                 
             case HDR_YUBI_SK:
                 if (utf8Len != PWSfileHeader::YUBI_SK_LEN) {
-                    delete[] utf8;
+                    SecureHeap::Free(utf8);
                     Close();
                     return FAILURE;
                 }
@@ -933,6 +1012,13 @@ int PWSfileV3::ReadHeader()
                 break;
             }
                 
+            case HDR_NRECORDS: /* Number of records, and when last saved */
+                if (utf8Len > sizeof(int32) &&
+                    PWSUtil::pull_time(nRecordsWhen, utf8 + sizeof(int32),
+                                       utf8Len - sizeof(int32)))
+                    nRecords = getInt32(utf8);
+                break;
+                
             case HDR_END: /* process END so not to treat it as 'unknown' */
                 break;
                 
@@ -952,9 +1038,14 @@ int PWSfileV3::ReadHeader()
 #endif
                 break;
         }
-        delete[] utf8; utf8 = NULL; utf8Len = 0;
+        SecureHeap::Free(utf8); utf8 = NULL; utf8Len = 0;
     } while (fieldType != HDR_END);
     
+    // An application that doesn't know HDR_NRECORDS keeps it as an
+    // unknown field, but updates the time it was saved
+    if (nRecordsWhen != 0 && nRecordsWhen == m_hdr.m_whenlastsaved)
+        m_hdr.m_nRecords = nRecords;
+    
     // Now sort it for when we compare.
     std::sort(m_vEmptyGroups.begin(), m_vEmptyGroups.end());
     
@@ -25,7 +25,8 @@ public:
     static int CheckPasskey(const StringX &filename,
                             const StringX &passkey,
                             FILE *a_fd = NULL,
-                            unsigned char *aPtag = NULL, uint32 *nIter = NULL);
+                            unsigned char *aPtag = NULL, uint32 *nIter = NULL,
+                            StretchedKey *sk = NULL);
     static bool IsV3x(const StringX &filename, VERSION &v);
     
     PWSfileV3(const StringX &filename, RWmode mode, VERSION version);
@@ -36,9 +37,13 @@ public:
     
     virtual int WriteRecord(const CItemData &item);
     virtual int ReadRecord(CItemData &item);
+    virtual int ReadRawRecord(CItemData::RawRecord &raw);
+    virtual int GetRawRecord(const CItemData &item, CItemData::RawRecord &raw) const;
+    virtual int WriteRawRecord(const CItemData::RawRecord &raw);
     
     virtual uint32 GetNHashIters() const {return m_nHashIters;}
     virtual void SetNHashIters(uint32 N) {m_nHashIters = N;}
+    static uint32 CalibrateHashIters(uint32 targetMillis);
     
 private:
     enum {PWSaltLength = 32}; // per format spec
@@ -60,5 +65,6 @@ private:
     static void StretchKey(const unsigned char *salt, unsigned long saltLen,
                            const StringX &passkey,
                            uint32 N, unsigned char *Ptag);
+    static void TimedStretch(uint32 N); // for CalibrateHashIters
 };
 #endif /* __PWSFILEV3_H */
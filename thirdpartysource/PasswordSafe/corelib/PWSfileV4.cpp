@@ -9,6 +9,7 @@
 #include "PWSfileV4.h"
 #include "PWSrand.h"
 #include "Util.h"
+#include "SecureHeap.h"
 #include "SysInfo.h"
 #include "PWScore.h"
 #include "PWSFilters.h"
@@ -122,7 +123,9 @@ int PWSfileV4::Open(const StringX &passkey)
     // Nonce is used to detect end of keyblocks
     static_assert(int(NONCELEN) == int(SHA256::HASHLEN), "can't call HashRandom256");
     HashRandom256(m_nonce); // Generate nonce
-    if (!m_keyblocks.GetKeys(passkey, m_nHashIters, m_key, m_ell)) {
+    if (m_keyblocks.empty()) {
+      MakeKeyBlock(passkey);
+    } else if (!m_keyblocks.GetKeys(passkey, m_nHashIters, m_key, m_ell)) {
       PWSfile::Close();
       return WRONG_PASSWORD;
     }
@@ -166,25 +169,31 @@ int PWSfileV4::Close()
   // Write or verify HMAC, depending on RWmode.
   size_t fret;
   if (m_rw == Write) {
+    ASSERT(m_nRecordsToWrite < 0 || m_nRecords == m_nRecordsToWrite);
     fret = fwrite(digest, sizeof(digest), 1, m_fd);
     if (fret != 1) {
       PWSfile::Close();
       return FAILURE;
     }
-    return PWSfile::Close();
+    Commit();
+    const int rc = PWSfile::Close();
+    if (rc == SUCCESS)
+      SetJournalBase(digest);
+    return rc;
   } else { // Read
     // Clear keyblocks, in case we re-open for read
     m_keyblocks.m_kbs.clear();
     // read hmac & verify
     unsigned char d[SHA256::HASHLEN];
-    fret = fread(d, sizeof(d), 1, m_fd);
+    fret = FRead(d, sizeof(d), 1);
     if (fret != 1) {
       PWSfile::Close();
       return TRUNCATED_FILE;
     }
-    if (memcmp(d, digest, SHA256::HASHLEN) == 0)
+    if (memcmp(d, digest, SHA256::HASHLEN) == 0) {
+      SetJournalBase(digest);
       return PWSfile::Close();
-    else {
+    } else {
       PWSfile::Close();
       return BAD_DIGEST;
     }
@@ -203,9 +212,34 @@ int PWSfileV4::SanityCheck(FILE *stream)
   return SUCCESS;
 }
 
+bool PWSfileV4::IsV4Layout(const StringX &filename)
+{
+  FILE *fd = pws_os::FOpen(filename.c_str(), _T("rb"));
+  if (fd == NULL)
+    return false;
+
+  bool retval = false;
+  if (SanityCheck(fd) == SUCCESS) {
+    // Same walk as ParseKeyBlocks(), without trying any of them
+    PWSfileV4 pv4(filename, Read, V40);
+    pv4.m_fd = fd;
+    if (fread(pv4.m_nonce, NONCELEN, 1, fd) == 1) {
+      unsigned char calc_hnonce[SHA256::HASHLEN];
+      SHA256 noncehasher;
+      noncehasher.Update(pv4.m_nonce, NONCELEN);
+      noncehasher.Final(calc_hnonce);
+      while (!retval && pv4.ReadKeyBlock() == SUCCESS)
+        retval = pv4.EndKeyBlocks(calc_hnonce);
+    }
+    pv4.m_fd = NULL; // s.t. d'tor doesn't fclose()
+  }
+  fclose(fd);
+  return retval;
+}
+
 int PWSfileV4::CheckPasskey(const StringX &filename,
                             const StringX &passkey, FILE *a_fd,
-                            unsigned char *, uint32 *)
+                            unsigned char *, uint32 *, StretchedKey *sk)
 {
   PWS_LOGIT;
 
@@ -223,7 +257,11 @@ int PWSfileV4::CheckPasskey(const StringX &filename,
   if (retval == SUCCESS) {
     PWSfileV4 pv4(filename, Read, V40);
     pv4.m_fd = fd;
+    if (sk != NULL)
+      pv4.SetStretchedKey(*sk);
     retval = pv4.ParseKeyBlocks(passkey);
+    if (retval == SUCCESS && sk != NULL)
+      pv4.GetStretchedKey(*sk);
     pv4.m_fd = NULL; // s.t. d'tor doesn't fclose()
   }
   if (a_fd == NULL) // if we opened the file, we close it...
@@ -260,7 +298,26 @@ int PWSfileV4::WriteRecord(const CItemData &item)
 {
   ASSERT(m_fd != NULL);
   ASSERT(m_curversion == V40);
-  return item.Write(this);
+  const int status = item.Write(this);
+  if (status == SUCCESS)
+    m_nRecords++;
+  return status;
+}
+
+int PWSfileV4::GetRawRecord(const CItemData &item, CItemData::RawRecord &raw) const
+{
+  item.GetRaw(this, raw);
+  return SUCCESS;
+}
+
+int PWSfileV4::WriteRawRecord(const CItemData::RawRecord &raw)
+{
+  ASSERT(m_fd != NULL);
+  ASSERT(m_curversion == V40);
+  const int status = CItemData::WriteRaw(this, raw);
+  if (status == SUCCESS)
+    m_nRecords++;
+  return status;
 }
 
 int PWSfileV4::WriteRecord(const CItemAtt &att)
@@ -273,7 +330,8 @@ int PWSfileV4::WriteRecord(const CItemAtt &att)
   // Following writes AttIV, AttEK, AttAK, AttContent
   // and AttContentHMAC per format spec.
   // All except the content are generated internally.
-size_t PWSfileV4::WriteContentFields(unsigned char *content, size_t len)
+size_t PWSfileV4::WriteContentFields(unsigned char *content, size_t len,
+                                     ContentKeys *keys)
 {
   if (len == 0)
     return SUCCESS;
@@ -297,6 +355,13 @@ size_t PWSfileV4::WriteContentFields(unsigned char *content, size_t len)
   putInt32(buf, len32);
   WriteField(CItemAtt::CONTENT, buf, sizeof(buf));
 
+  if (keys != NULL) {
+    memcpy(keys->IV, IV, sizeof(IV));
+    memcpy(keys->EK, EK, sizeof(EK));
+    memcpy(keys->AK, AK, sizeof(AK));
+    keys->offset = ftell(m_fd);
+  }
+
   // Create fish with EK
   TwoFish fish(EK, sizeof(EK));
   trashMemory(EK, sizeof(EK));
@@ -308,6 +373,7 @@ size_t PWSfileV4::WriteContentFields(unsigned char *content, size_t len)
 
   // write actual content using EK
   _writecbc(m_fd, content, len, &fish, IV);
+  trashMemory(IV, sizeof(IV));
 
   // update content's HMAC
   hmac.Update(content, (unsigned long)len);
@@ -316,20 +382,43 @@ size_t PWSfileV4::WriteContentFields(unsigned char *content, size_t len)
   unsigned char digest[SHA256::HASHLEN];
   hmac.Final(digest);
   WriteField(CItemAtt::CONTENTHMAC, digest, sizeof(digest));
+  if (keys != NULL)
+    memcpy(keys->digest, digest, sizeof(digest));
 
   return len;
 }
 
-size_t PWSfileV4::ReadContent(Fish *fish,  unsigned char *cbcbuffer,
-                              unsigned char *&content, size_t clen)
+long PWSfileV4::SkipContent(size_t clen)
+{
+  // Content's CBC encrypted with TwoFish, padded to a whole block
+  const size_t BS = TwoFish::BLOCKSIZE;
+  const size_t blen = ((clen + BS - 1)/BS)*BS;
+  const long offset = FTell();
+
+  if (offset < 0 || ulong64(offset) + blen > m_effectiveFileLength ||
+      FSeek(long(blen), SEEK_CUR) != 0)
+    return -1L;
+  return offset;
+}
+
+size_t PWSfileV4::ReadContent(const StringX &filename, long offset,
+                              Fish *fish, unsigned char *cbcbuffer,
+                              unsigned char *content, size_t clen)
 {
-  ASSERT(clen > 0 && fish != NULL && cbcbuffer != NULL);
-  // round up clen to nearest BS:
+  ASSERT(clen > 0 && fish != NULL && cbcbuffer != NULL && content != NULL);
+  // round up clen to nearest BS, as _writecbc() does:
   const unsigned int BS = fish->GetBlockSize();
-  size_t blen = (clen/BS + 1)*BS;
+  size_t blen = ((clen + BS - 1)/BS)*BS;
+
+  FILE *fd = pws_os::FOpen(filename.c_str(), _T("rb"));
+  if (fd == NULL)
+    return 0;
 
-  content = new unsigned char[blen]; // caller's responsible for delete[]
-  return _readcbc(m_fd, content, blen, fish, cbcbuffer);
+  size_t retval = 0;
+  if (fseek(fd, offset, SEEK_SET) == 0)
+    retval = _readcbc(fd, content, blen, fish, cbcbuffer);
+  fclose(fd);
+  return retval;
 }
 
 size_t PWSfileV4::ReadCBC(unsigned char &type, unsigned char* &data,
@@ -350,39 +439,64 @@ size_t PWSfileV4::ReadCBC(unsigned char &type, unsigned char* &data,
   return numRead;
 }
 
-void PWSfileV4::SaveState()
+bool PWSfileV4::PeekFieldType(unsigned char &type)
 {
-  m_savepos = ftell(m_fd);
-  memcpy(m_saveIV, m_IV, m_fish->GetBlockSize());
-  m_savehmac = m_hmac;
-}
+  unsigned char block[TwoFish::BLOCKSIZE];
+  unsigned char iv[TwoFish::BLOCKSIZE];
 
-void PWSfileV4::RestoreState()
-{
-  int seekstat = fseek(m_fd, m_savepos, SEEK_SET);
-  if (seekstat != 0)
-    ASSERT(0);
-  memcpy(m_IV, m_saveIV, m_fish->GetBlockSize());
-  m_hmac = m_savehmac;
+  const size_t n = FRead(block, 1, sizeof(block));
+  if (n > 0 && FSeek(-long(n), SEEK_CUR) != 0)
+    return false;
+  if (n != sizeof(block))
+    return false;
+  memcpy(iv, m_IV, sizeof(iv));
+  m_fish->DecryptCBC(block, 1, iv);
+  type = block[sizeof(int32)]; // after the length, see _readcbc
+  trashMemory(block, sizeof(block));
+  return true;
 }
 
 int PWSfileV4::ReadRecord(CItemData &item)
 {
   int status;
+  unsigned char type;
   ASSERT(m_fd != NULL);
   ASSERT(m_curversion == V40);
-  SaveState();
-  unsigned fpos = unsigned(ftell(m_fd));
+  unsigned fpos = unsigned(FTell());
   if (fpos < m_effectiveFileLength) {
+    if (PeekFieldType(type) && CItem::IsItemAttField(type))
+      return WRONG_RECORD; // caller should read it as a CItemAtt
     status = item.Read(this);
-    if (status < 0) { // detected an inappropriate field
-      RestoreState();
-      status = WRONG_RECORD;
-    }
+    if (status < 0) // attachment field in mid-record
+      status = READ_FAIL;
   } else if (fpos == m_effectiveFileLength)
     status = END_OF_FILE;
   else // fpos >= effectiveFileLength !?
     status = READ_FAIL;
+  if (status == SUCCESS)
+    m_nRecords++;
+  return status;
+}
+
+int PWSfileV4::ReadRawRecord(CItemData::RawRecord &raw)
+{
+  int status;
+  unsigned char type;
+  ASSERT(m_fd != NULL);
+  ASSERT(m_curversion == V40);
+  unsigned fpos = unsigned(FTell());
+  if (fpos < m_effectiveFileLength) {
+    if (PeekFieldType(type) && CItem::IsItemAttField(type))
+      return WRONG_RECORD; // caller should read it as a CItemAtt
+    status = CItemData::ReadRaw(this, raw);
+    if (status < 0) // attachment field in mid-record
+      status = READ_FAIL;
+  } else if (fpos == m_effectiveFileLength)
+    status = END_OF_FILE;
+  else // fpos >= effectiveFileLength !?
+    status = READ_FAIL;
+  if (status == SUCCESS)
+    m_nRecords++;
   return status;
 }
 
@@ -409,9 +523,8 @@ void PWSfileV4::StretchKey(const unsigned char *salt, unsigned long saltLen,
   size_t passLen = 0;
   unsigned char *pstr = NULL;
 
-  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
   ConvertString(passkey, pstr, passLen);
-  pbkdf2(pstr, (unsigned long)passLen, salt, saltLen, N, &hmac, Ptag, &PtagLen);
+  pbkdf2_sha256(pstr, (unsigned long)passLen, salt, saltLen, N, Ptag, &PtagLen);
 
 #ifdef UNICODE
   trashMemory(pstr, passLen);
@@ -419,6 +532,18 @@ void PWSfileV4::StretchKey(const unsigned char *salt, unsigned long saltLen,
 #endif
 }
 
+void PWSfileV4::TimedStretch(uint32 N)
+{
+  unsigned char salt[CKeyBlocks::PWSaltLength] = {0};
+  unsigned char Ptag[SHA256::HASHLEN];
+  StretchKey(salt, sizeof(salt), _T("calibrate"), N, Ptag, sizeof(Ptag));
+}
+
+uint32 PWSfileV4::CalibrateHashIters(uint32 targetMillis)
+{
+  return PWSfile::CalibrateHashIters(TimedStretch, targetMillis);
+}
+
 const short VersionNum = 0x0400;
 
 struct PWSfileV4::CKeyBlocks::KeyBlockFinder {
@@ -445,6 +570,59 @@ private:
   const StringX &passkey;
 };
 
+int PWSfileV4::CKeyBlocks::FindKeyBlock(const StringX &passkey,
+                                        unsigned char Ptag[SHA256::HASHLEN]) const
+{
+  // Keyblocks are stretched MAXLANES at a time, in lockstep, so a shared
+  // database costs about one stretch per MAXLANES keyblocks, rather than one each.
+  const unsigned LANES = SHA256::MAXLANES;
+  size_t passLen = 0;
+  unsigned char *pstr = NULL;
+  int found = -1;
+
+  ConvertString(passkey, pstr, passLen);
+
+  for (unsigned base = 0; base < size() && found < 0; base += LANES) {
+    const unsigned n = std::min(LANES, size() - base);
+    const unsigned char *salts[LANES];
+    unsigned long saltLens[LANES];
+    uint32 iters[LANES];
+    unsigned char Ptags[LANES][SHA256::HASHLEN];
+    unsigned char *outs[LANES];
+
+    for (unsigned l = 0; l < n; l++) {
+      const KeyBlock &kb = m_kbs[base + l];
+      ASSERT(kb.m_nHashIters >= MIN_HASH_ITERATIONS);
+      salts[l] = kb.m_salt;
+      saltLens[l] = sizeof(kb.m_salt);
+      iters[l] = kb.m_nHashIters;
+      outs[l] = Ptags[l];
+    }
+    pbkdf2_sha256_lanes(pstr, (unsigned long)passLen, n, salts, saltLens,
+                        iters, outs, SHA256::HASHLEN);
+
+    // Try to unwrap K, in keyblock order
+    for (unsigned l = 0; l < n; l++) {
+      unsigned char K[KLEN];
+      TwoFish Fish(Ptags[l], SHA256::HASHLEN); // XXX generalize to support AES as well
+      KeyWrap kwK(&Fish);
+      if (kwK.Unwrap(m_kbs[base + l].m_kw_k, K, KWLEN)) {
+        memcpy(Ptag, Ptags[l], SHA256::HASHLEN);
+        trashMemory(K, sizeof(K));
+        found = int(base + l);
+        break;
+      }
+    }
+    trashMemory(Ptags, sizeof(Ptags));
+  }
+
+#ifdef UNICODE
+  trashMemory(pstr, passLen);
+  delete[] pstr;
+#endif
+  return found;
+}
+
 bool PWSfileV4::CKeyBlocks::GetKeys(const StringX &passkey, uint32 nHashIters,
                                      unsigned char K[KLEN], unsigned char L[KLEN])
 {
@@ -455,21 +633,19 @@ bool PWSfileV4::CKeyBlocks::GetKeys(const StringX &passkey, uint32 nHashIters,
   if (m_kbs.empty())
     AddKeyBlock(passkey, passkey, nHashIters);
 
-  KeyBlockFinder find_kb(passkey);
-  auto kb_iter = find_if(m_kbs.begin(), m_kbs.end(), find_kb);
-  if (kb_iter == m_kbs.end())
+  unsigned char Ptag[SHA256::HASHLEN];
+  const int index = FindKeyBlock(passkey, Ptag);
+  if (index < 0)
     return false;
 
-  unsigned char Ptag[SHA256::HASHLEN];
-  PWSfileV4::StretchKey(kb_iter->m_salt, sizeof(kb_iter->m_salt),
-                        passkey, kb_iter->m_nHashIters,
-                        Ptag, sizeof(Ptag));
+  const KeyBlock &kb = m_kbs[index];
   TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
+  trashMemory(Ptag, sizeof(Ptag));
   KeyWrap kwK(&Fish);
-  if (!kwK.Unwrap(kb_iter->m_kw_k, K, sizeof(kb_iter->m_kw_k)))
+  if (!kwK.Unwrap(kb.m_kw_k, K, sizeof(kb.m_kw_k)))
     ASSERT(0);
   KeyWrap kwL(&Fish);
-  if (!kwL.Unwrap(kb_iter->m_kw_l, L, sizeof(kb_iter->m_kw_l)))
+  if (!kwL.Unwrap(kb.m_kw_l, L, sizeof(kb.m_kw_l)))
     ASSERT(0);
   return true;
 }
@@ -563,6 +739,7 @@ int PWSfileV4::WriteHeader()
   int status = SUCCESS;
   size_t numWritten = 0;
   m_hmac.Init(m_ell, sizeof(m_ell)); // re-init for header & data integrity
+  SetJournalKeys(m_key, m_ell, sizeof(m_key));
   {
     // See discussion in HashRandom256 to understand why we hash
     // random data instead of writing it directly
@@ -621,6 +798,17 @@ int PWSfileV4::WriteHeader()
     numWritten = WriteCBC(HDR_LASTUPDATETIME, pwt, pwt.GetLength());
     if (numWritten <= 0) { status = FAILURE; goto end; }
     m_hdr.m_whenlastsaved = pwt;
+
+    // and how many records it has then (see SetRecordCount)
+    if (m_nRecordsToWrite >= 0) {
+      unsigned char nbuf[sizeof(int32) + PWStime::TIME_LEN];
+      putInt32(nbuf, m_nRecordsToWrite);
+      memcpy(nbuf + sizeof(int32), static_cast<const unsigned char *>(pwt),
+             PWStime::TIME_LEN);
+      numWritten = WriteCBC(HDR_NRECORDS, nbuf, sizeof(nbuf));
+      if (numWritten <= 0) { status = FAILURE; goto end; }
+    }
+    m_hdr.m_nRecords = m_nRecordsToWrite;
   }
 
   // Write out who saved it!
@@ -805,17 +993,14 @@ int PWSfileV4::ReadKeyBlock()
   return SUCCESS;
 }
 
-int PWSfileV4::TryKeyBlock(unsigned index, const StringX &passkey,
+int PWSfileV4::TryKeyBlock(unsigned index, const unsigned char Ptag[SHA256::HASHLEN],
                            unsigned char K[KLEN], unsigned char L[KLEN],
                            uint32 &nHashIters)
 {
   CKeyBlocks::KeyBlock &kb = m_keyblocks.at(index);
-  unsigned char Ptag[SHA256::HASHLEN];
 
-  StretchKey(kb.m_salt, sizeof(kb.m_salt), passkey, kb.m_nHashIters,
-             Ptag, sizeof(Ptag));
   // Try to unwrap K
-  TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
+  TwoFish Fish(Ptag, SHA256::HASHLEN); // XXX generalize to support AES as well
   KeyWrap kwK(&Fish);
 
   if (!kwK.Unwrap(kb.m_kw_k, K, sizeof(kb.m_kw_k)))
@@ -891,17 +1076,63 @@ int PWSfileV4::ParseKeyBlocks(const StringX &passkey)
     }
   } while (!EndKeyBlocks(calc_hnonce));
 
-  for (unsigned i = 0; i < m_keyblocks.size(); i++) {
-    status = TryKeyBlock(i, passkey, m_key, m_ell, m_nHashIters);
-    if (status == SUCCESS) {
-      if (!VerifyKeyBlocks())
-        status = BAD_DIGEST;
-      break;
+  // A stretched key we've been given saves finding one the hard way
+  unsigned char Ptag[SHA256::HASHLEN];
+  int index = -1;
+  for (unsigned i = 0; i < m_keyblocks.size() && index < 0; i++) {
+    const CKeyBlocks::KeyBlock &kb = m_keyblocks[i];
+    if (m_stretchedKey.Matches(V40, kb.m_salt, kb.m_nHashIters, passkey)) {
+      memcpy(Ptag, m_stretchedKey.Ptag, sizeof(Ptag));
+      index = int(i);
     }
   }
+  if (index < 0)
+    index = m_keyblocks.FindKeyBlock(passkey, Ptag);
+  if (index < 0)
+    return WRONG_PASSWORD;
+
+  status = TryKeyBlock(unsigned(index), Ptag, m_key, m_ell, m_nHashIters);
+  if (status == SUCCESS)
+    m_stretchedKey.Set(V40, m_keyblocks[index].m_salt, m_nHashIters,
+                        passkey, Ptag);
+  trashMemory(Ptag, sizeof(Ptag));
+  if (status == SUCCESS && !VerifyKeyBlocks())
+    status = BAD_DIGEST;
   return status;
 }
 
+void PWSfileV4::MakeKeyBlock(const StringX &passkey)
+{
+  // Same as GetKeys() with no keyblocks, but stretches passkey once,
+  // or not at all if we've been given a stretched key to reuse.
+  CKeyBlocks::KeyBlock kb;
+  unsigned char Ptag[SHA256::HASHLEN];
+
+  kb.m_nHashIters = std::max(m_nHashIters, uint32(MIN_HASH_ITERATIONS));
+  if (m_stretchedKey.nHashIters == kb.m_nHashIters &&
+      m_stretchedKey.IsFor(V40, passkey)) {
+    memcpy(kb.m_salt, m_stretchedKey.salt, sizeof(kb.m_salt));
+    memcpy(Ptag, m_stretchedKey.Ptag, sizeof(Ptag));
+  } else {
+    HashRandom256(kb.m_salt);
+    StretchKey(kb.m_salt, sizeof(kb.m_salt), passkey, kb.m_nHashIters,
+               Ptag, sizeof(Ptag));
+    m_stretchedKey.Set(V40, kb.m_salt, kb.m_nHashIters, passkey, Ptag);
+  }
+
+  PWSrand::GetInstance()->GetRandomData(m_key, KLEN);
+  PWSrand::GetInstance()->GetRandomData(m_ell, KLEN);
+
+  TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
+  KeyWrap kwK(&Fish);
+  kwK.Wrap(m_key, kb.m_kw_k, KLEN);
+  KeyWrap kwL(&Fish);
+  kwL.Wrap(m_ell, kb.m_kw_l, KLEN);
+
+  trashMemory(Ptag, sizeof(Ptag));
+  m_keyblocks.m_kbs.push_back(kb);
+}
+
 bool PWSfileV4::CKeyBlocks::AddKeyBlock(const StringX &current_passkey,
                                         const StringX &new_passkey,
                                         uint nHashIters)
@@ -920,13 +1151,10 @@ bool PWSfileV4::CKeyBlocks::AddKeyBlock(const StringX &current_passkey,
     StretchKey(kb.m_salt, sizeof(kb.m_salt), current_passkey, kb.m_nHashIters,
                Ptag, sizeof(Ptag));
   } else { // we need to get K & L from current
-    KeyBlockFinder find_kb(current_passkey);
-    auto kb_iter = find_if(m_kbs.begin(), m_kbs.end(), find_kb);
-    if (kb_iter == m_kbs.end())
+    const int index = FindKeyBlock(current_passkey, Ptag);
+    if (index < 0)
       return false;
-    PWSfileV4::StretchKey(kb_iter->m_salt, sizeof(kb_iter->m_salt),
-                          current_passkey, kb_iter->m_nHashIters,
-                          Ptag, sizeof(Ptag));
+    auto kb_iter = m_kbs.begin() + index;
     TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
     KeyWrap kwK(&Fish);
     kwK.Unwrap(kb_iter->m_kw_k, K, sizeof(kb_iter->m_kw_k));
@@ -970,12 +1198,16 @@ bool PWSfileV4::CKeyBlocks::RemoveKeyBlock(const StringX &passkey)
 int PWSfileV4::ReadHeader()
 {
   m_hmac.Init(m_ell, sizeof(m_ell));
+  SetJournalKeys(m_key, m_ell, sizeof(m_key));
   size_t nIPread = fread(m_ipthing, sizeof(m_ipthing), 1, m_fd);
   if (nIPread != 1) {
     Close();
     return TRUNCATED_FILE;
   }
 
+  // Header fields, records and attachments are read from here on
+  MapForRead();
+
   m_fish = new TwoFish(m_key, sizeof(m_key));
 
   unsigned char fieldType;
@@ -983,6 +1215,8 @@ int PWSfileV4::ReadHeader()
   bool utf8status;
   unsigned char *utf8 = NULL;
   size_t utf8Len = 0;
+  int nRecords = -1;
+  time_t nRecordsWhen = 0; // HDR_NRECORDS only counts if saved with the file
 
   do {
     size_t numRead = ReadCBC(fieldType, utf8, utf8Len);
@@ -995,14 +1229,14 @@ int PWSfileV4::ReadHeader()
       // This hack keeps bwd compatibility.
       if (utf8Len != sizeof(VersionNum) &&
           utf8Len != sizeof(int32)) {
-        delete[] utf8;
+        SecureHeap::Free(utf8);
         Close();
         return FAILURE;
       }
       if (utf8[1] !=
           static_cast<unsigned char>((VersionNum & 0xff00) >> 8)) {
         //major version mismatch
-        delete[] utf8;
+        SecureHeap::Free(utf8);
         Close();
         return UNSUPPORTED_VERSION;
       }
@@ -1014,7 +1248,7 @@ int PWSfileV4::ReadHeader()
 
     case HDR_UUID: /* UUID */
       if (utf8Len != sizeof(uuid_array_t)) {
-        delete[] utf8;
+        SecureHeap::Free(utf8);
         Close();
         return FAILURE;
       }
@@ -1163,7 +1397,7 @@ int PWSfileV4::ReadHeader()
 
     case HDR_YUBI_SK:
       if (utf8Len != PWSfileHeader::YUBI_SK_LEN) {
-        delete[] utf8;
+        SecureHeap::Free(utf8);
         Close();
         return FAILURE;
       }
@@ -1235,6 +1469,13 @@ int PWSfileV4::ReadHeader()
         break;
       }
 
+    case HDR_NRECORDS: /* Number of records, and when last saved */
+      if (utf8Len == sizeof(int32) + PWStime::TIME_LEN) {
+        nRecordsWhen = PWStime(utf8 + sizeof(int32));
+        nRecords = getInt32(utf8);
+      }
+      break;
+
     case HDR_END: /* process END so not to treat it as 'unknown' */
       break;
 
@@ -1254,18 +1495,24 @@ int PWSfileV4::ReadHeader()
 #endif
       break;
     }
-    delete[] utf8; utf8 = NULL; utf8Len = 0;
+    SecureHeap::Free(utf8); utf8 = NULL; utf8Len = 0;
   } while (fieldType != HDR_END);
 
+  // An application that doesn't know HDR_NRECORDS keeps it as an
+  // unknown field, but updates the time it was saved
+  if (nRecordsWhen != 0 && nRecordsWhen == m_hdr.m_whenlastsaved)
+    m_hdr.m_nRecords = nRecords;
+
   // Now sort it for when we compare.
   std::sort(m_vEmptyGroups.begin(), m_vEmptyGroups.end());
 
   return SUCCESS;
 }
 
-bool PWSfileV4::IsV4x(const StringX &filename, const StringX &passkey, VERSION &v)
+bool PWSfileV4::IsV4x(const StringX &filename, const StringX &passkey, VERSION &v,
+                      StretchedKey *sk)
 {
-  if (CheckPasskey(filename, passkey) == SUCCESS) {
+  if (CheckPasskey(filename, passkey, NULL, NULL, NULL, sk) == SUCCESS) {
     v = V40;
     return true;
   } else
@@ -29,8 +29,14 @@ public:
   static int CheckPasskey(const StringX &filename,
                           const StringX &passkey,
                           FILE *a_fd = NULL,
-                          unsigned char *aPtag = NULL, uint32 *nIter = NULL);
-  static bool IsV4x(const StringX &filename, const StringX &passkey, VERSION &v);
+                          unsigned char *aPtag = NULL, uint32 *nIter = NULL,
+                          StretchedKey *sk = NULL);
+  static bool IsV4x(const StringX &filename, const StringX &passkey, VERSION &v,
+                    StretchedKey *sk = NULL);
+  // True if filename's keyblocks end where its nonce says they do,
+  // which doesn't take the passkey: a file that fails IsV4x() but
+  // passes this is V4 with some other passkey.
+  static bool IsV4Layout(const StringX &filename);
 
   PWSfileV4(const StringX &filename, RWmode mode, VERSION version);
   ~PWSfileV4();
@@ -40,20 +46,39 @@ public:
 
   virtual int WriteRecord(const CItemData &item);
   virtual int ReadRecord(CItemData &item);
+  virtual int ReadRawRecord(CItemData::RawRecord &raw);
+  virtual int GetRawRecord(const CItemData &item, CItemData::RawRecord &raw) const;
+  virtual int WriteRawRecord(const CItemData::RawRecord &raw);
 
   int WriteRecord(const CItemAtt &att);
   int ReadRecord(CItemAtt &att);
 
   // Following writes AttIV, AttEK, AttAK, AttContent
   // and AttContentHMAC per format spec.
-  // All except the content are generated internally.
-  size_t WriteContentFields(unsigned char *content, size_t len);
-  // Following allocates content, caller responsible for deallocating
-  size_t ReadContent(Fish *fish, unsigned char *cbcbuffer,
-                     unsigned char *&content, size_t clen);
+  // All except the content are generated internally, and are returned
+  // in keys, if it's not NULL, along with where the content went.
+  struct ContentKeys {
+    unsigned char IV[TwoFish::BLOCKSIZE];
+    unsigned char EK[KLEN];
+    unsigned char AK[KLEN];
+    unsigned char digest[SHA256::HASHLEN];
+    long offset;
+  };
+  size_t WriteContentFields(unsigned char *content, size_t len,
+                            ContentKeys *keys = NULL);
+  // Following skips over the clen bytes of content that follow the
+  // content field, returning where they start, or -1 if they don't fit.
+  // Lets attachments be read without their content (see CItemAtt::Read)
+  long SkipContent(size_t clen);
+  // ...which is read later from filename, into content, which must have
+  // room for clen rounded up to a whole number of blocks
+  static size_t ReadContent(const StringX &filename, long offset,
+                            Fish *fish, unsigned char *cbcbuffer,
+                            unsigned char *content, size_t clen);
 
   uint32 GetNHashIters() const {return m_nHashIters;}
   void SetNHashIters(uint32 N) {m_nHashIters = N;}
+  static uint32 CalibrateHashIters(uint32 targetMillis);
   
   // Following for low-level details that changed between format versions
   virtual size_t timeFieldLen() const {return 5;} // Experimental
@@ -90,6 +115,10 @@ public:
     
     bool GetKeys(const StringX &passkey, uint32 nHashIters,
                  unsigned char K[KLEN], unsigned char L[KLEN]); // not const
+    // Returns index of first keyblock that passkey unlocks, -1 if none.
+    // Sets Ptag to the stretched passkey for that keyblock.
+    int FindKeyBlock(const StringX &passkey,
+                     unsigned char Ptag[SHA256::HASHLEN]) const;
 
     KeyBlock &operator[](unsigned i) {return m_kbs[i];}
     const KeyBlock &operator[](unsigned i) const {return m_kbs[i];}
@@ -119,8 +148,9 @@ public:
   // Forward declaration of functors:
   struct KeyBlockWriter;
   int ParseKeyBlocks(const StringX &passkey);
+  void MakeKeyBlock(const StringX &passkey); // single-user write
   int ReadKeyBlock(); // can return SUCCESS or END_OF_FILE
-  int TryKeyBlock(unsigned index, const StringX &passkey,
+  int TryKeyBlock(unsigned index, const unsigned char Ptag[SHA256::HASHLEN],
                   unsigned char K[KLEN], unsigned char L[KLEN],
                   uint32 &nHashIters);
   void ComputeEndKB(const unsigned char hnonce[SHA256::HASHLEN],
@@ -139,18 +169,15 @@ public:
   int WriteHeader();
   int ReadHeader();
 
-  // Following to allow rollback when reverting an ItemAtt read
-  // as an ItemData
-  long m_savepos;
-  unsigned char m_saveIV[TwoFish::BLOCKSIZE];
-  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> m_savehmac;
-
-  void SaveState();
-  void RestoreState();
+  // Decrypts the next field's first block to get its type, without
+  // consuming it: position, IV and HMAC are left as they were. Lets
+  // ReadRecord() turn down an attachment without reading it.
+  bool PeekFieldType(unsigned char &type);
 
   static int SanityCheck(FILE *stream); // Check for TAG and EOF marker
   static void StretchKey(const unsigned char *salt, unsigned long saltLen,
                          const StringX &passkey, uint32 N,
                          unsigned char *Ptag, unsigned long PtagLen);
+  static void TimedStretch(uint32 N); // for CalibrateHashIters
 };
 #endif /* __PWSFILEV4_H */
@@ -6,30 +6,130 @@
  * http://www.opensource.org/licenses/artistic-license-2.0.php
  */
 #include <limits.h>
+#include <string.h>
+#include <algorithm>
 #include "os/rand.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #include "PwsPlatform.h"
 #include "PWSrand.h"
 
-PWSrand *PWSrand::self = NULL;
+std::mutex PWSrand::s_masterMutex;
+std::atomic<unsigned int> PWSrand::s_generation(0);
 
-PWSrand *PWSrand::GetInstance()
+struct PWSrand::ThreadSlot {
+    ThreadSlot() : p(NULL) {}
+    ~ThreadSlot() {delete p;} // at thread exit
+    PWSrand *p;
+};
+
+// ChaCha20 block function, per RFC 7539
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+a += b; d ^= a; d = ROTL32(d, 16); \
+c += d; b ^= c; b = ROTL32(b, 12); \
+a += b; d ^= a; d = ROTL32(d, 8); \
+c += d; b ^= c; b = ROTL32(b, 7);
+
+static inline uint32 load32_le(const unsigned char *p)
+{
+    return uint32(p[0]) | (uint32(p[1]) << 8) |
+    (uint32(p[2]) << 16) | (uint32(p[3]) << 24);
+}
+
+static inline void store32_le(unsigned char *p, uint32 v)
 {
-    if (self == NULL) {
-        self = new PWSrand;
+    p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24);
+}
+
+void PWSrand::ChaCha20Block(const uint32 in[16], unsigned char out[64])
+{
+    uint32 x[16];
+    int i;
+    
+    for (i = 0; i < 16; i++)
+        x[i] = in[i];
+    for (i = 0; i < 10; i++) { // 20 rounds, 2 at a time
+        QUARTERROUND(x[0], x[4], x[8],  x[12])
+        QUARTERROUND(x[1], x[5], x[9],  x[13])
+        QUARTERROUND(x[2], x[6], x[10], x[14])
+        QUARTERROUND(x[3], x[7], x[11], x[15])
+        QUARTERROUND(x[0], x[5], x[10], x[15])
+        QUARTERROUND(x[1], x[6], x[11], x[12])
+        QUARTERROUND(x[2], x[7], x[8],  x[13])
+        QUARTERROUND(x[3], x[4], x[9],  x[14])
     }
-    return self;
+    for (i = 0; i < 16; i++)
+        store32_le(out + 4 * i, x[i] + in[i]);
+    memset(x, 0, sizeof(x));
+}
+
+PWSrand::ThreadSlot &PWSrand::Slot()
+{
+    static thread_local ThreadSlot slot;
+    return slot;
+}
+
+PWSrand *PWSrand::GetInstance()
+{
+    ThreadSlot &slot = Slot();
+    if (slot.p == NULL)
+        slot.p = new PWSrand(false);
+    return slot.p;
 }
 
 void PWSrand::DeleteInstance()
 {
-    delete self;
-    self = NULL;
+    ThreadSlot &slot = Slot();
+    delete slot.p;
+    slot.p = NULL;
 }
 
-PWSrand::PWSrand()
-: ibRandomData(SHA256::HASHLEN)
+PWSrand *PWSrand::Master()
 {
+    // Never deleted, as threads may need it until they exit
+    static PWSrand *master = NULL;
+    if (master == NULL) {
+        master = new PWSrand(true);
+#ifndef _WIN32
+        pthread_atfork(AtForkPrepare, AtForkParent, AtForkChild);
+#endif
+    }
+    return master;
+}
+
+// A forked child mustn't repeat its parent's output, nor be left
+// with the master locked by a thread that no longer exists.
+void PWSrand::AtForkPrepare()
+{
+    s_masterMutex.lock();
+}
+
+void PWSrand::AtForkParent()
+{
+    s_masterMutex.unlock();
+}
+
+void PWSrand::AtForkChild()
+{
+    s_generation++;
+    s_masterMutex.unlock();
+}
+
+PWSrand::PWSrand(bool isMaster)
+: m_isMaster(isMaster), m_IsInternalPRNG(true),
+m_generation(s_generation), m_bufPos(BUFLEN), m_nSinceReseed(0)
+{
+    memset(K, 0, sizeof(K));
+    if (!m_isMaster) {
+        Reseed(); // from the master
+        return;
+    }
+    
     m_IsInternalPRNG = !pws_os::InitRandomDataFunction();
     
     SHA256 s;
@@ -42,87 +142,124 @@ PWSrand::PWSrand()
     s.Update(p, slen);
     delete[] p;
     s.Final(K);
+    
+    if (!m_IsInternalPRNG)
+        Reseed(); // mix in the OS's rng as well
 }
 
 PWSrand::~PWSrand()
 {
+    memset(K, 0, sizeof(K));
+    memset(m_buf, 0, sizeof(m_buf));
 }
 
 void PWSrand::AddEntropy(unsigned char *bytes, unsigned int numBytes)
 {
     ASSERT(bytes != NULL);
+    std::lock_guard<std::mutex> lock(s_masterMutex);
+    PWSrand *master = Master();
     
     SHA256 s;
     
-    s.Update(K, sizeof(K));
+    s.Update(master->K, sizeof(master->K));
     s.Update(bytes, numBytes);
-    s.Final(K);
+    s.Final(master->K);
+    
+    // Don't hand out anything generated before this, here or
+    // in any thread's generator
+    memset(master->m_buf, 0, sizeof(master->m_buf));
+    master->m_bufPos = BUFLEN;
+    master->m_generation = ++s_generation;
 }
 
-void PWSrand::NextRandBlock()
+void PWSrand::Reseed()
 {
+    // Fold fresh entropy into K, so that a leaked state doesn't
+    // predict our output for ever
+    const unsigned int generation = s_generation;
     SHA256 s;
     s.Update(K, sizeof(K));
-    s.Final(R);
-    unsigned int *Kp = reinterpret_cast<unsigned int *>(K);
-    unsigned int *Rp = reinterpret_cast<unsigned int *>(R);
-    const int N = SHA256::HASHLEN / sizeof(uint32);
-    
-    Kp[0]++;
+    if (!m_isMaster) {
+        unsigned char fresh[SHA256::HASHLEN];
+        {
+            std::lock_guard<std::mutex> lock(s_masterMutex);
+            Master()->GetRandomData(fresh, sizeof(fresh));
+        }
+        s.Update(fresh, sizeof(fresh));
+        memset(fresh, 0, sizeof(fresh));
+    } else if (!m_IsInternalPRNG) {
+        unsigned char fresh[SHA256::HASHLEN];
+        if (pws_os::GetRandomData(fresh, sizeof(fresh)))
+            s.Update(fresh, sizeof(fresh));
+        memset(fresh, 0, sizeof(fresh));
+    } else {
+        unsigned slen = 0;
+        pws_os::GetRandomSeed(NULL, slen);
+        unsigned char *p = new unsigned char[slen];
+        pws_os::GetRandomSeed(p, slen);
+        s.Update(p, slen);
+        memset(p, 0, slen);
+        delete[] p;
+    }
+    s.Final(K);
     
-    for (int32 i = 0; i < N; i++)
-        Kp[i] += Rp[i];
+    memset(m_buf, 0, sizeof(m_buf));
+    m_bufPos = BUFLEN;
+    m_nSinceReseed = 0;
+    m_generation = generation;
 }
 
-void PWSrand::GetRandomData( void * const buffer, unsigned long length )
+void PWSrand::Refill()
 {
-    if (!m_IsInternalPRNG) {
-        bool status;
-        status = pws_os::GetRandomData(buffer, length);
-        ASSERT(status);
-        UNREFERENCED_PARAMETER(status); // used only in assert
+    if (m_nSinceReseed >= RESEED_INTERVAL)
+        Reseed();
+    
+    // "expand 32-byte k", K, block counter, nonce. As K's used once
+    // only, a zero nonce is fine.
+    uint32 state[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (int i = 0; i < 8; i++)
+        state[4 + i] = load32_le(K + 4 * i);
+    for (unsigned int b = 0; b < BUFLEN / 64; b++) {
+        state[12] = b;
+        ChaCha20Block(state, m_buf + 64 * b);
     }
+    memset(state, 0, sizeof(state));
     
-    // If we have an external random source, we'll
-    // xor it in with ours. This helps protect against
-    // poor or subverted external PRNGs.
-    // Otherwise, we'll rely on our lonesome.
+    // Fast key erasure: the batch's first bytes are the next key
+    memcpy(K, m_buf, sizeof(K));
+    memset(m_buf, 0, sizeof(K));
+    m_bufPos = sizeof(K);
+    m_nSinceReseed += BUFLEN;
+}
+
+void PWSrand::GetRandomData( void * const buffer, unsigned long length )
+{
+    // No lock: only the calling thread uses its generator, and the
+    // master's only used with s_masterMutex held.
+    if (m_generation != s_generation.load(std::memory_order_relaxed))
+        Reseed(); // we've forked, or there's been AddEntropy()
     
+    // Bytes are wiped from m_buf as they're handed out, so that they
+    // can't be recovered from our state later.
     unsigned char *pb = static_cast<unsigned char *>(buffer);
-    while (length > SHA256::HASHLEN) {
-        NextRandBlock();
-        for (int j = 0; j < SHA256::HASHLEN; j++)
-            pb[j] = (m_IsInternalPRNG) ? R[j] : pb[j] ^ R[j];
-        length -= SHA256::HASHLEN;
-        pb += SHA256::HASHLEN;
-    }
-    
-    ASSERT(length <= SHA256::HASHLEN);
-    if (length > 0) {
-        unsigned long i = 0;
-        NextRandBlock();
-        while (i < length) {
-            pb[i] = (m_IsInternalPRNG) ? R[i] : pb[i] ^ R[i];
-            i++;
-        }
+    while (length > 0) {
+        if (m_bufPos == BUFLEN)
+            Refill();
+        const unsigned long n = std::min(length,
+                                         static_cast<unsigned long>(BUFLEN - m_bufPos));
+        memcpy(pb, m_buf + m_bufPos, n);
+        memset(m_buf + m_bufPos, 0, n);
+        m_bufPos += static_cast<unsigned int>(n);
+        pb += n;
+        length -= n;
     }
 }
 
-// generate random numbers from a buffer filled in by GetRandomData()
+// generate random numbers straight from the buffer GetRandomData() uses
 unsigned int PWSrand::RandUInt()
 {
-    // we don't want to keep filling the random buffer for each number we
-    // want, so fill the buffer with random data and use it up
-    
-    if (ibRandomData > (SHA256::HASHLEN - sizeof(uint32))) {
-        // no data left, refill the buffer
-        GetRandomData(rgbRandomData, SHA256::HASHLEN);
-        ibRandomData = 0;
-    }
-    
-    const unsigned int u =
-    *(reinterpret_cast<uint32 *>(rgbRandomData + ibRandomData));
-    ibRandomData += sizeof(uint32);
+    uint32 u;
+    GetRandomData(&u, sizeof(u));
     return u;
 }
 
@@ -13,12 +13,20 @@
 
 #include "sha256.h"
 
+#include <mutex>
+#include <atomic>
+
+// Each thread gets its own generator, keyed from a process-wide master
+// one, so that the hot path takes no locks. The master's only locked
+// when a thread's generator is created or rekeyed.
 class PWSrand
 {
 public:
+    // Returns the calling thread's generator
     static PWSrand *GetInstance();
-    static void DeleteInstance();
+    static void DeleteInstance(); // ...and this deletes it
     
+    // Mixed into the master; every thread's generator rekeys from it
     void AddEntropy(unsigned char *bytes, unsigned int numBytes);
     //  fill this buffer with random data
     void GetRandomData( void * const buffer, unsigned long length );
@@ -27,17 +35,42 @@ public:
     //  generate a random integer in [0, len)
     unsigned int RangeRand(size_t len);
     
+    // The ChaCha20 block function (RFC 7539 2.3) output's made with:
+    // 16 words of state in, 64 bytes of keystream out
+    static void ChaCha20Block(const uint32 in[16], unsigned char out[64]);
+    
 private:
-    PWSrand(); // start with some minimal entropy
+    PWSrand(bool isMaster); // start with some minimal entropy
     ~PWSrand();
     
-    void NextRandBlock();
-    static PWSrand *self;
+    // Output's ChaCha20 keystream under K, generated BUFLEN bytes at a
+    // time. The first bytes of each batch replace K, so that the state
+    // can't be used to recover earlier output, and fresh entropy's
+    // folded into K every RESEED_INTERVAL bytes: from the OS for the
+    // master, from the master for the others.
+    enum {BUFLEN = 4096, RESEED_INTERVAL = 1 << 20};
+    void Refill();
+    void Reseed();
+    
+    static PWSrand *Master(); // call with s_masterMutex held
+    struct ThreadSlot; // owns a thread's generator
+    static ThreadSlot &Slot(); // the calling thread's
+    static void AtForkPrepare();
+    static void AtForkParent();
+    static void AtForkChild();
+    
+    static std::mutex s_masterMutex;
+    // Bumped by fork() and AddEntropy(): generators that have seen an
+    // older value discard their buffers and reseed.
+    static std::atomic<unsigned int> s_generation;
+    
+    const bool m_isMaster;
     bool m_IsInternalPRNG;
+    unsigned int m_generation;
     unsigned char K[SHA256::HASHLEN];
-    unsigned char R[SHA256::HASHLEN];
     
-    char rgbRandomData[SHA256::HASHLEN];
-    unsigned int ibRandomData;
+    unsigned char m_buf[BUFLEN];
+    unsigned int m_bufPos; // next unused byte in m_buf
+    unsigned long m_nSinceReseed;
 };
 #endif /*  __PWSRAND_H */
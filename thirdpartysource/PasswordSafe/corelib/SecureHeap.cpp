@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+/// \file SecureHeap.cpp
+//-----------------------------------------------------------------------------
+
+#include "SecureHeap.h"
+#include "Util.h" // for trashMemory
+
+#include "os/mem.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace {
+    const size_t SLABSIZE = 16 * 1024; // a page on iOS, 4 elsewhere
+    const size_t REGIONSIZE = 16 * SLABSIZE;
+    const unsigned NSLABS = REGIONSIZE / SLABSIZE;
+    const unsigned MAXREGIONS = 16; // i.e., lock no more than 4MB
+    const size_t MINCLASS = 16;
+    const unsigned NCLASSES = 9; // 16, 32, ... 4096 bytes
+    const size_t MAXCLASS = MINCLASS << (NCLASSES - 1);
+    const unsigned CACHEMAX = 32; // free blocks per class kept by each thread
+    const size_t HDRLEN = 16; // fallback blocks' size, keeps malloc's alignment
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    struct Region {
+        unsigned char *base;
+        unsigned nSlabs; // handed out so far
+        unsigned char slabClass[NSLABS];
+    };
+
+    // Each thread keeps a few free blocks of each class, so that most
+    // calls needn't take the heap's lock.
+    struct ThreadCache {
+        ThreadCache();
+        ~ThreadCache(); // at thread exit, gives its blocks back
+        FreeBlock *free[NCLASSES];
+        unsigned count[NCLASSES];
+        // StringXs with static duration are freed after the main
+        // thread's cache is gone, so we don't use it past that point.
+        bool gone;
+    };
+
+    class Heap
+    {
+    public:
+        Heap();
+        void *Alloc(size_t size);
+        void Free(void *p);
+        void Drain(ThreadCache &tc);
+
+    private:
+        std::mutex m_mutex; // guards all but m_regions[0..m_nRegions)
+        Region m_regions[MAXREGIONS];
+        std::atomic<unsigned> m_nRegions;
+        FreeBlock *m_free[NCLASSES];
+
+        bool AddSlab(unsigned c);
+        bool ClassOf(const unsigned char *p, unsigned &c) const;
+    };
+
+    Heap &TheHeap()
+    {
+        // Never deleted: static StringXs may be freed after we'd be destroyed
+        static Heap *heap = new Heap;
+        return *heap;
+    }
+
+    ThreadCache &Cache()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+}
+
+ThreadCache::ThreadCache() : gone(false)
+{
+    for (unsigned c = 0; c < NCLASSES; c++) {
+        free[c] = NULL;
+        count[c] = 0;
+    }
+}
+
+ThreadCache::~ThreadCache()
+{
+    TheHeap().Drain(*this);
+    gone = true;
+}
+
+Heap::Heap() : m_nRegions(0)
+{
+    for (unsigned c = 0; c < NCLASSES; c++)
+        m_free[c] = NULL;
+}
+
+bool Heap::AddSlab(unsigned c)
+{
+    // Caller holds m_mutex. Returns false if we're out of regions.
+    unsigned n = m_nRegions.load(std::memory_order_relaxed);
+    Region *r = (n > 0) ? &m_regions[n - 1] : NULL;
+
+    if (r == NULL || r->nSlabs == NSLABS) {
+        if (n == MAXREGIONS)
+            return false;
+        void *base = pws_os::AllocSecurePages(REGIONSIZE);
+        if (base == NULL)
+            return false;
+        r = &m_regions[n];
+        r->base = static_cast<unsigned char *>(base);
+        r->nSlabs = 0;
+        m_nRegions.store(n + 1, std::memory_order_release);
+    }
+
+    unsigned char *slab = r->base + r->nSlabs * SLABSIZE;
+    r->slabClass[r->nSlabs++] = static_cast<unsigned char>(c);
+
+    // Push back to front, so that blocks are handed out in address order
+    const size_t blockSize = MINCLASS << c;
+    for (size_t offset = SLABSIZE; offset >= blockSize; offset -= blockSize) {
+        FreeBlock *b = reinterpret_cast<FreeBlock *>(slab + offset - blockSize);
+        b->next = m_free[c];
+        m_free[c] = b;
+    }
+    return true;
+}
+
+bool Heap::ClassOf(const unsigned char *p, unsigned &c) const
+{
+    // A region's base, and the class of each slab handed out from it,
+    // are set before any of its blocks are, so no lock's needed here.
+    const unsigned n = m_nRegions.load(std::memory_order_acquire);
+    for (unsigned i = 0; i < n; i++) {
+        const Region &r = m_regions[i];
+        if (p >= r.base && p < r.base + REGIONSIZE) {
+            c = r.slabClass[(p - r.base) / SLABSIZE];
+            return true;
+        }
+    }
+    return false; // fallback block
+}
+
+void *Heap::Alloc(size_t size)
+{
+    if (size <= MAXCLASS) {
+        unsigned c = 0;
+        while ((MINCLASS << c) < size)
+            c++;
+
+        ThreadCache &tc = Cache();
+        FreeBlock *b = tc.gone ? NULL : tc.free[c];
+        if (b != NULL) {
+            tc.free[c] = b->next;
+            tc.count[c]--;
+        } else {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (m_free[c] != NULL || AddSlab(c)) {
+                b = m_free[c];
+                m_free[c] = b->next;
+                // Take a few more while we hold the lock
+                while (!tc.gone && tc.count[c] < CACHEMAX / 2 && m_free[c] != NULL) {
+                    FreeBlock *x = m_free[c];
+                    m_free[c] = x->next;
+                    x->next = tc.free[c];
+                    tc.free[c] = x;
+                    tc.count[c]++;
+                }
+            }
+        }
+        if (b != NULL) {
+            // Rest of the block was zeroed by Free(), or is fresh from mmap
+            std::memset(b, 0, sizeof(*b));
+            return b;
+        }
+    }
+
+    // Too big, or out of regions
+    unsigned char *p = static_cast<unsigned char *>(std::calloc(1, HDRLEN + size));
+    if (p == NULL)
+        throw std::bad_alloc();
+    *reinterpret_cast<size_t *>(p) = size;
+    return p + HDRLEN;
+}
+
+void Heap::Free(void *p)
+{
+    unsigned char *u = static_cast<unsigned char *>(p);
+    unsigned c;
+
+    if (!ClassOf(u, c)) {
+        u -= HDRLEN;
+        trashMemory(u, HDRLEN + *reinterpret_cast<size_t *>(u));
+        std::free(u);
+        return;
+    }
+
+    trashMemory(u, MINCLASS << c);
+    FreeBlock *b = reinterpret_cast<FreeBlock *>(u);
+    ThreadCache &tc = Cache();
+    if (!tc.gone && tc.count[c] < CACHEMAX) {
+        b->next = tc.free[c];
+        tc.free[c] = b;
+        tc.count[c]++;
+    } else {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        b->next = m_free[c];
+        m_free[c] = b;
+    }
+}
+
+void Heap::Drain(ThreadCache &tc)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (unsigned c = 0; c < NCLASSES; c++) {
+        while (tc.free[c] != NULL) {
+            FreeBlock *b = tc.free[c];
+            tc.free[c] = b->next;
+            b->next = m_free[c];
+            m_free[c] = b;
+        }
+        tc.count[c] = 0;
+    }
+}
+
+void *SecureHeap::Alloc(size_t size)
+{
+    return TheHeap().Alloc(size);
+}
+
+void SecureHeap::Free(void *p)
+{
+    if (p != NULL)
+        TheHeap().Free(p);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+#ifndef __SECUREHEAP_H
+#define __SECUREHEAP_H
+
+// SecureHeap.h
+// Allocator for plaintext: StringX storage, decryption scratch buffers
+// and the like.
+//
+// Blocks are carved out of a few large regions that are locked in RAM
+// and kept out of core dumps (see pws_os::AllocSecurePages), so
+// allocating one costs no syscalls. Requests are rounded up to a
+// power-of-two size class, each with its own freelist, and blocks are
+// trashed as they're freed.
+// Requests larger than the biggest class, or made once the regions are
+// all used up, fall back to the C heap. These still get trashed on
+// Free(), but aren't locked.
+//-----------------------------------------------------------------------------
+
+#include <cstddef>
+
+namespace SecureHeap
+{
+    // Returns zeroed memory, never NULL (throws std::bad_alloc instead)
+    void *Alloc(size_t size);
+    // Trashes and releases p, which must be NULL or from Alloc()
+    void Free(void *p);
+}
+#endif /* __SECUREHEAP_H */
@@ -27,6 +27,7 @@
 
 #include "../os/typedefs.h"
 #include "./PwsPlatform.h"
+#include "./SecureHeap.h"
 
 // Using extern definition here instead of including "Util.h" because Util.h
 // references the StringX class and by including "Util.h" here, the StringX
@@ -97,10 +98,8 @@ namespace S_Alloc
         // Allocate raw memory
         pointer allocate(size_type n, const_pointer hint = 0) {
             UNREFERENCED_PARAMETER(hint);
-            pointer p = static_cast<pointer>(std::malloc(n * sizeof(T)));
-            if (p == NULL)
-                throw std::bad_alloc();
-            return p;
+            // Locked in RAM, see SecureHeap.h. Throws on failure.
+            return static_cast<pointer>(SecureHeap::Alloc(n * sizeof(T)));
         }
         
 #ifdef _WIN32
@@ -114,14 +113,11 @@ namespace S_Alloc
             // The standard states that p must not be NULL. However, some
             // STL implementations fail this requirement, so the check must
             // be made here.
+            UNREFERENCED_PARAMETER(n);
             if (p == NULL)
                 return;
             
-            if (n > 0) {
-                const size_type N = n * sizeof(T);
-                trashMemory((void *)p, N);
-            }
-            std::free(p);
+            SecureHeap::Free(p); // trashes p's block
         }
 #ifdef _WIN32
 #pragma optimize("", on)
@@ -613,6 +613,84 @@ static void twofish_ecb_decrypt(const unsigned char *ct, unsigned char *pt, cons
 }
 #endif
 
+#ifndef TWOFISH_SMALL
+/*
+ Decrypts four blocks of text with Twofish, interleaved.
+ A single block is one long dependency chain of table lookups;
+ running four independent blocks side by side lets their lookups
+ overlap, which is where most of the time goes.
+ @param ct The input ciphertext (64 bytes)
+ @param pt The output plaintext (64 bytes), may not overlap ct
+ @param skey The key as scheduled
+ */
+/* one block's share of the work, for block n of the four */
+#define TF4_LOAD(n)                                                 \
+    LOAD32L(ta,&ct[16*n+0]); LOAD32L(tb,&ct[16*n+4]);               \
+    LOAD32L(tc,&ct[16*n+8]); LOAD32L(td,&ct[16*n+12]);              \
+    a##n = tc ^ skey->K[6]; b##n = td ^ skey->K[7];                 \
+    c##n = ta ^ skey->K[4]; d##n = tb ^ skey->K[5]
+#define TF4_G(n, x, y)                                              \
+    t2##n = g1_func(y##n, skey); t1##n = g_func(x##n, skey) + t2##n
+#define TF4_MIX(n, x, y, k0, k1)                                    \
+    x##n = ROLc(x##n, 1) ^ (t1##n + k0);                            \
+    y##n = RORc(y##n ^ (t2##n + t1##n + k1), 1)
+#define TF4_STORE(n)                                                \
+    STORE32L(a##n ^ skey->K[0], &pt[16*n+0]);                       \
+    STORE32L(b##n ^ skey->K[1], &pt[16*n+4]);                       \
+    STORE32L(c##n ^ skey->K[2], &pt[16*n+8]);                       \
+    STORE32L(d##n ^ skey->K[3], &pt[16*n+12])
+
+#ifdef LTC_CLEAN_STACK
+static void _twofish_ecb_decrypt4(const unsigned char *ct, unsigned char *pt, const twofish_key *skey)
+#else
+static void twofish_ecb_decrypt4(const unsigned char *ct, unsigned char *pt, const twofish_key *skey)
+#endif
+{
+    uint32 a0,b0,c0,d0,a1,b1,c1,d1,a2,b2,c2,d2,a3,b3,c3,d3;
+    uint32 t10,t20,t11,t21,t12,t22,t13,t23,ta,tb,tc,td;
+    uint32 const *k;
+    int r;
+#if !defined(__GNUC__)
+    const uint32 *S1, *S2, *S3, *S4;
+    
+    S1 = skey->S[0];
+    S2 = skey->S[1];
+    S3 = skey->S[2];
+    S4 = skey->S[3];
+#endif
+    
+    ASSERT(pt   != NULL);
+    ASSERT(ct   != NULL);
+    ASSERT(skey != NULL);
+    
+    /* load input, undo undo final swap */
+    TF4_LOAD(0); TF4_LOAD(1); TF4_LOAD(2); TF4_LOAD(3);
+    
+    k = skey->K + 36;
+    for (r = 8; r != 0; --r) {
+        TF4_G(0, c, d); TF4_G(1, c, d); TF4_G(2, c, d); TF4_G(3, c, d);
+        TF4_MIX(0, a, b, k[2], k[3]); TF4_MIX(1, a, b, k[2], k[3]);
+        TF4_MIX(2, a, b, k[2], k[3]); TF4_MIX(3, a, b, k[2], k[3]);
+        
+        TF4_G(0, a, b); TF4_G(1, a, b); TF4_G(2, a, b); TF4_G(3, a, b);
+        TF4_MIX(0, c, d, k[0], k[1]); TF4_MIX(1, c, d, k[0], k[1]);
+        TF4_MIX(2, c, d, k[0], k[1]); TF4_MIX(3, c, d, k[0], k[1]);
+        k -= 4;
+    }
+    
+    /* pre-white, store */
+    TF4_STORE(0); TF4_STORE(1); TF4_STORE(2); TF4_STORE(3);
+}
+
+#ifdef LTC_CLEAN_STACK
+static void twofish_ecb_decrypt4(const unsigned char *ct, unsigned char *pt, const twofish_key *skey)
+{
+    _twofish_ecb_decrypt4(ct, pt, skey);
+    burnStack(sizeof(uint32) * 28 + sizeof(uint32));
+}
+#endif
+#endif /* TWOFISH_SMALL */
+
 TwoFish::TwoFish(const unsigned char* key, int keylen)
 {
     int status = twofish_setup(key, keylen, 0, &key_schedule);
@@ -636,3 +714,15 @@ void TwoFish::Decrypt(const unsigned char *in, unsigned char *out) const
 {
     twofish_ecb_decrypt(in, out, &key_schedule);
 }
+
+void TwoFish::DecryptBlocks(const unsigned char *in, unsigned char *out,
+                            size_t nblocks) const
+{
+    size_t i = 0;
+#ifndef TWOFISH_SMALL
+    for (; i + 4 <= nblocks; i += 4)
+        twofish_ecb_decrypt4(in + i * BLOCKSIZE, out + i * BLOCKSIZE, &key_schedule);
+#endif
+    for (; i < nblocks; i++)
+        twofish_ecb_decrypt(in + i * BLOCKSIZE, out + i * BLOCKSIZE, &key_schedule);
+}
@@ -34,6 +34,8 @@ public:
     ~TwoFish();
     void Encrypt(const unsigned char *in, unsigned char *out) const;
     void Decrypt(const unsigned char *in, unsigned char *out) const;
+    void DecryptBlocks(const unsigned char *in, unsigned char *out,
+                       size_t nblocks) const;
     unsigned int GetBlockSize() const {return BLOCKSIZE;}
     
 private:
@@ -15,6 +15,7 @@
 #include "core.h"
 #include "StringXStream.h"
 #include "PWPolicy.h"
+#include "SecureHeap.h"
 
 #include "Util.h"
 
@@ -30,6 +31,7 @@
 #endif
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 
 #ifdef MAC
 #include <CoreFoundation/CoreFoundation.h>
@@ -169,52 +171,100 @@ void GenRandhash(const StringX &a_passkey,
     keyHash.Final(a_randhash);
 }
 
+namespace {
+    // _writecbc() encrypts into a staging buffer from the SecureHeap (it
+    // holds plaintext until then), and writes it with one fwrite per
+    // WRITECHUNK bytes, rather than one per block.
+    const size_t WRITECHUNK = 4096; // SecureHeap's largest class, so pooled
+    
+    // Writes first, if not NULL, followed by length bytes of buffer padded
+    // with random data to BlockLength bytes, CBC encrypted.
+    size_t writeblocks(FILE *fp, const unsigned char *first,
+                       const unsigned char *buffer, size_t length,
+                       size_t BlockLength, Fish *Algorithm,
+                       unsigned char *cbcbuffer)
+    {
+        const unsigned int BS = Algorithm->GetBlockSize();
+        const size_t hdrlen = (first != NULL) ? BS : 0;
+        const size_t total = hdrlen + BlockLength;
+        if (total == 0)
+            return 0;
+        
+        const size_t chunklen = std::min(total, WRITECHUNK);
+        unsigned char *chunk = static_cast<unsigned char *>(SecureHeap::Alloc(chunklen));
+        size_t numWritten = 0;
+        
+        while (numWritten < total) {
+            const size_t n = std::min(chunklen, total - numWritten);
+            size_t off = 0;
+            if (numWritten == 0 && first != NULL) {
+                memcpy(chunk, first, BS);
+                off = BS;
+            }
+            // Where we are in buffer, and how much of it goes in this chunk
+            const size_t pos = numWritten + off - hdrlen;
+            const size_t dlen = (pos < length) ? std::min(n - off, length - pos) : 0;
+            if (dlen > 0)
+                memcpy(chunk + off, buffer + pos, dlen);
+            if (off + dlen < n) // uneven last block, or bwd compat empty one
+                PWSrand::GetInstance()->GetRandomData(chunk + off + dlen,
+                                                      static_cast<unsigned long>(n - off - dlen));
+            
+            Algorithm->EncryptCBC(chunk, n / BS, cbcbuffer);
+            if (fwrite(chunk, 1, n, fp) != n) {
+                SecureHeap::Free(chunk);
+                throw(EIO);
+            }
+            numWritten += n;
+        }
+        SecureHeap::Free(chunk); // trashes it
+        return numWritten;
+    }
+}
+
 size_t _writecbc(FILE *fp, const unsigned char *buffer, size_t length, unsigned char type,
                  Fish *Algorithm, unsigned char *cbcbuffer)
 {
     const unsigned int BS = Algorithm->GetBlockSize();
-    size_t numWritten = 0;
     
     // some trickery to avoid new/delete
     unsigned char block1[16];
-    
-    unsigned char *curblock = NULL;
     ASSERT(BS <= sizeof(block1)); // if needed we can be more sophisticated here...
     
-    // First encrypt and write the length of the buffer
-    curblock = block1;
+    // First the length of the buffer.
     // Fill unused bytes of length with random data, to make
     // a dictionary attack harder
-    PWSrand::GetInstance()->GetRandomData(curblock, BS);
+    PWSrand::GetInstance()->GetRandomData(block1, BS);
     // block length overwrites 4 bytes of the above randomness.
-    putInt32(curblock, reinterpret_cast<int32 &>(length));
+    putInt32(block1, reinterpret_cast<int32 &>(length));
     
     // following new for format 2.0 - lengthblock bytes 4-7 were unused before.
-    curblock[sizeof(int32)] = type;
+    block1[sizeof(int32)] = type;
     
     if (BS == 16) {
         // In this case, we've too many (11) wasted bytes in the length block
         // So we store actual data there:
         // (11 = BlockSize - 4 (length) - 1 (type)
         const size_t len1 = (length > 11) ? 11 : length;
-        memcpy(curblock + 5, buffer, len1);
+        memcpy(block1 + 5, buffer, len1);
         length -= len1;
         buffer += len1;
     }
     
-    xormem(curblock, cbcbuffer, BS); // do the CBC thing
-    Algorithm->Encrypt(curblock, curblock);
-    memcpy(cbcbuffer, curblock, BS); // update CBC for next round
+    // ...then the (rest of the) buffer, as the typeless version does
+    size_t BlockLength = ((length + (BS - 1)) / BS) * BS;
+    if (BlockLength == 0 && BS == 8) // bwd compat w/pre-3 format
+        BlockLength = BS;
     
-    numWritten = fwrite(curblock, 1, BS, fp);
-    if (numWritten != BS) {
-        trashMemory(curblock, BS);
-        throw(EIO);
+    size_t numWritten;
+    try {
+        numWritten = writeblocks(fp, block1, buffer, length, BlockLength,
+                                 Algorithm, cbcbuffer);
+    } catch (...) {
+        trashMemory(block1, BS);
+        throw;
     }
-    
-    numWritten += _writecbc(fp, buffer, length, Algorithm, cbcbuffer);
-    
-    trashMemory(curblock, BS);
+    trashMemory(block1, BS);
     return numWritten;
 }
 
@@ -225,47 +275,97 @@ size_t _writecbc(FILE *fp, const unsigned char *buffer, size_t length,
     // as required.
     
     const unsigned int BS = Algorithm->GetBlockSize();
-    size_t numWritten = 0;
-    
-    // some trickery to avoid new/delete
-    unsigned char block1[16];
-    
-    unsigned char *curblock = NULL;
-    ASSERT(BS <= sizeof(block1)); // if needed we can be more sophisticated here...
-    
-    // First encrypt and write the length of the buffer
-    curblock = block1;
-    // Fill unused bytes of length with random data, to make
-    // a dictionary attack harder
-    PWSrand::GetInstance()->GetRandomData(curblock, BS);
+    ASSERT(BS <= 16);
     
+    size_t BlockLength = 0;
     if (length > 0 ||
         (BS == 8 && length == 0)) { // This part for bwd compat w/pre-3 format
-        size_t BlockLength = ((length + (BS - 1)) / BS) * BS;
+        BlockLength = ((length + (BS - 1)) / BS) * BS;
         if (BlockLength == 0 && BS == 8)
             BlockLength = BS;
-        
-        // Now, encrypt and write the (rest of the) buffer
-        for (unsigned int x = 0; x < BlockLength; x += BS) {
-            if ((length == 0) || ((length % BS != 0) && (length - x < BS))) {
-                //This is for an uneven last block
-                PWSrand::GetInstance()->GetRandomData(curblock, BS);
-                memcpy(curblock, buffer + x, length % BS);
-            } else
-                memcpy(curblock, buffer + x, BS);
-            xormem(curblock, cbcbuffer, BS);
-            Algorithm->Encrypt(curblock, curblock);
-            memcpy(cbcbuffer, curblock, BS);
-            size_t nw =  fwrite(curblock, 1, BS, fp);
-            if (nw != BS) {
-                trashMemory(curblock, BS);
-                throw(EIO);
-            }
-            numWritten += nw;
+    }
+    return writeblocks(fp, NULL, buffer, length, BlockLength,
+                       Algorithm, cbcbuffer);
+}
+
+/*
+ * Works from the last block back to the first, so that the ciphertext
+ * each block is chained to is still in buf when it's needed: no
+ * per-block copying of chaining values, and runs of blocks go to
+ * DecryptBlocks() in one call.
+ */
+void Fish::DecryptCBC(unsigned char *buf, size_t nblocks,
+                      unsigned char *cbcbuffer) const
+{
+    enum {MAXBS = 16, RUN = 16}; // RUN blocks per DecryptBlocks call
+    const unsigned int BS = GetBlockSize();
+    unsigned char nextiv[MAXBS];
+    unsigned char tmp[RUN * MAXBS];
+    
+    ASSERT(BS <= MAXBS);
+    if (nblocks == 0 || BS > MAXBS)
+        return;
+    memcpy(nextiv, buf + (nblocks - 1) * BS, BS);
+    
+    size_t i = nblocks;
+    while (i > 0) {
+        const size_t n = (i > size_t(RUN)) ? size_t(RUN) : i;
+        i -= n;
+        DecryptBlocks(buf + i * BS, tmp, n);
+        // P[j] = D(C[j]) ^ C[j-1], with C[-1] = IV
+        for (size_t j = i + n; j-- > i; ) {
+            unsigned char *p = buf + j * BS;
+            const unsigned char *prev = (j == 0) ? cbcbuffer : p - BS;
+            const unsigned char *d = tmp + (j - i) * BS;
+            for (unsigned int k = 0; k < BS; k++)
+                p[k] = d[k] ^ prev[k];
         }
     }
-    trashMemory(curblock, BS);
-    return numWritten;
+    memcpy(cbcbuffer, nextiv, BS);
+    trashMemory(tmp, sizeof(tmp));
+}
+
+/*
+ * Unlike decryption, inherently one block at a time: each block's input
+ * depends on the previous block's output.
+ */
+void Fish::EncryptCBC(unsigned char *buf, size_t nblocks,
+                      unsigned char *cbcbuffer) const
+{
+    const unsigned int BS = GetBlockSize();
+    const unsigned char *prev = cbcbuffer;
+    
+    for (size_t i = 0; i < nblocks; i++) {
+        unsigned char *b = buf + i * BS;
+        xormem(b, prev, BS);
+        Encrypt(b, b);
+        prev = b;
+    }
+    if (nblocks > 0)
+        memcpy(cbcbuffer, prev, BS);
+}
+
+namespace {
+    // Where readcbc() gets its ciphertext from: a FILE or memory
+    // (e.g., a mapped file). The latter is read directly into the
+    // caller's buffer, where it's decrypted in place.
+    struct FileSource {
+        FILE *fp;
+        size_t Read(unsigned char *buf, size_t len)
+        {return fread(buf, 1, len, fp);}
+    };
+    
+    struct MemSource {
+        const unsigned char *&src;
+        const unsigned char *end;
+        size_t Read(unsigned char *buf, size_t len)
+        {
+            const size_t n = std::min(len, size_t(end - src));
+            memcpy(buf, src, n);
+            src += n;
+            return n;
+        }
+    };
 }
 
 /*
@@ -273,7 +373,7 @@ size_t _writecbc(FILE *fp, const unsigned char *buffer, size_t length,
  * The first block of the record contains the encrypted record length
  * We have the usual ugly problem of fixed buffer lengths in C/C++.
  * allocate the buffer here, to ensure that it's long enough.
- * *** THE CALLER MUST delete[] IT AFTER USE *** UGH++
+ * *** THE CALLER MUST SecureHeap::Free() IT AFTER USE *** UGH++
  *
  * (unless buffer_len is zero)
  *
@@ -284,10 +384,11 @@ size_t _writecbc(FILE *fp, const unsigned char *buffer, size_t length,
  * If TERMINAL_BLOCK is non-NULL, the first block read is tested against it,
  * and -1 is returned if it matches. (used in V3)
  */
-size_t _readcbc(FILE *fp,
-                unsigned char* &buffer, size_t &buffer_len, unsigned char &type,
-                Fish *Algorithm, unsigned char *cbcbuffer,
-                const unsigned char *TERMINAL_BLOCK, ulong64 file_len)
+template<class Source>
+static size_t readcbc(Source &in,
+                      unsigned char* &buffer, size_t &buffer_len, unsigned char &type,
+                      Fish *Algorithm, unsigned char *cbcbuffer,
+                      const unsigned char *TERMINAL_BLOCK, ulong64 file_len)
 {
     const unsigned int BS = Algorithm->GetBlockSize();
     size_t numRead = 0;
@@ -295,8 +396,6 @@ size_t _readcbc(FILE *fp,
     // some trickery to avoid new/delete
     // Initialize memory.  (Lockheed Martin) Secure Coding  11-14-2007
     unsigned char block1[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-    unsigned char block2[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-    unsigned char block3[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
     unsigned char *lengthblock = NULL;
     
     ASSERT(BS <= sizeof(block1)); // if needed we can be more sophisticated here...
@@ -308,7 +407,7 @@ size_t _readcbc(FILE *fp,
     lengthblock = block1;
     
     buffer_len = 0;
-    numRead = fread(lengthblock, 1, BS, fp);
+    numRead = in.Read(lengthblock, BS);
     if (numRead != BS) {
         return 0;
     }
@@ -317,12 +416,7 @@ size_t _readcbc(FILE *fp,
         memcmp(lengthblock, TERMINAL_BLOCK, BS) == 0)
         return static_cast<size_t>(-1);
     
-    unsigned char *lcpy = block2;
-    memcpy(lcpy, lengthblock, BS);
-    
-    Algorithm->Decrypt(lengthblock, lengthblock);
-    xormem(lengthblock, cbcbuffer, BS);
-    memcpy(cbcbuffer, lcpy, BS);
+    Algorithm->DecryptCBC(lengthblock, 1, cbcbuffer);
     
     size_t length = getInt32(lengthblock);
     
@@ -338,12 +432,10 @@ size_t _readcbc(FILE *fp,
     }
     
     buffer_len = length;
-    buffer = new unsigned char[(length / BS) * BS + 2 * BS]; // round upwards
+    // round upwards. Plaintext, so from the secure heap, which zeroes it
+    buffer = static_cast<unsigned char *>(SecureHeap::Alloc((length / BS) * BS + 2 * BS));
     unsigned char *b = buffer;
     
-    // Initialize memory.  (Lockheed Martin) Secure Coding  11-14-2007
-    memset(b, 0, (length / BS) * BS + 2 * BS);
-    
     if (BS == 16) {
         // length block contains up to 11 (= 16 - 4 - 1) bytes
         // of data
@@ -365,52 +457,68 @@ size_t _readcbc(FILE *fp,
     
     if (length > 0 ||
         (BS == 8 && length == 0)) { // pre-3 pain
-        unsigned char *tempcbc = block3;
-        numRead += fread(b, 1, BlockLength, fp);
-        for (unsigned int x = 0; x < BlockLength; x += BS) {
-            memcpy(tempcbc, b + x, BS);
-            Algorithm->Decrypt(b + x, b + x);
-            xormem(b + x, cbcbuffer, BS);
-            memcpy(cbcbuffer, tempcbc, BS);
-        }
+        numRead += in.Read(b, BlockLength);
+        Algorithm->DecryptCBC(b, BlockLength / BS, cbcbuffer);
     }
     
     if (buffer_len == 0) {
-        // delete[] buffer here since caller will see zero length
-        delete[] buffer;
+        // free buffer here since caller will see zero length
+        SecureHeap::Free(buffer);
     }
     return numRead;
 }
 
 // typeless version for V4 content (caller pre-allocates buffer)
-size_t _readcbc(FILE *fp, unsigned char *buffer,
-                const size_t buffer_len, Fish *Algorithm,
-                unsigned char *cbcbuffer)
+template<class Source>
+static size_t readcbc(Source &in, unsigned char *buffer,
+                      const size_t buffer_len, Fish *Algorithm,
+                      unsigned char *cbcbuffer)
 {
     const unsigned int BS = Algorithm->GetBlockSize();
     ASSERT((buffer_len % BS) == 0);
-    size_t nread = 0;
-    unsigned char *p = buffer;
-    unsigned char *tmpcbc = new unsigned char[BS];
-    
-    do {
-        size_t nr = fread(p, 1, BS, fp);
-        nread += nr;
-        if (nr != BS)
-            break;
-        
-        memcpy(tmpcbc, p, BS);
-        Algorithm->Decrypt(p, p);
-        xormem(p, cbcbuffer, BS);
-        memcpy(cbcbuffer, tmpcbc, BS);
-        
-        p += nr;
-    } while (nread < buffer_len);
     
-    delete[] tmpcbc;
+    // One read, one pass over whatever whole blocks we got
+    size_t nread = in.Read(buffer, buffer_len);
+    Algorithm->DecryptCBC(buffer, nread / BS, cbcbuffer);
     return nread;
 }
 
+size_t _readcbc(FILE *fp,
+                unsigned char* &buffer, size_t &buffer_len, unsigned char &type,
+                Fish *Algorithm, unsigned char *cbcbuffer,
+                const unsigned char *TERMINAL_BLOCK, ulong64 file_len)
+{
+    FileSource in = {fp};
+    return readcbc(in, buffer, buffer_len, type, Algorithm, cbcbuffer,
+                   TERMINAL_BLOCK, file_len);
+}
+
+size_t _readcbc(FILE *fp, unsigned char *buffer,
+                const size_t buffer_len, Fish *Algorithm,
+                unsigned char *cbcbuffer)
+{
+    FileSource in = {fp};
+    return readcbc(in, buffer, buffer_len, Algorithm, cbcbuffer);
+}
+
+size_t _readcbc(const unsigned char *&src, const unsigned char *end,
+                unsigned char* &buffer, size_t &buffer_len, unsigned char &type,
+                Fish *Algorithm, unsigned char *cbcbuffer,
+                const unsigned char *TERMINAL_BLOCK, ulong64 file_len)
+{
+    MemSource in = {src, end};
+    return readcbc(in, buffer, buffer_len, type, Algorithm, cbcbuffer,
+                   TERMINAL_BLOCK, file_len);
+}
+
+size_t _readcbc(const unsigned char *&src, const unsigned char *end,
+                unsigned char *buffer, const size_t buffer_len,
+                Fish *Algorithm, unsigned char *cbcbuffer)
+{
+    MemSource in = {src, end};
+    return readcbc(in, buffer, buffer_len, Algorithm, cbcbuffer);
+}
+
 // PWSUtil implementations
 
 void PWSUtil::strCopy(LPTSTR target, size_t tcount, const LPCTSTR source, size_t scount)
@@ -48,7 +48,8 @@ extern void GenRandhash(const StringX &passkey,
                         const unsigned char *m_randstuff,
                         unsigned char *m_randhash);
 
-// buffer is allocated by _readcbc, *** delete[] is responsibility of caller ***
+// buffer is allocated by _readcbc from the SecureHeap,
+// *** SecureHeap::Free() is responsibility of caller ***
 extern size_t _readcbc(FILE *fp, unsigned char * &buffer,
                        size_t &buffer_len,
                        unsigned char &type, Fish *Algorithm,
@@ -61,6 +62,19 @@ extern size_t _readcbc(FILE *fp, unsigned char *buffer,
                        const size_t buffer_len, Fish *Algorithm,
                        unsigned char *cbcbuffer);
 
+// Following read from memory (e.g., a mapped file) instead of a FILE.
+// src is advanced past what's consumed, end is one past the last byte.
+extern size_t _readcbc(const unsigned char *&src, const unsigned char *end,
+                       unsigned char * &buffer, size_t &buffer_len,
+                       unsigned char &type, Fish *Algorithm,
+                       unsigned char *cbcbuffer,
+                       const unsigned char *TERMINAL_BLOCK = NULL,
+                       ulong64 file_len = 0);
+
+extern size_t _readcbc(const unsigned char *&src, const unsigned char *end,
+                       unsigned char *buffer, const size_t buffer_len,
+                       Fish *Algorithm, unsigned char *cbcbuffer);
+
 // _writecbc will throw(EIO) iff a write fail occurs!
 extern size_t _writecbc(FILE *fp, const unsigned char *buffer, size_t length,
                         unsigned char type, Fish *Algorithm,
@@ -71,3 +71,149 @@
 //  memset(d, 0, HASHLEN);
 //  H1.Final(digest);
 //}
+
+HMAC_SHA256_PRF::HMAC_SHA256_PRF(const unsigned char *key, unsigned long keylen)
+{
+  ASSERT(key != NULL || keylen == 0);
+  unsigned char K[BLOCKSIZE];
+  unsigned char pad[BLOCKSIZE];
+
+  memset(K, 0, sizeof(K));
+  if (keylen > BLOCKSIZE) {
+    SHA256 H0;
+    H0.Update(key, keylen);
+    H0.Final(K);
+  } else if (keylen > 0) {
+    memcpy(K, key, keylen);
+  }
+
+  for (int i = 0; i < BLOCKSIZE; i++)
+    pad[i] = K[i] ^ 0x36;
+  SHA256::InitState(m_istate);
+  SHA256::Compress(m_istate, pad);
+
+  for (int i = 0; i < BLOCKSIZE; i++)
+    pad[i] = K[i] ^ 0x5c;
+  SHA256::InitState(m_ostate);
+  SHA256::Compress(m_ostate, pad);
+
+  trashMemory(K, sizeof(K));
+  trashMemory(pad, sizeof(pad));
+}
+
+HMAC_SHA256_PRF::~HMAC_SHA256_PRF()
+{
+  trashMemory(m_istate, sizeof(m_istate));
+  trashMemory(m_ostate, sizeof(m_ostate));
+}
+
+void HMAC_SHA256_PRF::Compute(const unsigned char *in1, unsigned long len1,
+                              const unsigned char *in2, unsigned long len2,
+                              uint32 U[WORDS]) const
+{
+  unsigned char d[HASHLEN];
+
+  SHA256 inner(m_istate, 1);
+  inner.Update(in1, len1);
+  inner.Update(in2, len2);
+  inner.Final(d);
+
+  SHA256 outer(m_ostate, 1);
+  outer.Update(d, HASHLEN);
+  outer.Final(d);
+
+  for (int i = 0; i < WORDS; i++) {
+    LOAD32H(U[i], d + 4*i);
+  }
+  trashMemory(d, sizeof(d));
+}
+
+void HMAC_SHA256_PRF::Iterate(uint32 U[WORDS], uint32 T[WORDS],
+                              uint32 count) const
+{
+  // Both compressions hash a single padded block: the 32 byte message
+  // following the 64 byte key pad, i.e., 768 bits in all.
+  uint32 W[64];
+  ulong32 st[8];
+  int i;
+
+  for (i = WORDS + 1; i < 15; i++)
+    W[i] = 0;
+  W[WORDS] = 0x80000000UL;
+  W[15] = (BLOCKSIZE + HASHLEN) * 8;
+
+  while (count-- > 0) {
+    for (i = 0; i < WORDS; i++)
+      W[i] = U[i];
+    memcpy(st, m_istate, sizeof(st));
+    SHA256::Transform(st, W);
+
+    for (i = 0; i < WORDS; i++)
+      W[i] = static_cast<uint32>(st[i]);
+    memcpy(st, m_ostate, sizeof(st));
+    SHA256::Transform(st, W);
+
+    for (i = 0; i < WORDS; i++) {
+      U[i] = static_cast<uint32>(st[i]);
+      T[i] ^= U[i];
+    }
+  }
+  trashMemory(W, sizeof(W));
+  trashMemory(st, sizeof(st));
+}
+
+void HMAC_SHA256_PRF::IterateLanes(uint32 U[WORDS][SHA256::MAXLANES],
+                                   uint32 T[WORDS][SHA256::MAXLANES],
+                                   const uint32 count[SHA256::MAXLANES]) const
+{
+  const unsigned L = SHA256::MAXLANES;
+  uint32 W[16][L], st[8][L], mask[L];
+  unsigned i, l;
+
+  for (l = 0; l < L; l++) {
+    for (i = WORDS + 1; i < 15; i++)
+      W[i][l] = 0;
+    W[WORDS][l] = 0x80000000UL;
+    W[15][l] = (BLOCKSIZE + HASHLEN) * 8;
+  }
+
+  // Lanes may have different counts, so we run in phases: each phase
+  // runs all lanes up to the next lane's count, and only accumulates
+  // into T for those lanes that haven't reached theirs.
+  uint32 done = 0;
+  for (;;) {
+    uint32 next = 0;
+    for (l = 0; l < L; l++)
+      if (count[l] > done && (next == 0 || count[l] < next))
+        next = count[l];
+    if (next == 0)
+      break;
+    for (l = 0; l < L; l++)
+      mask[l] = (count[l] > done) ? 0xffffffffUL : 0;
+
+    for (uint32 n = done; n < next; n++) {
+      for (i = 0; i < WORDS; i++)
+        for (l = 0; l < L; l++) {
+          W[i][l] = U[i][l];
+          st[i][l] = static_cast<uint32>(m_istate[i]);
+        }
+      SHA256::TransformLanes(st, W);
+
+      for (i = 0; i < WORDS; i++)
+        for (l = 0; l < L; l++) {
+          W[i][l] = st[i][l];
+          st[i][l] = static_cast<uint32>(m_ostate[i]);
+        }
+      SHA256::TransformLanes(st, W);
+
+      for (i = 0; i < WORDS; i++)
+        for (l = 0; l < L; l++) {
+          U[i][l] = st[i][l];
+          T[i][l] ^= st[i][l] & mask[l];
+        }
+    }
+    done = next;
+  }
+  trashMemory(W, sizeof(W));
+  trashMemory(st, sizeof(st));
+}
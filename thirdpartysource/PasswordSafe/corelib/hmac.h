@@ -16,6 +16,8 @@
 
 #include "Util.h" // for ASSERT
 
+#include <type_traits>
+
 class HMAC_BASE
 {
 public:
@@ -39,84 +41,81 @@ template<class H, unsigned int HASHLEN, unsigned int BLOCKSIZE>
 class HMAC : public HMAC_BASE
 {
 public:
+    // All of a computation's state, by value (H must be trivially
+    // copyable), so that snapshotting one's just a copy - e.g., to
+    // roll back a tentative read. HMACs copy the same way.
+    struct State {
+        H hash;
+        unsigned char K[BLOCKSIZE];
+        bool inited;
+    };
+    
     HMAC(const unsigned char *key, unsigned long keylen)
-    : HMAC_BASE(), Hash(0)
+    : HMAC_BASE()
     {
         ASSERT(key != NULL);
         
-        memset(K, 0, sizeof(K));
+        m_state.inited = false;
+        memset(m_state.K, 0, sizeof(m_state.K));
         Init(key, keylen);
     }
     
-    HMAC() : HMAC_BASE(), Hash(0)
+    HMAC() : HMAC_BASE()
     { // Init needs to be called separately
-        memset(K, 0, sizeof(K));
+        m_state.inited = false;
+        memset(m_state.K, 0, sizeof(m_state.K));
     }
     
-    HMAC(const HMAC &hmac) {
-        delete Hash;
-        Hash = new H;
-        *Hash = *hmac.Hash;
-        memcpy(K, hmac.K, BLOCKSIZE);
-    }
-    
-    HMAC &operator=(const HMAC &that) {
-        if (this != &that) {
-            delete Hash;
-            Hash = new H;
-            *Hash = *that.Hash;
-            memcpy(K, that.K, BLOCKSIZE);
-        }
-        return *this;
-    }
-    
-    ~HMAC(){delete Hash;}
+    ~HMAC() {trashMemory(&m_state, sizeof(m_state));}
     
     unsigned int GetBlockSize() const {return BLOCKSIZE;}
     unsigned int GetHashLen() const {return HASHLEN;}
-    bool IsInited() const {return Hash != NULL;}
+    bool IsInited() const {return m_state.inited;}
+    
+    void Snapshot(State &state) const {state = m_state;}
+    void Restore(const State &state) {m_state = state;}
     
     void Init(const unsigned char *key, unsigned long keylen)
     {
         ASSERT(key != NULL);
-        ASSERT(Hash == NULL);
-        Hash = new H; // to ensure state's cleared.
+        ASSERT(!m_state.inited);
+        m_state.hash = H(); // to ensure state's cleared.
+        m_state.inited = true;
         
         if (keylen > BLOCKSIZE) {
             H H0;
             H0.Update(key, keylen);
-            H0.Final(K);
+            H0.Final(m_state.K);
         } else {
-            ASSERT(keylen <= sizeof(K));
-            memcpy(K, key, keylen);
+            ASSERT(keylen <= sizeof(m_state.K));
+            memcpy(m_state.K, key, keylen);
         }
         
         unsigned char k_ipad[BLOCKSIZE];
         for (unsigned int i = 0; i < BLOCKSIZE; i++)
-            k_ipad[i] = K[i] ^ 0x36;
-        Hash->Update(k_ipad, BLOCKSIZE);
+            k_ipad[i] = m_state.K[i] ^ 0x36;
+        m_state.hash.Update(k_ipad, BLOCKSIZE);
         memset(k_ipad, 0, BLOCKSIZE);
     }
     
     void Update(const unsigned char *in, unsigned long inlen)
     {
-        ASSERT(Hash != NULL);
-        Hash->Update(in, inlen);
+        ASSERT(m_state.inited);
+        m_state.hash.Update(in, inlen);
     }
     
     void Final(unsigned char digest[HASHLEN])
     {
         unsigned char d[HASHLEN];
-        ASSERT(Hash != NULL);
+        ASSERT(m_state.inited);
         
-        Hash->Final(d);
-        delete(Hash);
-        Hash = NULL;
+        m_state.hash.Final(d);
+        m_state.inited = false;
         unsigned char k_opad[BLOCKSIZE];
         for (unsigned int i = 0; i < BLOCKSIZE; i++)
-            k_opad[i] = K[i] ^ 0x5c;
+            k_opad[i] = m_state.K[i] ^ 0x5c;
         
-        memset(K, 0, BLOCKSIZE);
+        memset(m_state.K, 0, BLOCKSIZE);
         
         H H1;
         H1.Update(k_opad, BLOCKSIZE);
@@ -127,8 +126,43 @@ public:
     }
     
 private:
-    H *Hash;
-    unsigned char K[BLOCKSIZE];
+    static_assert(std::is_trivially_copyable<H>::value,
+                  "HMAC's hash must be a value type");
+    State m_state;
+};
+
+// HMAC-SHA256 as a PRF for PBKDF2.
+// The key's inner and outer padded blocks are hashed once, at construction,
+// and the resulting midstates are kept. Since PBKDF2's iterated messages are
+// exactly one hash long, each iteration then costs two SHA256 compressions,
+// with no allocation, re-keying or virtual dispatch.
+class HMAC_SHA256_PRF
+{
+public:
+    enum {HASHLEN = SHA256::HASHLEN, BLOCKSIZE = SHA256::BLOCKSIZE,
+        WORDS = SHA256::HASHLEN / 4};
+    
+    HMAC_SHA256_PRF(const unsigned char *key, unsigned long keylen);
+    ~HMAC_SHA256_PRF();
+    
+    // U <- PRF(key, in1 || in2), U as big-endian words
+    void Compute(const unsigned char *in1, unsigned long len1,
+                 const unsigned char *in2, unsigned long len2,
+                 uint32 U[WORDS]) const;
+    // count times: U <- PRF(key, U), T ^= U
+    void Iterate(uint32 U[WORDS], uint32 T[WORDS], uint32 count) const;
+    // Same, for SHA256::MAXLANES independent chains in lockstep
+    // (word-sliced, U[i][lane]), lane l running count[l] times.
+    void IterateLanes(uint32 U[WORDS][SHA256::MAXLANES],
+                      uint32 T[WORDS][SHA256::MAXLANES],
+                      const uint32 count[SHA256::MAXLANES]) const;
+    
+    HMAC_SHA256_PRF(const HMAC_SHA256_PRF &) = delete;
+    HMAC_SHA256_PRF &operator=(const HMAC_SHA256_PRF &) = delete;
+    
+private:
+    ulong32 m_istate[8]; // after H(K ^ ipad)
+    ulong32 m_ostate[8]; // after H(K ^ opad)
 };
 
 #endif /* __HMAC_H */
@@ -13,6 +13,7 @@
 #include "hmac.h"
 
 #include <cstring>
+#include <algorithm>
 
 /**
    @param password          The input password (or key)
@@ -90,3 +91,99 @@ void pbkdf2(const unsigned char *password, unsigned long password_len,
 
   delete[] buf[0];
 }
+
+void pbkdf2_sha256(const unsigned char *password, unsigned long password_len,
+                   const unsigned char *salt,     unsigned long salt_len,
+                   int iteration_count,
+                   unsigned char *out,            unsigned long *outlen)
+{
+  ASSERT(password != NULL || password_len == 0);
+  ASSERT(salt     != NULL);
+  ASSERT(out      != NULL);
+  ASSERT(outlen   != NULL);
+
+  const HMAC_SHA256_PRF prf(password, password_len);
+  uint32 U[HMAC_SHA256_PRF::WORDS], T[HMAC_SHA256_PRF::WORDS];
+  unsigned char blk[4], Tb[HMAC_SHA256_PRF::HASHLEN];
+  unsigned long left = *outlen, stored = 0;
+  ulong32 blkno = 1;
+
+  while (left != 0) {
+    /* U_1 = PRF(P, S||int(blkno)) */
+    STORE32H(blkno, blk);
+    ++blkno;
+    prf.Compute(salt, salt_len, blk, sizeof(blk), U);
+    memcpy(T, U, sizeof(T));
+
+    /* U_i = PRF(P, U_{i-1}), T ^= U_i */
+    if (iteration_count > 1)
+      prf.Iterate(U, T, uint32(iteration_count - 1));
+
+    for (int i = 0; i < HMAC_SHA256_PRF::WORDS; i++) {
+      STORE32H(T[i], Tb + 4*i);
+    }
+    for (unsigned long y = 0; y < sizeof(Tb) && left != 0; ++y) {
+      out[stored++] = Tb[y];
+      --left;
+    }
+  }
+  *outlen = stored;
+
+  trashMemory(U, sizeof(U));
+  trashMemory(T, sizeof(T));
+  trashMemory(Tb, sizeof(Tb));
+}
+
+void pbkdf2_sha256_lanes(const unsigned char *password, unsigned long password_len,
+                         unsigned n,
+                         const unsigned char *const salts[],
+                         const unsigned long salt_lens[],
+                         const uint32 iteration_counts[],
+                         unsigned char *const outs[], unsigned long outlen)
+{
+  const unsigned L = SHA256::MAXLANES;
+  const unsigned WORDS = HMAC_SHA256_PRF::WORDS;
+  ASSERT(n > 0 && n <= L);
+  ASSERT(salts != NULL && salt_lens != NULL);
+  ASSERT(iteration_counts != NULL && outs != NULL);
+
+  const HMAC_SHA256_PRF prf(password, password_len);
+  uint32 U[WORDS][L], T[WORDS][L], count[L], u[WORDS];
+  unsigned char blk[4], Tb[HMAC_SHA256_PRF::HASHLEN];
+  unsigned long stored = 0;
+  ulong32 blkno = 1;
+  unsigned i, l;
+
+  // Unused lanes get a zero count, and are never accumulated
+  for (l = 0; l < L; l++)
+    count[l] = (l < n && iteration_counts[l] > 1) ? iteration_counts[l] - 1 : 0;
+
+  while (stored < outlen) {
+    /* U_1 = PRF(P, S||int(blkno)), per lane */
+    STORE32H(blkno, blk);
+    ++blkno;
+    memset(U, 0, sizeof(U));
+    for (l = 0; l < n; l++) {
+      prf.Compute(salts[l], salt_lens[l], blk, sizeof(blk), u);
+      for (i = 0; i < WORDS; i++)
+        U[i][l] = u[i];
+    }
+    memcpy(T, U, sizeof(T));
+
+    prf.IterateLanes(U, T, count);
+
+    const unsigned long nout = std::min(outlen - stored, (unsigned long)sizeof(Tb));
+    for (l = 0; l < n; l++) {
+      for (i = 0; i < WORDS; i++) {
+        STORE32H(T[i][l], Tb + 4*i);
+      }
+      memcpy(outs[l] + stored, Tb, nout);
+    }
+    stored += nout;
+  }
+
+  trashMemory(U, sizeof(U));
+  trashMemory(T, sizeof(T));
+  trashMemory(u, sizeof(u));
+  trashMemory(Tb, sizeof(Tb));
+}
@@ -14,6 +14,8 @@
 
 #ifndef __PBKDF2_H
 #define __PBKDF2_H
+#include "../os/typedefs.h"
+
 class HMAC_BASE;
 /**
    @param password          The input password (or key)
@@ -30,4 +32,28 @@ void pbkdf2(const unsigned char *password, unsigned long password_len,
             const unsigned char *salt,     unsigned long salt_len,
             int iteration_count,           HMAC_BASE *hmac,
             unsigned char *out,            unsigned long *outlen);
+
+/**
+   As above, specialized for HMAC-SHA256 (used by V4 key stretching).
+   Functionally identical to pbkdf2() with an HMAC<SHA256...>, but keeps
+   the padded key midstates across iterations (see HMAC_SHA256_PRF in hmac.h),
+   which makes it several times faster.
+*/
+void pbkdf2_sha256(const unsigned char *password, unsigned long password_len,
+                   const unsigned char *salt,     unsigned long salt_len,
+                   int iteration_count,
+                   unsigned char *out,            unsigned long *outlen);
+/**
+   PBKDF2-HMAC-SHA256 of one password against n salts, n <= SHA256::MAXLANES,
+   each with its own iteration count. The derivations run in lockstep on
+   the multi-buffer SHA256 kernel, so the lot costs about as much as the
+   longest one alone.
+   @param outs              [out] outs[i] receives outlen bytes for salts[i]
+*/
+void pbkdf2_sha256_lanes(const unsigned char *password, unsigned long password_len,
+                         unsigned n,
+                         const unsigned char *const salts[],
+                         const unsigned long salt_lens[],
+                         const uint32 iteration_counts[],
+                         unsigned char *const outs[], unsigned long outlen);
 #endif /* __PBKDF2_H */
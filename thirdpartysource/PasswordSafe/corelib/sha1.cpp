@@ -18,6 +18,14 @@
 #include <stdlib.h>
 #include "sha1.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(PWS_ARMV8_SHA) && defined(__aarch64__) && \
+      (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#include <arm_neon.h>
+#endif
+
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
 /* blk0() and blk() perform the initial expand. */
@@ -94,6 +102,141 @@ static void SHA1Transform(uint32 state[5],
     a = b = c = d = e = 0;
 }
 
+/*
+ The same, with the CPU's SHA-1 instructions: Intel SHA extensions
+ (SHA-NI) on x86, the ARMv8 Cryptography Extensions on arm64.
+ Each of the 20 steps below is 4 rounds; Q[i & 3] holds message words
+ 4i..4i+3, each quad being expanded from the previous four in place.
+ As with SHA-256, the ARMv8 kernel is only built with PWS_ARMV8_SHA.
+ */
+typedef void (*sha1_block_fn)(uint32 state[5], const unsigned char buffer[64]);
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA1_HAVE_SHANI
+
+// i = step, f = round function (0..3), E = E for this step, P = the other
+#define SHA1_STEP(i, f, E, P)                                             \
+E = (i == 0) ? _mm_add_epi32(E, Q[0]) : _mm_sha1nexte_epu32(E, Q[i & 3]); \
+P = ABCD;                                                                 \
+if (i >= 3 && i <= 18) Q[(i + 1) & 3] = _mm_sha1msg2_epu32(Q[(i + 1) & 3], Q[i & 3]); \
+ABCD = _mm_sha1rnds4_epu32(ABCD, E, f);                                   \
+if (i >= 1 && i <= 16) Q[(i + 3) & 3] = _mm_sha1msg1_epu32(Q[(i + 3) & 3], Q[i & 3]); \
+if (i >= 2 && i <= 17) Q[(i + 2) & 3] = _mm_xor_si128(Q[(i + 2) & 3], Q[i & 3]);
+
+__attribute__((target("sha,sse4.1")))
+static void SHA1Transform_shani(uint32 state[5], const unsigned char buffer[64])
+{
+    const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1, Q[4];
+    
+    ABCD = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+    E0 = E0_SAVE = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+    ABCD_SAVE = ABCD;
+    for (int i = 0; i < 4; i++)
+        Q[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buffer + 16 * i)), MASK);
+    
+    SHA1_STEP( 0, 0, E0, E1); SHA1_STEP( 1, 0, E1, E0); SHA1_STEP( 2, 0, E0, E1);
+    SHA1_STEP( 3, 0, E1, E0); SHA1_STEP( 4, 0, E0, E1); SHA1_STEP( 5, 1, E1, E0);
+    SHA1_STEP( 6, 1, E0, E1); SHA1_STEP( 7, 1, E1, E0); SHA1_STEP( 8, 1, E0, E1);
+    SHA1_STEP( 9, 1, E1, E0); SHA1_STEP(10, 2, E0, E1); SHA1_STEP(11, 2, E1, E0);
+    SHA1_STEP(12, 2, E0, E1); SHA1_STEP(13, 2, E1, E0); SHA1_STEP(14, 2, E0, E1);
+    SHA1_STEP(15, 3, E1, E0); SHA1_STEP(16, 3, E0, E1); SHA1_STEP(17, 3, E1, E0);
+    SHA1_STEP(18, 3, E0, E1); SHA1_STEP(19, 3, E1, E0);
+    
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+    
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(ABCD, 0x1B));
+    state[4] = static_cast<uint32>(_mm_extract_epi32(E0, 3));
+}
+#undef SHA1_STEP
+
+static bool sha1_cpu_has_shani()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return false;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1u << 29)) != 0; /* CPUID.(EAX=7,ECX=0):EBX.SHA */
+}
+#endif
+
+#if defined(PWS_ARMV8_SHA) && defined(__aarch64__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SHA1_HAVE_ARMV8
+static void SHA1Transform_armv8(uint32 state[5], const unsigned char buffer[64])
+{
+    static const uint32 K[4] = {0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
+    uint32x4_t ABCD, ABCD_SAVE, Q[4], MSG;
+    uint32_t E0, E1, E0_SAVE;
+    int i;
+    
+    ABCD = ABCD_SAVE = vld1q_u32(state);
+    E0 = E0_SAVE = state[4];
+    for (i = 0; i < 4; i++)
+        Q[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buffer + 16 * i)));
+    
+    for (i = 0; i < 20; i++) {
+        MSG = vaddq_u32(Q[i & 3], vdupq_n_u32(K[i / 5]));
+        E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+        if (i < 5)
+            ABCD = vsha1cq_u32(ABCD, E0, MSG);
+        else if (i >= 10 && i < 15)
+            ABCD = vsha1mq_u32(ABCD, E0, MSG);
+        else
+            ABCD = vsha1pq_u32(ABCD, E0, MSG);
+        E0 = E1;
+        if (i < 16) /* words 4i+16..4i+19, replacing 4i..4i+3 */
+            Q[i & 3] = vsha1su1q_u32(vsha1su0q_u32(Q[i & 3], Q[(i + 1) & 3], Q[(i + 2) & 3]),
+                                     Q[(i + 3) & 3]);
+    }
+    
+    vst1q_u32(state, vaddq_u32(ABCD, ABCD_SAVE));
+    state[4] = E0 + E0_SAVE;
+}
+#endif
+
+#if defined(SHA1_HAVE_SHANI) || defined(SHA1_HAVE_ARMV8)
+/* Known answer: FIPS 180-2 A.1, "abc" as one padded block */
+static bool sha1_block_ok(sha1_block_fn fn)
+{
+    static const uint32 ABC[5] = {
+        0xA9993E36, 0x4706816A, 0xBA3E2571, 0x7850C26C, 0x9CD0D89D};
+    uint32 st[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char block[64];
+    
+    memset(block, 0, sizeof(block));
+    memcpy(block, "abc\x80", 4);
+    block[63] = 24; /* bit length */
+    fn(st, block);
+    return memcmp(st, ABC, sizeof(ABC)) == 0;
+}
+#endif
+
+// Pick the best kernel for this CPU, once.
+// A hardware kernel is only used if it gets the known answer.
+static sha1_block_fn sha1_select_block()
+{
+#ifdef SHA1_HAVE_SHANI
+    if (sha1_cpu_has_shani() && sha1_block_ok(SHA1Transform_shani))
+        return SHA1Transform_shani;
+#endif
+#ifdef SHA1_HAVE_ARMV8
+    // if it's compiled in, we have it
+    if (sha1_block_ok(SHA1Transform_armv8))
+        return SHA1Transform_armv8;
+#endif
+    return SHA1Transform;
+}
+
+static void sha1_block(uint32 state[5], const unsigned char buffer[64])
+{
+    static const sha1_block_fn block_fn = sha1_select_block();
+    block_fn(state, buffer);
+}
+
 SHA1::SHA1()
 {
     /* SHA1 initialization constants */
@@ -115,9 +258,9 @@ void SHA1::Update(const unsigned char* data, unsigned int len)
     count[1] += (len >> 29);
     if ((j + len) > 63) {
         memcpy(&buffer[j], data, (i = 64-j));
-        SHA1Transform(state, buffer);
+        sha1_block(state, buffer);
         for ( ; i + 63 < len; i += 64) {
-            SHA1Transform(state, &data[i]);
+            sha1_block(state, &data[i]);
         }
         j = 0;
     }
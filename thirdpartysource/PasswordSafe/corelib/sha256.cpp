@@ -12,9 +12,18 @@
 #include "sha256.h"
 #include "PwsPlatform.h"
 #include "Util.h"
+#include "os/env.h"
 
 #include <algorithm>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(PWS_ARMV8_SHA) && defined(__aarch64__) && \
+      (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#include <arm_neon.h>
+#endif
+
 #define LTC_CLEAN_STACK
 
 /* hashsize = 32, blocksize = 64 */
@@ -48,16 +57,15 @@ static const unsigned long K[64] = {
 #define Gamma0(x)       (S(x, 7) ^ S(x, 18) ^ R(x, 3))
 #define Gamma1(x)       (S(x, 17) ^ S(x, 19) ^ R(x, 10))
 
-/* compress 512-bits */
-#ifdef LTC_CLEAN_STACK
-static void _sha256_compress(ulong32 state[8], const unsigned char *buf)
-#else
-static void  sha256_compress(ulong32 state[8], const unsigned char *buf)
-#endif
+/* single-block kernel, selected at first use: see sha256_select_block() */
+static void sha256_block(ulong32 state[8], uint32 W[64]);
+
+/* compress 512-bits, message block already loaded into W[0..15] */
+static void sha256_transform(ulong32 state[8], uint32 W[64])
 {
-    unsigned int S[8], W[64], t0, t1;
+    uint32 S[8], t0, t1;
 #ifdef LTC_SMALL_CODE
-    unsigned long t;
+    uint32 t;
 #endif
     int i;
     
@@ -66,11 +74,6 @@ static void  sha256_compress(ulong32 state[8], const unsigned char *buf)
         S[i] = state[i];
     }
     
-    /* copy the state into 512-bits into W[0..15] */
-    for (i = 0; i < 16; i++) {
-        LOAD32H(W[i], buf + (4*i));
-    }
-    
     /* fill W[16..63] */
     for (i = 16; i < 64; i++) {
         W[i] = Gamma1(W[i - 2]) + W[i - 7] + Gamma0(W[i - 15]) + W[i - 16];
@@ -171,13 +174,330 @@ h  = t0 + t1;
     }
 }
 
+#ifdef LTC_CLEAN_STACK
+static void _sha256_compress(ulong32 state[8], const unsigned char *buf)
+#else
+static void  sha256_compress(ulong32 state[8], const unsigned char *buf)
+#endif
+{
+    uint32 W[64];
+    
+    /* copy the state into 512-bits into W[0..15] */
+    for (int i = 0; i < 16; i++) {
+        LOAD32H(W[i], buf + (4*i));
+    }
+    sha256_block(state, W);
+}
+
+/*
+ Multi-buffer compression: MAXLANES independent transforms in lockstep,
+ word-sliced so that each SHA-256 operation becomes one vector operation.
+ Written with GCC/clang vector extensions, so the same body compiles to
+ AVX2 (when the CPU has it, see dispatch below), SSE2 on other x86-64,
+ NEON on ARM, or plain scalar code elsewhere.
+ */
+static const uint32 K256[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
+    0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
+    0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
+    0xc19bf174UL, 0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL, 0x983e5152UL,
+    0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL,
+    0x06ca6351UL, 0x14292967UL, 0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL,
+    0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL,
+    0xd6990624UL, 0xf40e3585UL, 0x106aa070UL, 0x19a4c116UL, 0x1e376c08UL,
+    0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL,
+    0x682e6ff3UL, 0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+typedef void (*sha256_lanes_fn)(uint32 state[8][SHA256::MAXLANES],
+                                const uint32 W[16][SHA256::MAXLANES]);
+
+#if defined(__GNUC__) || defined(__clang__)
+
+static_assert(SHA256::MAXLANES == 8, "lane vector type assumes 8 lanes");
+typedef uint32 lanevec __attribute__((vector_size(32)));
+
+#define vROR(x, n)      (((x) >> (n)) | ((x) << (32 - (n))))
+#define vSigma0(x)      (vROR(x, 2) ^ vROR(x, 13) ^ vROR(x, 22))
+#define vSigma1(x)      (vROR(x, 6) ^ vROR(x, 11) ^ vROR(x, 25))
+#define vGamma0(x)      (vROR(x, 7) ^ vROR(x, 18) ^ ((x) >> 3))
+#define vGamma1(x)      (vROR(x, 17) ^ vROR(x, 19) ^ ((x) >> 10))
+
+static inline __attribute__((always_inline))
+void sha256_lanes_body(uint32 state[8][SHA256::MAXLANES],
+                       const uint32 Win[16][SHA256::MAXLANES])
+{
+    lanevec W[64], a, b, c, d, e, f, g, h, t0, t1;
+    int i;
+    
+    for (i = 0; i < 16; i++)
+        memcpy(&W[i], Win[i], sizeof(lanevec));
+    for (i = 16; i < 64; i++)
+        W[i] = vGamma1(W[i - 2]) + W[i - 7] + vGamma0(W[i - 15]) + W[i - 16];
+    
+    memcpy(&a, state[0], sizeof(lanevec)); memcpy(&b, state[1], sizeof(lanevec));
+    memcpy(&c, state[2], sizeof(lanevec)); memcpy(&d, state[3], sizeof(lanevec));
+    memcpy(&e, state[4], sizeof(lanevec)); memcpy(&f, state[5], sizeof(lanevec));
+    memcpy(&g, state[6], sizeof(lanevec)); memcpy(&h, state[7], sizeof(lanevec));
+    
+    for (i = 0; i < 64; i++) {
+        t0 = h + vSigma1(e) + Ch(e, f, g) + K256[i] + W[i];
+        t1 = vSigma0(a) + Maj(a, b, c);
+        h = g; g = f; f = e; e = d + t0;
+        d = c; c = b; b = a; a = t0 + t1;
+    }
+    
+    lanevec v;
+    memcpy(&v, state[0], sizeof(v)); v += a; memcpy(state[0], &v, sizeof(v));
+    memcpy(&v, state[1], sizeof(v)); v += b; memcpy(state[1], &v, sizeof(v));
+    memcpy(&v, state[2], sizeof(v)); v += c; memcpy(state[2], &v, sizeof(v));
+    memcpy(&v, state[3], sizeof(v)); v += d; memcpy(state[3], &v, sizeof(v));
+    memcpy(&v, state[4], sizeof(v)); v += e; memcpy(state[4], &v, sizeof(v));
+    memcpy(&v, state[5], sizeof(v)); v += f; memcpy(state[5], &v, sizeof(v));
+    memcpy(&v, state[6], sizeof(v)); v += g; memcpy(state[6], &v, sizeof(v));
+    memcpy(&v, state[7], sizeof(v)); v += h; memcpy(state[7], &v, sizeof(v));
+}
+
+static void sha256_lanes_generic(uint32 state[8][SHA256::MAXLANES],
+                                 const uint32 W[16][SHA256::MAXLANES])
+{
+    sha256_lanes_body(state, W);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_HAVE_AVX2
+__attribute__((target("avx2")))
+static void sha256_lanes_avx2(uint32 state[8][SHA256::MAXLANES],
+                              const uint32 W[16][SHA256::MAXLANES])
+{
+    sha256_lanes_body(state, W);
+}
+#endif
+
+#else /* no vector extensions: one lane at a time */
+
+static void sha256_lanes_generic(uint32 state[8][SHA256::MAXLANES],
+                                 const uint32 Win[16][SHA256::MAXLANES])
+{
+    uint32 W[64];
+    ulong32 st[8];
+    int i;
+    for (unsigned l = 0; l < SHA256::MAXLANES; l++) {
+        for (i = 0; i < 16; i++) W[i] = Win[i][l];
+        for (i = 0; i < 8; i++) st[i] = state[i][l];
+        sha256_transform(st, W);
+        for (i = 0; i < 8; i++) state[i][l] = static_cast<uint32>(st[i]);
+    }
+}
+
+#endif
+
+/*
+ Single-block compression with the CPU's SHA-256 instructions: Intel SHA
+ extensions (SHA-NI) on x86, the ARMv8 Cryptography Extensions on arm64.
+ Both take W[0..15] as host-order words - the form LOAD32H leaves them in -
+ and leave W[16..63] alone, as they expand the message schedule in
+ registers. State is copied in and out, as ulong32 may be 64 bits wide.
+ The ARMv8 kernel has yet to be run on arm64 hardware, so it's only built
+ with PWS_ARMV8_SHA defined; build HashKATTest with it there first.
+ */
+typedef void (*sha256_block_fn)(ulong32 state[8], uint32 W[64]);
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_HAVE_SHANI
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_shani(ulong32 state[8], uint32 W[64])
+{
+    uint32 st[8];
+    __m128i STATE0, STATE1, ABEF_SAVE, CDGH_SAVE, MSG, TMP, M[4];
+    int i;
+    
+    for (i = 0; i < 8; i++)
+        st[i] = static_cast<uint32>(state[i]);
+    
+    /* SHA-NI wants the state as ABEF/CDGH */
+    TMP = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&st[0]));
+    STATE1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&st[4]));
+    TMP = _mm_shuffle_epi32(TMP, 0xB1);          /* CDAB */
+    STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);    /* EFGH */
+    STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);    /* ABEF */
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0); /* CDGH */
+    ABEF_SAVE = STATE0;
+    CDGH_SAVE = STATE1;
+    
+    for (i = 0; i < 4; i++)
+        M[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&W[4*i]));
+    
+    /* 16 x 4 rounds; M[i & 3] holds W[4i..4i+3] */
+    for (i = 0; i < 16; i++) {
+        MSG = _mm_add_epi32(M[i & 3],
+                            _mm_loadu_si128(reinterpret_cast<const __m128i *>(&K256[4*i])));
+        STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+        MSG = _mm_shuffle_epi32(MSG, 0x0E);
+        STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+        if (i < 12) { /* W[4i+16..4i+19], replacing W[4i..4i+3] */
+            TMP = _mm_sha256msg1_epu32(M[i & 3], M[(i + 1) & 3]);
+            TMP = _mm_add_epi32(TMP, _mm_alignr_epi8(M[(i + 3) & 3], M[(i + 2) & 3], 4));
+            M[i & 3] = _mm_sha256msg2_epu32(TMP, M[(i + 3) & 3]);
+        }
+    }
+    
+    STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+    STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+    
+    /* back to ABCD/EFGH */
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B);       /* FEBA */
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);    /* DCHG */
+    STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0); /* DCBA */
+    STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);    /* ABEF */
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&st[0]), STATE0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&st[4]), STATE1);
+    
+    for (i = 0; i < 8; i++)
+        state[i] = st[i];
+}
+
+static bool sha256_cpu_has_shani()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return false;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1u << 29)) != 0; /* CPUID.(EAX=7,ECX=0):EBX.SHA */
+}
+#endif
+
+#if defined(PWS_ARMV8_SHA) && defined(__aarch64__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SHA256_HAVE_ARMV8
+static void sha256_transform_armv8(ulong32 state[8], uint32 W[64])
+{
+    uint32 st[8];
+    uint32x4_t STATE0, STATE1, ABCD_SAVE, EFGH_SAVE, MSG, TMP, M[4];
+    int i;
+    
+    for (i = 0; i < 8; i++)
+        st[i] = static_cast<uint32>(state[i]);
+    STATE0 = ABCD_SAVE = vld1q_u32(&st[0]);
+    STATE1 = EFGH_SAVE = vld1q_u32(&st[4]);
+    
+    for (i = 0; i < 4; i++)
+        M[i] = vld1q_u32(&W[4*i]);
+    
+    /* 16 x 4 rounds; M[i & 3] holds W[4i..4i+3] */
+    for (i = 0; i < 16; i++) {
+        MSG = vaddq_u32(M[i & 3], vld1q_u32(&K256[4*i]));
+        TMP = STATE0;
+        STATE0 = vsha256hq_u32(STATE0, STATE1, MSG);
+        STATE1 = vsha256h2q_u32(STATE1, TMP, MSG);
+        if (i < 12) /* W[4i+16..4i+19], replacing W[4i..4i+3] */
+            M[i & 3] = vsha256su1q_u32(vsha256su0q_u32(M[i & 3], M[(i + 1) & 3]),
+                                       M[(i + 2) & 3], M[(i + 3) & 3]);
+    }
+    
+    vst1q_u32(&st[0], vaddq_u32(STATE0, ABCD_SAVE));
+    vst1q_u32(&st[4], vaddq_u32(STATE1, EFGH_SAVE));
+    for (i = 0; i < 8; i++)
+        state[i] = st[i];
+}
+#endif
+
+#if defined(SHA256_HAVE_SHANI) || defined(SHA256_HAVE_ARMV8)
+/* Known answer: FIPS 180-2 B.1, "abc" as one padded block */
+static bool sha256_block_ok(sha256_block_fn fn)
+{
+    static const ulong32 H0[8] = {
+        0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+        0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL};
+    static const ulong32 ABC[8] = {
+        0xBA7816BFUL, 0x8F01CFEAUL, 0x414140DEUL, 0x5DAE2223UL,
+        0xB00361A3UL, 0x96177A9CUL, 0xB410FF61UL, 0xF20015ADUL};
+    ulong32 st[8];
+    uint32 W[64];
+    int i;
+    
+    for (i = 0; i < 8; i++)
+        st[i] = H0[i];
+    memset(W, 0, sizeof(W));
+    W[0] = 0x61626380; /* 'a' 'b' 'c' 0x80 */
+    W[15] = 24;        /* bit length */
+    fn(st, W);
+    for (i = 0; i < 8; i++)
+        if ((st[i] & 0xFFFFFFFFUL) != ABC[i])
+            return false;
+    return true;
+}
+#endif
+
+// Setting PWS_SHA_PORTABLE in the environment turns off both kernel
+// choices below, so that tests can check the portable code on any CPU.
+static bool sha256_force_portable()
+{
+    return !pws_os::getenv("PWS_SHA_PORTABLE", false).empty();
+}
+
+// Pick the best single-block kernel for this CPU, once.
+// A hardware kernel is only used if it gets the known answer.
+static sha256_block_fn sha256_select_block()
+{
+    if (sha256_force_portable())
+        return sha256_transform;
+#ifdef SHA256_HAVE_SHANI
+    if (sha256_cpu_has_shani() && sha256_block_ok(sha256_transform_shani))
+        return sha256_transform_shani;
+#endif
+#ifdef SHA256_HAVE_ARMV8
+    // if it's compiled in, we have it
+    if (sha256_block_ok(sha256_transform_armv8))
+        return sha256_transform_armv8;
+#endif
+    return sha256_transform;
+}
+
+static void sha256_block(ulong32 state[8], uint32 W[64])
+{
+    static const sha256_block_fn block_fn = sha256_select_block();
+    block_fn(state, W);
+}
+
+// Pick the best kernel for this CPU, once.
+static sha256_lanes_fn sha256_select_lanes()
+{
+    if (sha256_force_portable())
+        return sha256_lanes_generic;
+#ifdef SHA256_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return sha256_lanes_avx2;
+#endif
+    return sha256_lanes_generic;
+}
+
 #ifdef LTC_CLEAN_STACK
 static void sha256_compress(ulong32 state[8], const unsigned char *buf)
 {
     _sha256_compress(state, buf);
     burnStack(sizeof(unsigned long) * 74);
 }
+#else
+#define _sha256_compress sha256_compress
+#endif
+
+/* compress nblocks consecutive blocks, burning the stack once at the end */
+static void sha256_compress_blocks(ulong32 state[8], const unsigned char *in,
+                                   size_t nblocks)
+{
+    for (size_t i = 0; i < nblocks; i++)
+        _sha256_compress(state, in + 64 * i);
+#ifdef LTC_CLEAN_STACK
+    burnStack(sizeof(unsigned long) * 74);
 #endif
+}
 
 /*
  Initialize the hash state
@@ -186,19 +506,86 @@ SHA256::SHA256()
 {
     curlen = 0;
     length = 0;
-    state[0] = 0x6A09E667UL;
-    state[1] = 0xBB67AE85UL;
-    state[2] = 0x3C6EF372UL;
-    state[3] = 0xA54FF53AUL;
-    state[4] = 0x510E527FUL;
-    state[5] = 0x9B05688CUL;
-    state[6] = 0x1F83D9ABUL;
-    state[7] = 0x5BE0CD19UL;
+    InitState(state);
+}
+
+/*
+ Resume hashing from a saved chaining value
+ @param midstate  The chaining value after nblocks full blocks
+ @param nblocks   The number of 64-byte blocks already absorbed
+ */
+SHA256::SHA256(const ulong32 midstate[8], size_t nblocks)
+{
+    curlen = 0;
+    length = static_cast<ulong64>(nblocks) * BLOCKSIZE * 8;
+    memcpy(state, midstate, sizeof(state));
+}
+
+void SHA256::InitState(ulong32 st[8])
+{
+    st[0] = 0x6A09E667UL;
+    st[1] = 0xBB67AE85UL;
+    st[2] = 0x3C6EF372UL;
+    st[3] = 0xA54FF53AUL;
+    st[4] = 0x510E527FUL;
+    st[5] = 0x9B05688CUL;
+    st[6] = 0x1F83D9ABUL;
+    st[7] = 0x5BE0CD19UL;
+}
+
+/*
+ Raw compression functions, no padding, length tracking or stack burning:
+ callers are expected to clean up after themselves.
+ */
+void SHA256::Compress(ulong32 st[8], const unsigned char block[BLOCKSIZE])
+{
+    uint32 W[64];
+    for (int i = 0; i < 16; i++) {
+        LOAD32H(W[i], block + (4*i));
+    }
+    sha256_block(st, W);
+}
+
+void SHA256::Transform(ulong32 st[8], uint32 W[64])
+{
+    sha256_block(st, W);
+}
+
+void SHA256::Iterate(unsigned char X[HASHLEN], uint32 n)
+{
+    // A 32-byte message pads to one block: the message, the '1' bit,
+    // zeroes and the length (256 bits). The state's big-endian words
+    // after each round are the next round's message words.
+    uint32 W[64];
+    ulong32 st[8];
+    int i;
+    
+    for (i = 0; i < 8; i++) {
+        LOAD32H(W[i], X + (4*i));
+    }
+    W[8] = 0x80000000UL;
+    for (i = 9; i < 15; i++)
+        W[i] = 0;
+    W[15] = HASHLEN * 8;
+    
+    while (n-- > 0) {
+        InitState(st);
+        sha256_block(st, W);
+        for (i = 0; i < 8; i++)
+            W[i] = static_cast<uint32>(st[i]);
+    }
+    
+    for (i = 0; i < 8; i++) {
+        STORE32H(W[i], X + (4*i));
+    }
+    trashMemory(W, sizeof(W));
+    trashMemory(st, sizeof(st));
 }
 
-SHA256::~SHA256()
+void SHA256::TransformLanes(uint32 st[8][MAXLANES], const uint32 W[16][MAXLANES])
 {
-    // sanitizing done in Final()
+    static const sha256_lanes_fn lanes_fn = sha256_select_lanes();
+    lanes_fn(st, W);
 }
 
 /*
@@ -214,10 +601,11 @@ void SHA256::Update(const unsigned char *in, size_t inlen)
     ASSERT(curlen <= sizeof(buf));
     while (inlen > 0) {
         if (curlen == 0 && inlen >= block_size) {
-            sha256_compress(state, in);
-            length += block_size * 8;
-            in             += block_size;
-            inlen          -= block_size;
+            const size_t nblocks = inlen / block_size;
+            sha256_compress_blocks(state, in, nblocks);
+            length += nblocks * block_size * 8;
+            in             += nblocks * block_size;
+            inlen          -= nblocks * block_size;
         } else {
             n = std::min(inlen, (block_size - curlen));
             memcpy(buf + curlen, in, static_cast<size_t>(n));
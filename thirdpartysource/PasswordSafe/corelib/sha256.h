@@ -20,10 +20,39 @@ class SHA256
 public:
     enum {HASHLEN = 32, BLOCKSIZE = 64};
     SHA256();
-    ~SHA256();
+    // Following resumes from a chaining value captured after nblocks
+    // full blocks (e.g., an HMAC key pad), see InitState/Compress below.
+    SHA256(const ulong32 midstate[8], size_t nblocks);
+    // No destructor: Final() sanitizes, and this way we're trivially
+    // copyable, which HMAC relies on for cheap snapshots.
     void Update(const unsigned char *in, size_t inlen);
     void Final(unsigned char digest[HASHLEN]);
     
+    // Low-level access for fixed-size inputs (PBKDF2, key stretching).
+    // Compress absorbs one 64-byte block; Transform takes the block as
+    // 16 big-endian words in W[0..15], and may use W[16..63] as scratch.
+    // Neither pads nor burns the stack - that's up to the caller.
+    // All hashing uses the CPU's SHA instructions if it has them
+    // (SHA-NI, ARMv8), selected at first call if they get the
+    // known answer for "abc" (FIPS 180-2), else the portable code.
+    static void InitState(ulong32 state[8]);
+    static void Compress(ulong32 state[8], const unsigned char block[BLOCKSIZE]);
+    static void Transform(ulong32 state[8], uint32 W[64]);
+    
+    // X = SHA256(X), n times over, for a 32-byte X (V3 key stretching).
+    // Builds the single padded block once, and only rewrites its first
+    // 8 words each time round.
+    static void Iterate(unsigned char X[HASHLEN], uint32 n);
+    
+    // Multi-buffer version of Transform: MAXLANES independent blocks
+    // in lockstep, word-sliced as state[i][lane] and W[i][lane], i < 16.
+    // Uses the widest SIMD unit available, selected at first call.
+    // Either choice falls back to the portable code if PWS_SHA_PORTABLE
+    // is set in the environment (for testing).
+    enum {MAXLANES = 8};
+    static void TransformLanes(uint32 state[8][MAXLANES],
+                               const uint32 W[16][MAXLANES]);
+    
 private:
     ulong64 length;
     size_t curlen;
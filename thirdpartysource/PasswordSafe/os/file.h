@@ -33,7 +33,27 @@ namespace pws_os {
     
     extern std::FILE *FOpen(const stringT &filename, const TCHAR *mode);
     extern int FClose(std::FILE *fd, const bool &bIsWrite);
+    // Flushes fd's buffers and has what's been written put on disk
+    // before returning (FClose() does this for files being written).
+    extern bool FSync(std::FILE *fd);
+    // Creates and opens for writing ("wb") a new file alongside filename,
+    // named after it but with a suffix no other file has, and sets
+    // tmpname to its name. Readable by the owner only.
+    extern std::FILE *FOpenTemp(const stringT &filename, stringT &tmpname);
+    // Has the directory entry for filename put on disk, e.g. after
+    // RenameFile() has replaced it.
+    extern bool FSyncDir(const stringT &filename);
     extern ulong64 fileLength(std::FILE *fp);
+    // Read-only mapping of all of fp's file (filename), for fast parsing.
+    // Saves replace the file by renaming a new one over it, which leaves
+    // the mapped one alone. Where the filesystem can clone cheaply, a
+    // clone nothing else can get at is mapped instead, so that not even
+    // truncating the file in place can pull it from under us (a SIGBUS).
+    // Returns NULL if the file can't be mapped - caller should fall back
+    // to stdio.
+    extern const unsigned char *MapFile(const stringT &filename, std::FILE *fp,
+                                        ulong64 &length);
+    extern void UnmapFile(const unsigned char *map, ulong64 length);
     extern bool GetFileTimes(const stringT &filename,
                              time_t &ctime, time_t &mtime, time_t &atime);
     extern bool SetFileTimes(const stringT &filename,
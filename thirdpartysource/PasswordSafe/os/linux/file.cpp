@@ -11,13 +11,21 @@
  */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <cassert>
-#include <fstream>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h> // for FICLONE
 
 #include <dirent.h>
 #include <fnmatch.h>
@@ -89,6 +97,118 @@ bool pws_os::RenameFile(const stringT &oldname, const stringT &newname)
   return (status == 0);
 }
 
+namespace {
+  // Directories that CopyAFile() has already made, or found there, so
+  // that backing up to the same place again doesn't mkdir() every
+  // component of the path each time
+  std::set<string> knownDirs;
+  std::mutex knownDirsMutex;
+
+  void MakeDirsFor(const string &path, bool recheck = false)
+  {
+    string::size_type stop = path.find_last_of('/');
+    if (stop == string::npos || stop == 0)
+      return;
+    const string dir(path, 0, stop);
+
+    std::lock_guard<std::mutex> guard(knownDirsMutex);
+    if (!recheck && knownDirs.find(dir) != knownDirs.end())
+      return;
+    stop = (dir[0] == '/') ? 1 : 0;
+    while ((stop = dir.find('/', stop)) != string::npos) {
+      ::mkdir(dir.substr(0, stop).c_str(), 0700); // fail if already there - who cares?
+      stop++;
+    }
+    if (::mkdir(dir.c_str(), 0700) == 0 || errno == EEXIST)
+      knownDirs.insert(dir);
+  }
+
+  // Last resort: plain reads and writes of whatever's past offset done
+  bool CopyBuffered(int in, int out, off_t done)
+  {
+    const size_t BUFSIZE = 1024 * 1024;
+    std::vector<char> buf(BUFSIZE);
+    for (;;) {
+      ssize_t n = ::pread(in, &buf[0], BUFSIZE, done);
+      if (n == 0)
+        return true;
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      for (ssize_t w = 0; w < n; ) {
+        ssize_t m = ::pwrite(out, &buf[w], n - w, done + w);
+        if (m < 0) {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+        w += m;
+      }
+      done += n;
+    }
+  }
+
+  bool CopyData(int in, int out, off_t size)
+  {
+#ifdef FICLONE
+    // On btrfs, XFS and the like, the copy shares the source's extents
+    // until one of them changes
+    if (::ioctl(out, FICLONE, in) == 0)
+      return true;
+#endif
+    off_t done = 0;
+#ifdef __NR_copy_file_range
+    // Copies within the kernel, server-side on network filesystems
+    for (loff_t inoff = 0, outoff = 0; done < size; ) {
+      long n = ::syscall(__NR_copy_file_range, in, &inoff, out, &outoff,
+                         size_t(size - done), 0U);
+      if (n <= 0)
+        break;
+      done += n;
+    }
+#endif
+    // Older kernels can't copy_file_range() across filesystems
+    if (done < size && ::lseek(out, done, SEEK_SET) == done) {
+      off_t off = done;
+      while (done < size) {
+        ssize_t n = ::sendfile(out, in, &off, size_t(size - done));
+        if (n <= 0)
+          break;
+        done += n;
+      }
+    }
+    return CopyBuffered(in, out, done);
+  }
+
+  bool CopyFileData(const char *from, const char *to)
+  {
+    int in = ::open(from, O_RDONLY);
+    if (in < 0)
+      return false;
+    struct stat st;
+    int out = -1;
+    if (::fstat(in, &st) == 0) {
+      const mode_t mode = st.st_mode & 0777;
+      out = ::open(to, O_WRONLY | O_CREAT | O_TRUNC, mode);
+      if (out < 0 && errno == ENOENT) { // directory went away since we made it?
+        MakeDirsFor(to, true);
+        out = ::open(to, O_WRONLY | O_CREAT | O_TRUNC, mode);
+      }
+    }
+    bool retval = (out >= 0) && CopyData(in, out, st.st_size);
+    if (out >= 0) {
+      if (::close(out) != 0)
+        retval = false;
+      if (!retval)
+        ::unlink(to);
+    }
+    ::close(in);
+    return retval;
+  }
+}
+
 bool pws_os::CopyAFile(const stringT &from, const stringT &to)
 {
   const char *szfrom = NULL;
@@ -108,32 +228,9 @@ bool pws_os::CopyAFile(const stringT &from, const stringT &to)
 #endif /* UNICODE */
   // can we read the source?
   bool readable = ::access(szfrom, R_OK) == 0;
-  if (!readable) {
-    retval = false;
-  } else { // creates dirs as needed
-
-    string cto(szto);
-    string::size_type start = (cto[0] == '/') ? 1 : 0;
-    string::size_type stop;
-    do {
-      stop = cto.find_first_of("/", start);
-      if (stop != stringT::npos)
-        ::mkdir(cto.substr(start, stop).c_str(), 0700); // fail if already there - who cares?
-      start = stop + 1;
-    } while (stop != stringT::npos);
-
-    ifstream src(szfrom, ios_base::in|ios_base::binary);
-    ofstream dst(szto, ios_base::out|ios_base::binary);
-    const size_t BUFSIZE = 2048;
-    char buf[BUFSIZE];
-    size_t readBytes;
-
-    do {
-      src.read(buf, BUFSIZE);
-      readBytes = src.gcount();
-      dst.write(buf, readBytes);
-    } while(readBytes != 0);
-    retval = true;
+  if (readable) {
+    MakeDirsFor(szto); // creates dirs as needed
+    retval = CopyFileData(szfrom, szto);
   }
 #ifdef UNICODE
   delete[] szfrom;
@@ -343,6 +440,68 @@ std::FILE *pws_os::FOpen(const stringT &filename, const TCHAR *mode)
   return retval;
 }
 
+bool pws_os::FSync(std::FILE *fd)
+{
+  return fflush(fd) == 0 && fsync(fileno(fd)) == 0;
+}
+
+std::FILE *pws_os::FOpenTemp(const stringT &filename, stringT &tmpname)
+{
+#ifdef UNICODE
+  size_t fnsize = wcstombs(NULL, filename.c_str(), 0) + 1;
+  assert(fnsize > 0);
+  char *cfname = new char[fnsize];
+  wcstombs(cfname, filename.c_str(), fnsize);
+  string tmpl(cfname);
+  delete[] cfname;
+#else
+  string tmpl(filename);
+#endif /* UNICODE */
+  // mkstemp() picks the name and creates the file in one step, so two
+  // saves of the same file never write to the same temporary
+  static const char SUFFIX[] = ".XXXXXX";
+  tmpl += SUFFIX;
+  vector<char> cname(tmpl.begin(), tmpl.end());
+  cname.push_back('\0');
+  const int fd = ::mkstemp(&cname[0]);
+  if (fd == -1)
+    return NULL;
+  FILE *retval = ::fdopen(fd, "wb");
+  if (retval == NULL) {
+    ::close(fd);
+    ::unlink(&cname[0]);
+    return NULL;
+  }
+  // The suffix is plain ASCII
+  tmpname = filename;
+  for (size_t i = cname.size() - sizeof(SUFFIX); cname[i] != '\0'; i++)
+    tmpname += TCHAR(cname[i]);
+  return retval;
+}
+
+bool pws_os::FSyncDir(const stringT &filename)
+{
+#ifdef UNICODE
+  size_t fnsize = wcstombs(NULL, filename.c_str(), 0) + 1;
+  assert(fnsize > 0);
+  char *cfname = new char[fnsize];
+  wcstombs(cfname, filename.c_str(), fnsize);
+  string path(cfname);
+  delete[] cfname;
+#else
+  string path(filename);
+#endif /* UNICODE */
+  const string::size_type stop = path.find_last_of('/');
+  const string dir = (stop == string::npos) ? string(".") :
+                     (stop == 0) ? string("/") : path.substr(0, stop);
+  const int fd = ::open(dir.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  const bool retval = (::fsync(fd) == 0);
+  ::close(fd);
+  return retval;
+}
+
 long pws_os::fileLength(std::FILE *fp)
 {
   int fd = fileno(fp);
@@ -354,3 +513,67 @@ long pws_os::fileLength(std::FILE *fp)
   return st.st_size;
 }
 
+namespace {
+  // Returns an fd for a clone of fd's file, made next to path (same
+  // filesystem) and unlinked at once, or -1 if the filesystem can't
+  // clone (FICLONE: btrfs, XFS and the like) or we can't write there.
+  int SnapshotFile(const char *path, int fd)
+  {
+#ifdef FICLONE
+    string tmpl(path);
+    tmpl += ".XXXXXX";
+    vector<char> cname(tmpl.begin(), tmpl.end());
+    cname.push_back('\0');
+    const int snap = ::mkstemp(&cname[0]);
+    if (snap == -1)
+      return -1;
+    ::unlink(&cname[0]);
+    if (::ioctl(snap, FICLONE, fd) == 0)
+      return snap;
+    ::close(snap);
+#else
+    (void)path;
+    (void)fd;
+#endif
+    return -1;
+  }
+}
+
+const unsigned char *pws_os::MapFile(const stringT &filename, std::FILE *fp,
+                                    ulong64 &length)
+{
+  length = 0;
+  int fd = fileno(fp);
+  if (fd == -1)
+    return NULL;
+#ifdef UNICODE
+  size_t fnsize = wcstombs(NULL, filename.c_str(), 0) + 1;
+  assert(fnsize > 0);
+  char *cfname = new char[fnsize];
+  wcstombs(cfname, filename.c_str(), fnsize);
+  const int snap = SnapshotFile(cfname, fd);
+  delete[] cfname;
+#else
+  const int snap = SnapshotFile(filename.c_str(), fd);
+#endif /* UNICODE */
+  const int mapfd = (snap != -1) ? snap : fd;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(mapfd, &st) == 0 && st.st_size > 0)
+    map = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, mapfd, 0);
+  if (snap != -1)
+    ::close(snap); // the mapping keeps the clone alive
+  if (map == MAP_FAILED)
+    return NULL;
+  // We parse front to back, once
+  madvise(map, size_t(st.st_size), MADV_SEQUENTIAL);
+  length = ulong64(st.st_size);
+  return static_cast<const unsigned char *>(map);
+}
+
+void pws_os::UnmapFile(const unsigned char *map, ulong64 length)
+{
+  if (map != NULL)
+    munmap(const_cast<unsigned char *>(map), size_t(length));
+}
+
@@ -26,3 +26,16 @@ bool pws_os::munlock(void *p, size_t size)
   return ::munlock(p, size) == 0;
 }
 
+void *pws_os::AllocSecurePages(size_t size)
+{
+  void *p = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  ::mlock(p, size); // best effort, see mem.h
+#ifdef MADV_DONTDUMP
+  ::madvise(p, size, MADV_DONTDUMP); // keep plaintext out of core files
+#endif
+  return p;
+}
+
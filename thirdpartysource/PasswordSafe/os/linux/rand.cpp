@@ -10,39 +10,88 @@
  * \file Linux-specific implementation of rand.h
  */
 #include "../rand.h"
-#include <fstream>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 
-using namespace std;
+// getrandom(2) when the kernel has it (3.17 and later), otherwise
+// /dev/urandom, kept open once it's been opened. getrandom() blocks
+// until the kernel's pool has been initialized, which only ever
+// happens once, early in boot, and never after that.
+static bool read_urandom(unsigned char *p, size_t len)
+{
+  static std::atomic<int> urandom_fd(-1);
+  int fd = urandom_fd;
+  if (fd < 0) {
+    // Not cached if it fails (e.g. out of fds), so we try again next time
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+    int expected = -1;
+    if (!urandom_fd.compare_exchange_strong(expected, fd)) {
+      close(fd); // another thread got there first
+      fd = expected;
+    }
+  }
+  while (len > 0) {
+    const ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= size_t(n);
+  }
+  return true;
+}
+
+static bool get_kernel_random(void *buf, size_t len)
+{
+  unsigned char *p = static_cast<unsigned char *>(buf);
+#ifdef SYS_getrandom
+  static std::atomic<bool> has_getrandom(true);
+  while (has_getrandom && len > 0) {
+    // No GRND_NONBLOCK: until the pool's initialized, /dev/urandom
+    // isn't any better, so waiting's the only safe thing to do
+    const long n = syscall(SYS_getrandom, p, len, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOSYS)
+        has_getrandom = false; // old kernel, don't try again
+      break;
+    }
+    p += n;
+    len -= size_t(n);
+  }
+  if (len == 0)
+    return true;
+#endif
+  return read_urandom(p, len);
+}
 
 bool pws_os::InitRandomDataFunction()
 {
-  // For starters, we won't rely on /dev/urandom, only on /dev/random for
-  // the seed. Returning false indicates this decision.
-  // Perhaps we can check for a hardware rng in future versions, and change
-  // the returned value accordingly?
-  return false;
+  // The kernel's rng is good, and cheap to get at, so PasswordSafe
+  // mixes it in with its own (see PWSrand).
+  unsigned char probe;
+  return get_kernel_random(&probe, sizeof(probe));
 }
 
 bool pws_os::GetRandomData(void *p, unsigned long len)
 {
-  // Return data from /dev/urandom
-  // Will not be used by PasswordSafe when InitRandomDataFunction()
-  // returns false!
-
-  ifstream is("/dev/urandom");
-  if (!is)
-    return false;
-  return is.read((char *)p, len);
+  return get_kernel_random(p, len);
 }
 
 static void get_failsafe_rnd(char * &p, unsigned &slen)
 {
   // This function will be called
-  // iff we couldn't get a minimal amount of entropy
-  // from the kernel's entropy pool.
+  // iff we couldn't get any entropy from the kernel.
   slen = sizeof(suseconds_t);
   p = new char[slen];
   struct timeval tv;
@@ -54,11 +103,12 @@ static void get_failsafe_rnd(char * &p, unsigned &slen)
 void pws_os::GetRandomSeed(void *p, unsigned &slen)
 {
   /**
-   * Return a cryptographically strong seed
-   * from /dev/random, if possible.
+   * Return a cryptographically strong seed from the kernel.
+   * Unlike /dev/random, this only waits until the kernel's pool has
+   * been initialized, not for its entropy estimate to fill up - at
+   * boot, or in a container, that can take a long time.
    *
-   * When called with p == NULL, return nuber of bytes currently
-   * in entropy pool.
+   * When called with p == NULL, return the seed's length.
    * To minimize TOCTTOU, we also read the data at this time,
    * and deliver it when called with non-NULL p.
    *
@@ -71,23 +121,13 @@ void pws_os::GetRandomSeed(void *p, unsigned &slen)
       delete[] data;
       data = NULL;
     }
-    ifstream ent_avail("/proc/sys/kernel/random/entropy_avail");
-    if (ent_avail) {
-      unsigned ent_bits;
-      if (ent_avail >> ent_bits && ent_bits >= 32) {
-        slen = ent_bits/8;
-        data = new char[slen];
-        ifstream rnd("/dev/random");
-        if (rnd.read(data, slen))
-          return;
-        else { // trouble reading
-          delete[] data;
-          data = NULL;
-          // will get randomness from failsafe.
-        }
-      }
-    }
-    // here if we had any trouble getting data from /dev/random
+    slen = 32;
+    data = new char[slen];
+    if (get_kernel_random(data, slen))
+      return;
+    delete[] data;
+    data = NULL;
+    // here if we had any trouble getting data from the kernel
     get_failsafe_rnd(data, slen);
   } else { // called with non-NULL p, just return our hard-earned entropy
     assert(data != NULL); // MUST call with p == NULL first!
@@ -95,4 +135,4 @@ void pws_os::GetRandomSeed(void *p, unsigned &slen)
     delete[] data;
     data = NULL;
   }
-}    
+}
@@ -26,6 +26,16 @@ bool pws_os::munlock(void *p, size_t size)
   return ::munlock(p, size) == 0;
 }
 
+void *pws_os::AllocSecurePages(size_t size)
+{
+  void *p = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  ::mlock(p, size); // best effort, see mem.h
+  return p;
+}
+
 // Following has OS support only in Windows
 bool pws_os::mcryptProtect(void *, size_t)
 {
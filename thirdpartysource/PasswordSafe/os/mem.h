@@ -18,6 +18,16 @@ namespace pws_os {
     extern bool mlock(void *p, size_t size);
     extern bool munlock(void *p, size_t size);
     
+    /**
+     * Returns size bytes (a multiple of the page size) of zeroed,
+     * page-aligned memory, locked in RAM and, where supported, kept
+     * out of core dumps. Locking is best-effort: if it fails (e.g.,
+     * RLIMIT_MEMLOCK), the pages are returned anyway.
+     * Returns NULL if the memory can't be mapped. Never freed, meant
+     * for long-lived pools.
+     */
+    extern void *AllocSecurePages(size_t size);
+    
     /**
      * Following are wrappers for Window's 'protect memory' functions,
      * that use an unspecified algorithm with an unspecified key
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+// ExpiredList.cpp
+// What PWScore uses of ExpiredList, for linking the tests: corelib's
+// ExpiredList.cpp isn't in this tree.
+//-----------------------------------------------------------------------------
+
+#include "../corelib/ExpiredList.h"
+
+#include <algorithm>
+
+ExpPWEntry::ExpPWEntry(const CItemData &ci)
+  : uuid(ci.GetUUID()), expirytttXTime(0)
+{
+  ci.GetXTime(expirytttXTime);
+}
+
+void ExpiredList::Add(const CItemData &ci)
+{
+  push_back(ExpPWEntry(ci));
+}
+
+void ExpiredList::Remove(const CItemData &ci)
+{
+  const pws_os::CUUID uuid = ci.GetUUID();
+  iterator iter = std::find_if(begin(), end(),
+                               [&uuid](ExpPWEntry &ee) {return ee.uuid == uuid;});
+  if (iter != end())
+    erase(iter);
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+// ItemMemoryTest.cpp
+// Memory benchmark for CItemData's field storage over a 50k-entry
+// database. Global operator new/delete are replaced to count what the
+// entries themselves allocate (StringX's SecureHeap isn't counted, and
+// holds nothing once an entry's built). Reports, per entry:
+// - heap blocks and bytes live after building the entries
+// - heap blocks allocated, and time taken, to copy them all
+// - time to read every field back, checking each against what was set
+// Build the same file against an older corelib to compare layouts.
+// Build against corelib and os/<platform>; exits non-zero on failure.
+//-----------------------------------------------------------------------------
+
+#include "../corelib/ItemData.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace {
+  size_t nBlocks = 0, nBytes = 0, nAllocs = 0;
+
+  // Each block carries its size in front of it, so delete can count it
+  const size_t HDR = 16;
+}
+
+void *operator new(size_t n)
+{
+  void *p = std::malloc(n + HDR);
+  if (p == NULL)
+    throw std::bad_alloc();
+  *static_cast<size_t *>(p) = n;
+  nBlocks++; nBytes += n; nAllocs++;
+  return static_cast<char *>(p) + HDR;
+}
+
+void operator delete(void *p) noexcept
+{
+  if (p == NULL)
+    return;
+  void *b = static_cast<char *>(p) - HDR;
+  nBlocks--; nBytes -= *static_cast<size_t *>(b);
+  std::free(b);
+}
+
+namespace {
+  const size_t N = 50000;
+
+  // Typical entry: every 4th has notes, every 8th's notes are long
+  StringX Field(int ft, size_t i)
+  {
+    wchar_t buf[512];
+    switch (ft) {
+    case CItemData::GROUP:
+      swprintf(buf, 512, L"Group %zu.Sub %zu", i % 40, i % 7); break;
+    case CItemData::TITLE:
+      swprintf(buf, 512, L"Entry %05zu", i); break;
+    case CItemData::USER:
+      swprintf(buf, 512, L"user%05zu@example.com", i); break;
+    case CItemData::PASSWORD:
+      swprintf(buf, 512, L"p%zuQ7!vX#k2wZ9e", i); break;
+    case CItemData::URL:
+      swprintf(buf, 512, L"https://www.example.com/login?id=%zu", i); break;
+    case CItemData::NOTES:
+      if (i % 4 != 0)
+        return StringX();
+      swprintf(buf, 512, L"Security question %zu: first pet's name. %ls", i,
+               i % 8 == 0 ? L"Account recovery goes through the help desk, "
+                            L"ticket reference on file since 2014; PIN is "
+                            L"kept on the card in the safe." : L"");
+      break;
+    default:
+      return StringX();
+    }
+    return buf;
+  }
+
+  const int fields[] = {CItemData::GROUP, CItemData::TITLE, CItemData::USER,
+                        CItemData::PASSWORD, CItemData::URL, CItemData::NOTES};
+  const size_t nFields = sizeof(fields) / sizeof(fields[0]);
+
+  double Since(std::chrono::steady_clock::time_point t0)
+  {
+    const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+    return dt.count();
+  }
+}
+
+int main()
+{
+  int failures = 0;
+  // Reserved up front, so the vector isn't counted: it's the same
+  // whatever the field layout
+  std::vector<CItemData> entries;
+  entries.reserve(N);
+
+  // Warm up CItem's session key and anything else allocated once
+  {CItemData ci; ci.SetTitle(L"x");}
+
+  const size_t blocks0 = nBlocks, bytes0 = nBytes;
+  for (size_t i = 0; i < N; i++) {
+    entries.push_back(CItemData());
+    CItemData &ci = entries.back();
+    ci.CreateUUID();
+    ci.SetGroup(Field(CItemData::GROUP, i));
+    ci.SetTitle(Field(CItemData::TITLE, i));
+    ci.SetUser(Field(CItemData::USER, i));
+    ci.SetPassword(Field(CItemData::PASSWORD, i));
+    ci.SetURL(Field(CItemData::URL, i));
+    ci.SetNotes(Field(CItemData::NOTES, i));
+    ci.SetCTime(1500000000 + i);
+    ci.SetPMTime(1500000000 + i);
+    ci.SetATime(1500000000 + i);
+  }
+  printf("%zu entries, sizeof(CItemData) %zu\n", N, sizeof(CItemData));
+  printf("live:  %.1f blocks, %.0f bytes per entry\n",
+         double(nBlocks - blocks0) / N, double(nBytes - bytes0) / N);
+
+  const size_t allocs0 = nAllocs;
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<CItemData> copy(entries); // the vector's one block isn't counted
+  const double tCopy = Since(t0);
+  printf("copy:  %.1f allocations per entry, %.0f ns per entry\n",
+         double(nAllocs - allocs0 - 1) / N, tCopy * 1e9 / N);
+
+  t0 = std::chrono::steady_clock::now();
+  size_t bad = 0;
+  for (size_t i = 0; i < N; i++) {
+    for (size_t f = 0; f < nFields; f++)
+      if (copy[i].GetFieldValue(static_cast<CItemData::FieldType>(fields[f])) !=
+          Field(fields[f], i))
+        bad++;
+    time_t t;
+    copy[i].GetPMTime(t);
+    if (t != time_t(1500000000 + i))
+      bad++;
+  }
+  const double tRead = Since(t0);
+  printf("read:  %.0f ns per entry (%zu fields)\n", tRead * 1e9 / N, nFields + 1);
+  if (bad != 0) {
+    printf("FAIL %zu fields read back differently\n", bad);
+    failures++;
+  }
+
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
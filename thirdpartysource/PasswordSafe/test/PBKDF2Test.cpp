@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+// PBKDF2Test.cpp
+// Checks and microbenchmark for pbkdf2_sha256(), which V4 key stretching
+// uses instead of the generic pbkdf2() over an HMAC<SHA256>:
+// - both get the RFC 7914 section 11 PBKDF2-HMAC-SHA256 answers
+// - both agree for output lengths that aren't a whole number of blocks
+// - pbkdf2_sha256_lanes(), which V4 uses to try every key block at once,
+//   agrees with pbkdf2_sha256() for 1..MAXLANES lanes, each with its own
+//   salt and iteration count
+// then reports iterations/sec for each, i.e., before and after the
+// pad midstates were kept across iterations (HMAC_SHA256_PRF).
+// The lanes run on AVX2 where the CPU has it; run again with
+// PWS_SHA_PORTABLE=1 in the environment to check the portable kernel.
+// Build against corelib and os/<platform>; exits non-zero on failure.
+//-----------------------------------------------------------------------------
+
+#include "../corelib/pbkdf2.h"
+#include "../corelib/hmac.h"
+#include "../corelib/sha256.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace {
+  typedef HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> HMAC_SHA256;
+
+  struct KAT {
+    const char *password, *salt;
+    int iterations;
+    const char *dk; // 64 bytes
+  };
+
+  const KAT kats[] = {
+    {"passwd", "salt", 1,
+     "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+     "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783"},
+    {"Password", "NaCl", 80000,
+     "4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56"
+     "a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d"},
+  };
+
+  std::string hex(const unsigned char *p, size_t n)
+  {
+    std::string s;
+    char b[3];
+    for (size_t i = 0; i < n; i++) {
+      snprintf(b, sizeof(b), "%02x", p[i]);
+      s += b;
+    }
+    return s;
+  }
+
+  std::string generic(const std::string &pw, const std::string &salt,
+                      int iterations, unsigned long len)
+  {
+    HMAC_SHA256 hmac;
+    unsigned char dk[128];
+    pbkdf2(reinterpret_cast<const unsigned char *>(pw.data()), pw.size(),
+           reinterpret_cast<const unsigned char *>(salt.data()), salt.size(),
+           iterations, &hmac, dk, &len);
+    return hex(dk, len);
+  }
+
+  std::string sha256(const std::string &pw, const std::string &salt,
+                     int iterations, unsigned long len)
+  {
+    unsigned char dk[128];
+    pbkdf2_sha256(reinterpret_cast<const unsigned char *>(pw.data()), pw.size(),
+                  reinterpret_cast<const unsigned char *>(salt.data()), salt.size(),
+                  iterations, dk, &len);
+    return hex(dk, len);
+  }
+
+  // Lane l gets salt "lane l salt..." and iterations[l] iterations
+  int CheckLanes(unsigned long len)
+  {
+    static const uint32 iterations[SHA256::MAXLANES] = {
+      1, 2, 1000, 3, 2048, 999, 4097, 17};
+    const std::string pw = "lanes password";
+    std::string salts[SHA256::MAXLANES];
+    const unsigned char *saltp[SHA256::MAXLANES];
+    unsigned long salt_lens[SHA256::MAXLANES];
+    unsigned char dk[SHA256::MAXLANES][100];
+    unsigned char *outs[SHA256::MAXLANES];
+    int failures = 0;
+
+    for (unsigned l = 0; l < SHA256::MAXLANES; l++) {
+      salts[l] = "lane " + std::to_string(l) + " salt" + std::string(l * 9, 's');
+      saltp[l] = reinterpret_cast<const unsigned char *>(salts[l].data());
+      salt_lens[l] = static_cast<unsigned long>(salts[l].size());
+      outs[l] = dk[l];
+    }
+    for (unsigned n = 1; n <= SHA256::MAXLANES; n++) {
+      memset(dk, 0, sizeof(dk));
+      pbkdf2_sha256_lanes(reinterpret_cast<const unsigned char *>(pw.data()), pw.size(),
+                          n, saltp, salt_lens, iterations, outs, len);
+      for (unsigned l = 0; l < n; l++) {
+        if (hex(dk[l], len) != sha256(pw, salts[l], iterations[l], len)) {
+          printf("FAIL lanes n = %u, lane %u, outlen %lu: differs from pbkdf2_sha256\n",
+                 n, l, len);
+          failures++;
+        }
+      }
+    }
+    return failures;
+  }
+
+  template <class F>
+  double ItersPerSec(F derive, int iterations)
+  {
+    const auto t0 = std::chrono::steady_clock::now();
+    derive(iterations);
+    const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+    return iterations / dt.count();
+  }
+}
+
+int main()
+{
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+    const KAT &k = kats[i];
+    const std::string g = generic(k.password, k.salt, k.iterations, 64);
+    const std::string s = sha256(k.password, k.salt, k.iterations, 64);
+    if (g != k.dk) {
+      printf("FAIL pbkdf2 \"%s\"/\"%s\": %s\n", k.password, k.salt, g.c_str());
+      failures++;
+    }
+    if (s != k.dk) {
+      printf("FAIL pbkdf2_sha256 \"%s\"/\"%s\": %s\n", k.password, k.salt, s.c_str());
+      failures++;
+    }
+  }
+
+  // Partial last block, long password (hashed down to a key first)
+  const std::string longpw(100, 'p');
+  const unsigned long lens[] = {1, 31, 32, 33, 100};
+  for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+    if (generic(longpw, "salt", 1000, lens[i]) != sha256(longpw, "salt", 1000, lens[i])) {
+      printf("FAIL outlen %lu: pbkdf2 and pbkdf2_sha256 differ\n", lens[i]);
+      failures++;
+    }
+  }
+
+  const bool portable = getenv("PWS_SHA_PORTABLE") != NULL;
+#if defined(__x86_64__) || defined(__i386__)
+  printf("lanes kernel: %s\n",
+         portable ? "portable" : __builtin_cpu_supports("avx2") ? "AVX2" : "portable (no AVX2)");
+#else
+  printf("lanes kernel: %s\n", portable ? "portable" : "native");
+#endif
+  // One block, and two with a partial second
+  failures += CheckLanes(32);
+  failures += CheckLanes(40);
+
+  const int N = 200000;
+  const std::string pw = "correct horse battery staple", salt(32, 's');
+  const double before = ItersPerSec([&](int n) {generic(pw, salt, n, 32);}, N);
+  const double after = ItersPerSec([&](int n) {sha256(pw, salt, n, 32);}, N);
+  printf("%d iterations: pbkdf2 %.0f/s, pbkdf2_sha256 %.0f/s (x%.2f)\n",
+         N, before, after, after / before);
+
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+// PWSrandTest.cpp
+// Checks and microbenchmark for PWSrand's ChaCha20 generator:
+// - the block function gets RFC 7539's answers (2.3.2, and A.1 #1,
+//   which has a zero key and counter, as Refill() lays the state out)
+// and what comes out of the generator:
+// - monobit: the fraction of 1 bits in 64MiB is within 4 sigma of 1/2
+// - chi-square of byte frequencies, 255 degrees of freedom, is below
+//   the 0.9999 quantile (347.7)
+// - RangeRand(n) hits every value in [0, n) about equally often
+// - distinct threads don't produce the same output
+// then reports GetRandomData() throughput for a few request sizes,
+// beside that of the SHA-256 generator it replaced, i.e., before and
+// after.
+// Build against corelib and os/<platform>; exits non-zero on failure.
+//-----------------------------------------------------------------------------
+
+#include "../corelib/PWSrand.h"
+#include "../corelib/sha256.h"
+#include "../os/rand.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace {
+  int failures = 0;
+
+  void check(bool ok, const char *what, double value)
+  {
+    printf("%-4s %-28s %.4f\n", ok ? "ok" : "FAIL", what, value);
+    if (!ok)
+      failures++;
+  }
+
+  struct KAT {
+    uint32 in[16];
+    unsigned char out[64];
+  };
+
+  const KAT kats[] = {
+    // RFC 7539 2.3.2: key 00:01:..:1f, block counter 1,
+    // nonce 00:00:00:09:00:00:00:4a:00:00:00:00
+    {{0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+      0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+      0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c,
+      0x00000001, 0x09000000, 0x4a000000, 0x00000000},
+     {0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+      0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+      0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03,
+      0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+      0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09,
+      0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+      0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9,
+      0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e}},
+    // RFC 7539 A.1 #1: zero key, block counter 0, zero nonce
+    {{0x61707865, 0x3320646e, 0x79622d32, 0x6b206574},
+     {0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90,
+      0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+      0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a,
+      0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+      0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d,
+      0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+      0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c,
+      0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86}},
+  };
+
+  void BlockKAT()
+  {
+    for (size_t i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+      unsigned char out[64];
+      PWSrand::ChaCha20Block(kats[i].in, out);
+      const bool ok = memcmp(out, kats[i].out, sizeof(out)) == 0;
+      printf("%-4s RFC 7539 block %zu\n", ok ? "ok" : "FAIL", i + 1);
+      if (!ok)
+        failures++;
+    }
+  }
+
+  // PWSrand's generator before ChaCha20: one SHA-256 per 32 bytes, the
+  // OS's rng xored in on every call
+  class OldPWSrand
+  {
+  public:
+    OldPWSrand()
+    {
+      m_IsInternalPRNG = !pws_os::InitRandomDataFunction();
+      unsigned slen = 0;
+      pws_os::GetRandomSeed(NULL, slen);
+      std::vector<unsigned char> p(slen);
+      pws_os::GetRandomSeed(&p[0], slen);
+      SHA256 s;
+      s.Update(&p[0], slen);
+      s.Final(K);
+    }
+
+    void GetRandomData(void * const buffer, unsigned long length)
+    {
+      if (!m_IsInternalPRNG)
+        pws_os::GetRandomData(buffer, length);
+      unsigned char *pb = static_cast<unsigned char *>(buffer);
+      while (length > 0) {
+        NextRandBlock();
+        const unsigned long n = length < SHA256::HASHLEN ? length : SHA256::HASHLEN;
+        for (unsigned long j = 0; j < n; j++)
+          pb[j] = m_IsInternalPRNG ? R[j] : pb[j] ^ R[j];
+        length -= n;
+        pb += n;
+      }
+    }
+
+  private:
+    void NextRandBlock()
+    {
+      SHA256 s;
+      s.Update(K, sizeof(K));
+      s.Final(R);
+      uint32 *Kp = reinterpret_cast<uint32 *>(K);
+      const uint32 *Rp = reinterpret_cast<const uint32 *>(R);
+      Kp[0]++;
+      for (unsigned i = 0; i < SHA256::HASHLEN / sizeof(uint32); i++)
+        Kp[i] += Rp[i];
+    }
+
+    bool m_IsInternalPRNG;
+    unsigned char K[SHA256::HASHLEN], R[SHA256::HASHLEN];
+  };
+
+  void Quality()
+  {
+    const size_t N = 64 << 20;
+    std::vector<unsigned char> buf(N);
+    PWSrand::GetInstance()->GetRandomData(&buf[0], static_cast<unsigned long>(N));
+
+    unsigned long long ones = 0, counts[256] = {0};
+    for (size_t i = 0; i < N; i++) {
+      counts[buf[i]]++;
+      for (unsigned char c = buf[i]; c != 0; c &= c - 1)
+        ones++;
+    }
+    const double bits = 8.0 * N;
+    const double z = (ones - bits / 2) / std::sqrt(bits / 4);
+    check(std::fabs(z) < 4, "monobit z-score", z);
+
+    double chi2 = 0;
+    const double expected = N / 256.0;
+    for (int i = 0; i < 256; i++)
+      chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
+    check(chi2 < 347.7, "byte chi-square (255 df)", chi2);
+
+    const unsigned n = 10, draws = 1000000;
+    unsigned long hits[n] = {0};
+    for (unsigned i = 0; i < draws; i++)
+      hits[PWSrand::GetInstance()->RangeRand(n)]++;
+    double rchi2 = 0;
+    for (unsigned i = 0; i < n; i++)
+      rchi2 += (hits[i] - draws / double(n)) * (hits[i] - draws / double(n)) / (draws / double(n));
+    check(rchi2 < 33.7, "RangeRand(10) chi-square", rchi2); // 9 df, 0.9999
+
+    unsigned char a[32], b[32];
+    PWSrand::GetInstance()->GetRandomData(a, sizeof(a));
+    std::thread t([&b] {PWSrand::GetInstance()->GetRandomData(b, sizeof(b));});
+    t.join();
+    check(memcmp(a, b, sizeof(a)) != 0, "threads differ", 0);
+  }
+
+  template <class R>
+  double MBPerSec(R *r, unsigned long size, std::vector<unsigned char> &buf)
+  {
+    const unsigned long total = 64ul << 20;
+    const unsigned long reps = total / size;
+    const auto t0 = std::chrono::steady_clock::now();
+    for (unsigned long j = 0; j < reps; j++)
+      r->GetRandomData(&buf[0], size);
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    return total / secs / 1e6;
+  }
+
+  void Throughput()
+  {
+    const unsigned long sizes[] = {4, 32, 4096, 1 << 20};
+    std::vector<unsigned char> buf(1 << 20);
+    OldPWSrand old;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      const double before = MBPerSec(&old, sizes[i], buf);
+      const double after = MBPerSec(PWSrand::GetInstance(), sizes[i], buf);
+      printf("GetRandomData(%7lu): SHA-256 %8.1f MB/s, ChaCha20 %8.1f MB/s (x%.1f)\n",
+             sizes[i], before, after, after / before);
+    }
+  }
+}
+
+int main()
+{
+  BlockKAT();
+  Quality();
+  Throughput();
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
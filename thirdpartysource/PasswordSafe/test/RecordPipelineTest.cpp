@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+// RecordPipelineTest.cpp
+// Checks PWScore's pipelined saving and loading (RecordPipeline) against
+// the serial paths, for V3 and V4, over a database whose entry count
+// isn't a whole number of batches:
+// - a save with workers writes the same decrypted record stream, field
+//   by field, as one without (RecordWriter)
+// - a load with workers gets the same entries as one without
+// PWS_RECORD_WORKERS is set here to choose the path, so this checks
+// both on any machine.
+// Build against corelib and os/<platform>; exits non-zero on failure.
+//-----------------------------------------------------------------------------
+
+#include "../corelib/PWScore.h"
+#include "../corelib/PWSfile.h"
+#include "../corelib/SecureHeap.h"
+#include "../corelib/sha256.h"
+#include "../os/env.h"
+#include "../os/file.h"
+
+#include <cstdio>
+#include <cwchar>
+#include <vector>
+
+namespace {
+  const size_t N = 1000; // 15 batches and a bit
+  const StringX passkey(L"RecordPipelineTest");
+
+  struct Field {
+    unsigned char type;
+    std::vector<unsigned char> data;
+    bool operator==(const Field &that) const
+    {return type == that.type && data == that.data;}
+  };
+
+  // Entries with more or fewer fields, some long
+  void AddEntries(PWScore &core)
+  {
+    for (size_t i = 0; i < N; i++) {
+      wchar_t buf[256];
+      CItemData ci;
+      ci.CreateUUID();
+      swprintf(buf, 256, L"Group %zu.Sub %zu", i % 13, i % 5);
+      ci.SetGroup(buf);
+      swprintf(buf, 256, L"Entry %zu", i);
+      ci.SetTitle(buf);
+      swprintf(buf, 256, L"user%zu", i);
+      ci.SetUser(buf);
+      swprintf(buf, 256, L"p%zu-Q7!vX#k2", i * 7919);
+      ci.SetPassword(buf);
+      if (i % 2 == 0) {
+        swprintf(buf, 256, L"https://example.com/%zu", i);
+        ci.SetURL(buf);
+      }
+      if (i % 3 == 0) {
+        StringX notes;
+        for (size_t j = 0; j <= i % 40; j++)
+          notes += L"A line of notes.\r\n";
+        ci.SetNotes(notes);
+      }
+      if (i % 5 == 0) {
+        swprintf(buf, 256, L"user%zu@example.com", i);
+        ci.SetEmail(buf);
+        ci.SetAutoType(L"\\u\\t\\p\\n");
+        ci.SetXTime(time_t(1600000000 + i));
+      }
+      if (i % 11 == 0)
+        ci.SetProtected(true);
+      ci.SetCTime(time_t(1500000000 + i));
+      ci.SetPMTime(time_t(1500000000 + 2 * i));
+      static_cast<CommandInterface *>(&core)->DoAddEntry(ci, NULL);
+    }
+  }
+
+  // Decrypted records, field by field, as they are in the file.
+  // V3 records end at a terminal block, V4's where the HMAC starts.
+  bool ReadFields(const StringX &fn, std::vector<Field> &fields)
+  {
+    std::FILE *fp = pws_os::FOpen(fn.c_str(), _T("rb"));
+    if (fp == NULL)
+      return false;
+    const ulong64 end = pws_os::fileLength(fp) - SHA256::HASHLEN;
+    pws_os::FClose(fp, false);
+
+    PWSfile::VERSION version = PWSfile::UNKNOWN_VERSION;
+    int status;
+    PWSfile *in = PWSfile::MakePWSfile(fn, passkey, version,
+                                       PWSfile::Read, status);
+    if (in == NULL || in->Open(passkey) != PWSfile::SUCCESS) {
+      delete in;
+      return false;
+    }
+    while (version != PWSfile::V40 || ulong64(in->GetOffset()) < end) {
+      Field f;
+      unsigned char *data = NULL;
+      size_t length = 0;
+      // <= 0 at V3's terminal block, as in CItemData::ReadRaw()
+      if (static_cast<signed long>(in->ReadField(f.type, data, length)) <= 0)
+        break;
+      f.data.assign(data, data + length);
+      SecureHeap::Free(data);
+      fields.push_back(f);
+    }
+    status = in->Close();
+    delete in;
+    return status == PWSfile::SUCCESS;
+  }
+
+  int Check(PWSfile::VERSION version, const wchar_t *suffix)
+  {
+    int failures = 0;
+    const StringX serial = StringX(L"RecordPipelineTest-serial.") + suffix;
+    const StringX piped = StringX(L"RecordPipelineTest-piped.") + suffix;
+
+    PWScore core;
+    core.NewFile(passkey);
+    core.SetHashIters(2048);
+    AddEntries(core);
+
+    pws_os::setenv("PWS_RECORD_WORKERS", "0");
+    const int rc0 = core.WriteFile(serial, version);
+    pws_os::setenv("PWS_RECORD_WORKERS", "3");
+    const int rc1 = core.WriteFile(piped, version);
+    if (rc0 != PWSfile::SUCCESS || rc1 != PWSfile::SUCCESS) {
+      printf("FAIL %ls: save failed (%d, %d)\n", suffix, rc0, rc1);
+      return 1;
+    }
+
+    std::vector<Field> f0, f1;
+    if (!ReadFields(serial, f0) || !ReadFields(piped, f1)) {
+      printf("FAIL %ls: can't read the saved records back\n", suffix);
+      failures++;
+    } else if (f0.empty() || !(f0 == f1)) {
+      printf("FAIL %ls: saves' records differ (%zu fields, %zu)\n",
+             suffix, f0.size(), f1.size());
+      failures++;
+    }
+
+    PWScore serialCore, pipedCore;
+    pws_os::setenv("PWS_RECORD_WORKERS", "0");
+    const int lrc0 = serialCore.ReadFile(serial, passkey);
+    pws_os::setenv("PWS_RECORD_WORKERS", "3");
+    const int lrc1 = pipedCore.ReadFile(serial, passkey);
+    if (lrc0 != PWScore::SUCCESS || lrc1 != PWScore::SUCCESS) {
+      printf("FAIL %ls: load failed (%d, %d)\n", suffix, lrc0, lrc1);
+      failures++;
+    } else if (serialCore.GetNumEntries() != N ||
+               pipedCore.GetNumEntries() != N) {
+      printf("FAIL %ls: loads got %zu, %zu entries\n", suffix,
+             size_t(serialCore.GetNumEntries()), size_t(pipedCore.GetNumEntries()));
+      failures++;
+    } else {
+      size_t bad = 0;
+      for (auto iter = serialCore.GetEntryIter();
+           iter != serialCore.GetEntryEndIter(); iter++) {
+        auto found = pipedCore.Find(iter->first);
+        if (found == pipedCore.GetEntryEndIter() || found->second != iter->second)
+          bad++;
+      }
+      if (bad != 0) {
+        printf("FAIL %ls: %zu entries loaded differently\n", suffix, bad);
+        failures++;
+      }
+    }
+    printf("%ls: %zu entries, %zu fields\n", suffix, N, f0.size());
+
+    pws_os::DeleteAFile(serial.c_str());
+    pws_os::DeleteAFile(piped.c_str());
+    return failures;
+  }
+}
+
+int main()
+{
+  int failures = 0;
+  failures += Check(PWSfile::V30, L"psafe3");
+  failures += Check(PWSfile::V40, L"psafe4");
+
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
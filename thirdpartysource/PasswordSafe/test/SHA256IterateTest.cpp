@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2003-2017 Rony Shapiro <ronys@pwsafe.org>.
+ * All rights reserved. Use of the code is allowed under the
+ * Artistic License 2.0 terms, as specified in the LICENSE file
+ * distributed with this code, or available from
+ * http://www.opensource.org/licenses/artistic-license-2.0.php
+ */
+// SHA256IterateTest.cpp
+// Checks and microbenchmark for SHA256::Iterate(), which V3 key
+// stretching uses to compute X = SHA256(X) n times:
+// - it gets the same X as the loop it replaced, one SHA256 object per
+//   round, for round counts on and around the edges
+// then reports rounds/sec for each, i.e., before and after.
+// Build against corelib and os/<platform>; exits non-zero on failure.
+//-----------------------------------------------------------------------------
+
+#include "../corelib/sha256.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+  // PWSfileV3::StretchKey's loop before SHA256::Iterate
+  void Loop(unsigned char X[SHA256::HASHLEN], uint32 n)
+  {
+    for (uint32 i = 0; i < n; i++) {
+      SHA256 H;
+      H.Update(X, SHA256::HASHLEN);
+      H.Final(X);
+    }
+  }
+
+  template <class F>
+  double RoundsPerSec(F iterate, uint32 n)
+  {
+    unsigned char X[SHA256::HASHLEN] = {0};
+    const auto t0 = std::chrono::steady_clock::now();
+    iterate(X, n);
+    const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+    return n / dt.count();
+  }
+}
+
+int main()
+{
+  int failures = 0;
+  const uint32 counts[] = {0, 1, 2, 3, 2048, 100000};
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    unsigned char a[SHA256::HASHLEN], b[SHA256::HASHLEN];
+    for (unsigned j = 0; j < SHA256::HASHLEN; j++)
+      a[j] = b[j] = static_cast<unsigned char>(j * 7 + counts[i]);
+    Loop(a, counts[i]);
+    SHA256::Iterate(b, counts[i]);
+    if (memcmp(a, b, sizeof(a)) != 0) {
+      printf("FAIL n = %u: Iterate differs from the loop\n", counts[i]);
+      failures++;
+    }
+  }
+
+  const uint32 N = 1u << 20;
+  const double before = RoundsPerSec(Loop, N);
+  const double after = RoundsPerSec(SHA256::Iterate, N);
+  printf("%u rounds: loop %.0f/s, Iterate %.0f/s (x%.2f)\n",
+         N, before, after, after / before);
+
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}